@@ -14,6 +14,21 @@
 
 ABSL_FLAG(bool, eval, true, "Run evaluator.");
 ABSL_FLAG(bool, print_stats, true, "Print timing stats.");
+ABSL_FLAG(uint64_t,
+          memo,
+          0,
+          "Results of pure functions cached per function by the vm, 0 is off.");
+
+ABSL_FLAG(bool, fold, true, "Fold constants before compiling.");
+ABSL_FLAG(bool, optimize, true, "Run optimization passes on the bytecode.");
+ABSL_FLAG(bool,
+          precompute,
+          false,
+          "Evaluate pure top-level lets at compile time.");
+ABSL_FLAG(bool,
+          parallel_compile,
+          false,
+          "Compile independent top-level functions on a thread pool.");
 
 namespace monkey {
 
@@ -22,7 +37,12 @@ const std::string kPrompt = ">> ";
 void StartReplComp() {
   std::string line;
   Compiler comp;
+  comp.SetConstantFolding(absl::GetFlag(FLAGS_fold));
+  comp.SetOptimization(absl::GetFlag(FLAGS_optimize));
+  if (absl::GetFlag(FLAGS_precompute)) comp.SetEvaluator(MakeEvaluator());
+  comp.SetParallel(absl::GetFlag(FLAGS_parallel_compile));
   VirtualMachine vm;
+  vm.SetMemoCapacity(absl::GetFlag(FLAGS_memo));
 
   while (true) {
     fmt::print(fmt::emphasis::bold | fmt::fg(fmt::color::red), kPrompt);
@@ -51,6 +71,7 @@ void StartReplComp() {
     fmt::print("{}\n", vm.Last().Inspect());
     if (absl::GetFlag(FLAGS_print_stats)) {
       fmt::print("{}\n", comp.timers().ReportAll());
+      fmt::print("Specialized ops: {}\n", comp.num_specialized());
     }
   }
 }
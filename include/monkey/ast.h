@@ -1,5 +1,8 @@
 #pragma once
 
+#include <absl/container/flat_hash_set.h>
+
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <string>
@@ -29,11 +32,15 @@ enum class NodeType {
   kInfixExpr,
   kIfExpr,
   kCallExpr,
+  kYieldExpr,
   // Statement
   kExprStmt,
   kLetStmt,
   kReturnStmt,
-  kBlockStmt
+  kBlockStmt,
+  kAssignStmt,
+  kWhileStmt,
+  kForStmt
 };
 
 std::string Repr(NodeType type);
@@ -190,6 +197,34 @@ struct IfExpr final : public NodeBase {
   BlockStmt false_block;
 };
 
+/// Reassigns a variable defined by an earlier let, `x = x + 1;`
+struct AssignStmt final : public NodeBase {
+  AssignStmt() : NodeBase{NodeType::kAssignStmt} {}
+  std::string String() const override;
+
+  Identifier name;
+  ExprNode expr;
+};
+
+/// Loops evaluate to null, the body does not open a new scope
+struct WhileStmt final : public NodeBase {
+  WhileStmt() : NodeBase{NodeType::kWhileStmt} {}
+  std::string String() const override;
+
+  ExprNode cond;
+  BlockStmt body;
+};
+
+struct ForStmt final : public NodeBase {
+  ForStmt() : NodeBase{NodeType::kForStmt} {}
+  std::string String() const override;
+
+  StmtNode init;
+  ExprNode cond;
+  StmtNode update;
+  BlockStmt body;
+};
+
 struct FuncLiteral final : public NodeBase {
   FuncLiteral() : NodeBase{NodeType::kFuncLiteral} {}
   std::string String() const override;
@@ -216,6 +251,13 @@ struct IndexExpr final : public NodeBase {
   ExprNode index;
 };
 
+struct YieldExpr final : public NodeBase {
+  YieldExpr() : NodeBase{NodeType::kYieldExpr} {}
+  std::string String() const override;
+
+  ExprNode value;
+};
+
 struct DictLiteral final : public NodeBase {
   DictLiteral() : NodeBase{NodeType::kDictLiteral} {}
   std::string String() const override;
@@ -226,6 +268,32 @@ struct DictLiteral final : public NodeBase {
 // Helper function to get the expression in ExprStmt
 const ExprNode& GetExpr(const StmtNode& node);
 
+/// Call fn on every statement in node, including the ones nested in if
+/// expressions and loops but not those in function literals, which belong to
+/// another scope
+using StmtFn = std::function<void(const StmtNode&)>;
+void VisitStmts(const AstNode& node, const StmtFn& fn);
+void VisitBlock(const BlockStmt& block, const StmtFn& fn);
+
+/// Names assigned anywhere in the scope of stmts
+absl::flat_hash_set<std::string> AssignedNames(
+    const std::vector<StmtNode>& stmts);
+
+/// An occurrence of a name, see VisitNames
+struct NameRef {
+  enum class Use { kRead, kCall, kDefine, kAssign };
+
+  absl::string_view name;
+  Use use{Use::kRead};
+  const FuncLiteral* func{nullptr};  // innermost literal, nullptr if none
+  size_t num_args{0};                // of a kCall
+};
+
+/// Call fn on every name in node, function literals included. A name called
+/// directly is a kCall instead of a kRead, lets and params are a kDefine.
+using NameFn = std::function<void(const NameRef&)>;
+void VisitNames(const AstNode& node, const NameFn& fn);
+
 // TODO: suspend for now
 // using ModifyFunc = std::function<ExprNode(ExprNode)>;
 // ExprNode Modify(const ExprNode& expr, const ModifyFunc& func);
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/strings/string_view.h>
+
+#include <array>
+#include <type_traits>
+#include <utility>
 
 #include "monkey/object.h"
 
@@ -13,13 +18,139 @@ enum class Builtin {
   kRest,
   kPush,
   kPuts,
+  kMap,
+  kFilter,
+  kReduce,
+  kEach,
+  kSortBy,
+  kGenerator,
+  kNext,
+  kTake,
+  kCollect,
+  kSpawn,
+  kChan,
+  kSend,
+  kRecv,
+  kPmap,
+  kPreduce,
   kNumBuiltins,
 };
 
 std::string Repr(Builtin bt);
 std::ostream& operator<<(std::ostream& os, Builtin bt);
 
-// Builtins
+// Builtins, the ones in Builtin come first followed by registered ones
 const std::vector<Object>& GetBuiltins();
+/// Whether the builtin has no effects and calls no functions, registered
+/// builtins never count as pure
+bool IsPureBuiltin(size_t index);
+/// Index of the builtin called name, or -1
+int FindBuiltin(absl::string_view name);
+
+/// Add a builtin visible to compilers and evaluators created afterwards and
+/// return its index. Registration is not synchronized with running code, so
+/// register everything at startup. Names must be unique.
+size_t RegisterBuiltin(BuiltinFunc func);
+inline size_t Register(std::string name, BuiltinFunc::Fn fn) {
+  return RegisterBuiltin({std::move(name), fn});
+}
+
+/// Conversion between Objects and the C++ types of typed builtins. kInvalid
+/// accepts any type.
+template <typename T>
+struct NativeType;
+
+template <>
+struct NativeType<IntType> {
+  static constexpr auto kType = ObjectType::kInt;
+  static IntType From(const Object& obj) { return obj.Cast<IntType>(); }
+  static Object To(IntType value) { return IntObj(value); }
+};
+
+template <>
+struct NativeType<BoolType> {
+  static constexpr auto kType = ObjectType::kBool;
+  static BoolType From(const Object& obj) { return obj.Cast<BoolType>(); }
+  static Object To(BoolType value) { return BoolObj(value); }
+};
+
+template <>
+struct NativeType<StrType> {
+  static constexpr auto kType = ObjectType::kStr;
+  static const StrType& From(const Object& obj) { return obj.Cast<StrType>(); }
+  static Object To(StrType value) { return StrObj(std::move(value)); }
+};
+
+template <>
+struct NativeType<Array> {
+  static constexpr auto kType = ObjectType::kArray;
+  static const Array& From(const Object& obj) { return obj.Cast<Array>(); }
+  static Object To(Array value) { return ArrayObj(std::move(value)); }
+};
+
+template <>
+struct NativeType<Object> {
+  static constexpr auto kType = ObjectType::kInvalid;
+  static const Object& From(const Object& obj) { return obj; }
+  static Object To(Object value) { return value; }
+};
+
+/// Errors of the generated argument checks
+Object WrongNumArgsError(size_t got, size_t want);
+Object ArgTypeError(const BuiltinFunc& func,
+                    size_t index,
+                    ObjectType want,
+                    ObjectType got);
+
+template <typename R, typename... Args, size_t... I>
+Object ApplyNative(const BuiltinFunc& self,
+                   absl::Span<const Object> args,
+                   std::index_sequence<I...>) {
+  const auto fn = reinterpret_cast<R (*)(Args...)>(self.target);
+  if constexpr (std::is_void_v<R>) {
+    fn(NativeType<std::decay_t<Args>>::From(args[I])...);
+    return NullObj();
+  } else {
+    return NativeType<std::decay_t<R>>::To(
+        fn(NativeType<std::decay_t<Args>>::From(args[I])...));
+  }
+}
+
+template <typename R, typename... Args>
+Object InvokeNative(const BuiltinFunc& self,
+                    absl::Span<const Object> args,
+                    Caller&) {
+  constexpr std::array<ObjectType, sizeof...(Args)> kTypes = {
+      NativeType<std::decay_t<Args>>::kType...};
+  if (args.size() != kTypes.size()) {
+    return WrongNumArgsError(args.size(), kTypes.size());
+  }
+  for (size_t i = 0; i < kTypes.size(); ++i) {
+    if (kTypes[i] != ObjectType::kInvalid && args[i].Type() != kTypes[i]) {
+      return ArgTypeError(self, i, kTypes[i], args[i].Type());
+    }
+  }
+  return ApplyNative<R, Args...>(
+      self, args, std::index_sequence_for<Args...>{});
+}
+
+/// Register a native function with parameters and result of type IntType,
+/// BoolType, StrType, Array or Object (any value). The arity and argument
+/// checks and the conversions are generated at compile time, e.g.
+///   Register("clamp", [](IntType x, IntType lo, IntType hi) -> IntType {
+///     return std::min(std::max(x, lo), hi);
+///   });
+template <typename R, typename... Args>
+size_t Register(std::string name, R (*fn)(Args...)) {
+  return RegisterBuiltin({std::move(name),
+                          &InvokeNative<R, Args...>,
+                          reinterpret_cast<BuiltinFunc::Erased>(fn)});
+}
+
+/// Lambdas must not capture so that they convert to a function pointer
+template <typename F>
+size_t Register(std::string name, F fn) {
+  return Register(std::move(name), +fn);
+}
 
 }  // namespace monkey
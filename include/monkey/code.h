@@ -1,7 +1,9 @@
 #pragma once
 
 #include <absl/container/inlined_vector.h>
+#include <absl/strings/string_view.h>
 
+#include <array>
 #include <cstring>
 #include <iosfwd>
 #include <string>
@@ -42,6 +44,20 @@ enum class Opcode : Byte {
   kGetBuiltin,
   kClosure,
   kGetFree,
+  kYield,
+  kCallBuiltin,
+  kCallGlobal,
+  kCurrentClosure,
+  // Specialized by the optimizer where the types of the operands are known,
+  // ints for the arithmetic and comparisons and a bool for the jump
+  kAddInt,
+  kSubInt,
+  kMulInt,
+  kEqInt,
+  kNeInt,
+  kGtInt,
+  kJumpNotTrueBool,
+  kWide,  // prefix, the next instruction has operands twice as wide
 };
 
 std::string Repr(Opcode op);
@@ -55,9 +71,76 @@ inline constexpr Opcode ToOpcode(Byte bt) noexcept {
   return static_cast<Opcode>(bt);
 }
 
+/// Name and operand widths of an opcode, indexed by opcode in kOpcodeInfos so
+/// that the emitter and decoders need neither a lookup nor a copy
+struct OpcodeInfo {
+  Opcode op;
+  absl::string_view name;
+  size_t num_operands{0};
+  std::array<size_t, 3> operand_bytes{};
+};
+
+inline constexpr size_t kNumOpcodes = size_t{ToByte(Opcode::kWide)} + 1;
+
+inline constexpr std::array<OpcodeInfo, kNumOpcodes> kOpcodeInfos = {{
+    {Opcode::kConst, "OpConst", 1, {2}},
+    {Opcode::kPop, "OpPop"},
+    {Opcode::kTrue, "OpTrue"},
+    {Opcode::kFalse, "OpFalse"},
+    {Opcode::kAdd, "OpAdd"},
+    {Opcode::kSub, "OpSub"},
+    {Opcode::kMul, "OpMul"},
+    {Opcode::kDiv, "OpDiv"},
+    {Opcode::kEq, "OpEq"},
+    {Opcode::kNe, "OpNe"},
+    {Opcode::kGt, "OpGt"},
+    {Opcode::kMinus, "OpMinus"},
+    {Opcode::kBang, "OpBang"},
+    {Opcode::kJumpNotTrue, "OpJumpNotTrue", 1, {2}},
+    {Opcode::kJump, "OpJump", 1, {2}},
+    {Opcode::kNull, "OpNull"},
+    {Opcode::kGetGlobal, "OpGetGlobal", 1, {2}},
+    {Opcode::kSetGlobal, "OpSetGlobal", 1, {2}},
+    {Opcode::kArray, "OpArray", 1, {2}},
+    {Opcode::kDict, "OpDict", 1, {2}},
+    {Opcode::kIndex, "OpIndex"},
+    {Opcode::kCall, "OpCall", 1, {1}},
+    {Opcode::kReturn, "OpReturn"},
+    {Opcode::kReturnVal, "OpReturnVal"},
+    {Opcode::kGetLocal, "OpGetLocal", 1, {1}},
+    {Opcode::kSetLocal, "OpSetLocal", 1, {1}},
+    {Opcode::kGetBuiltin, "OpGetBuiltin", 1, {2}},
+    {Opcode::kClosure, "OpClosure", 2, {2, 1}},
+    {Opcode::kGetFree, "OpGetFree", 1, {1}},
+    {Opcode::kYield, "OpYield"},
+    {Opcode::kCallBuiltin, "OpCallBuiltin", 2, {2, 1}},
+    {Opcode::kCallGlobal, "OpCallGlobal", 3, {2, 1, 2}},
+    {Opcode::kCurrentClosure, "OpCurrentClosure"},
+    {Opcode::kAddInt, "OpAddInt"},
+    {Opcode::kSubInt, "OpSubInt"},
+    {Opcode::kMulInt, "OpMulInt"},
+    {Opcode::kEqInt, "OpEqInt"},
+    {Opcode::kNeInt, "OpNeInt"},
+    {Opcode::kGtInt, "OpGtInt"},
+    {Opcode::kJumpNotTrueBool, "OpJumpNotTrueBool", 1, {2}},
+    {Opcode::kWide, "OpWide"},
+}};
+
+constexpr bool OpcodeInfosInOrder() {
+  for (size_t i = 0; i < kNumOpcodes; ++i) {
+    if (ToByte(kOpcodeInfos[i].op) != i) return false;
+  }
+  return true;
+}
+static_assert(OpcodeInfosInOrder(), "kOpcodeInfos must be indexed by opcode");
+
+inline constexpr const OpcodeInfo& GetOpcodeInfo(Opcode op) noexcept {
+  return kOpcodeInfos[ToByte(op)];
+}
+
 struct Definition {
-  std::string name;
-  absl::InlinedVector<size_t, 2> operand_bytes{};
+  absl::string_view name;
+  absl::InlinedVector<size_t, 3> operand_bytes{};
 
   std::string Repr() const;
   friend std::ostream& operator<<(std::ostream& os, const Definition& def);
@@ -66,7 +149,10 @@ struct Definition {
   size_t SumOperandBytes() const;
 };
 
-Definition LookupDefinition(Opcode op);
+/// Operands that do not fit their width are encoded behind an OpWide prefix,
+/// which doubles the width of every operand of the next instruction. Only the
+/// rare wide forms pay for it, narrow instructions decode as before.
+Definition LookupDefinition(Opcode op, bool wide = false);
 
 // Helper functions
 inline uint16_t SwapUint16Bytes(uint16_t n) {
@@ -83,4 +169,19 @@ inline uint16_t ReadUint16(const uint8_t* src) {
   return SwapUint16Bytes(n);
 }
 
+inline uint32_t SwapUint32Bytes(uint32_t n) {
+  return (n >> 24) | ((n >> 8) & 0xff00U) | ((n << 8) & 0xff0000U) | (n << 24);
+}
+
+inline void PutUint32(uint8_t* dst, uint32_t n) {
+  n = SwapUint32Bytes(n);
+  std::memcpy(dst, &n, sizeof(uint32_t));
+}
+
+inline uint32_t ReadUint32(const uint8_t* src) {
+  uint32_t n;
+  std::memcpy(&n, src, sizeof(uint32_t));
+  return SwapUint32Bytes(n);
+}
+
 }  // namespace monkey
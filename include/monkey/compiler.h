@@ -1,11 +1,20 @@
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/status/statusor.h>
+#include <absl/types/span.h>
+
+#include <functional>
+#include <tuple>
 
 #include "monkey/ast.h"
 #include "monkey/code.h"
+#include "monkey/folder.h"
 #include "monkey/instruction.h"
+#include "monkey/ir.h"
 #include "monkey/object.h"
+#include "monkey/optimizer.h"
 #include "monkey/symbol.h"
 #include "monkey/timer.h"
 
@@ -17,18 +26,69 @@ inline absl::Status MakeError(absl::string_view msg) {
 
 inline static const absl::Status kOkStatus = absl::OkStatus();
 
+/// The constant pool is append-only and shared between the compiler and every
+/// Bytecode it returned, so compiling more code never copies old constants and
+/// earlier Bytecode stays valid. Do not compile while another thread runs a
+/// Bytecode from the same compiler.
+using Constants = std::vector<Object>;
+using ConstantsPtr = std::shared_ptr<const Constants>;
+
+/// Index of every global defined so far by name, shared like the constants
+using GlobalNames = absl::flat_hash_map<std::string, size_t>;
+using GlobalNamesPtr = std::shared_ptr<const GlobalNames>;
+
 struct Bytecode {
-  Instruction ins;
-  std::vector<Object> consts;
+  InstructionPtr ins;
+  ConstantsPtr consts;
+  GlobalNamesPtr names;
 };
 
 class Compiler {
  public:
   Compiler();
 
+  /// Compile program and return the instructions emitted by this call only.
+  /// Globals and constants from previous calls remain visible, so this can be
+  /// called repeatedly (e.g. in a repl) with cost proportional to the new code
   absl::StatusOr<Bytecode> Compile(const Program& program);
 
   const auto& timers() const noexcept { return timers_; }
+  /// Number of calls replaced by the code of the function so far
+  size_t num_inlined() const noexcept { return num_inlined_; }
+  /// Number of function literals compiled without a closure so far
+  size_t num_lifted() const noexcept { return num_lifted_; }
+  /// Number of ops specialized for the types inferred for them by the last
+  /// call to Compile
+  size_t num_specialized() const noexcept { return num_specialized_; }
+
+  /// Run ConstantFolder on each program before code generation, on by
+  /// default. Only change it before the first call to Compile.
+  void SetConstantFolding(bool enabled) { fold_constants_ = enabled; }
+
+  /// Lift and inline calls to small functions, the ones bound to globals only
+  /// at top level since later programs may assign them, and run the passes of
+  /// PassManager on the code of each scope after code generation, on by
+  /// default. Only change it before the first call to Compile.
+  void SetOptimization(bool enabled) { optimize_ = enabled; }
+
+  /// Runs bytecode at compile time and returns the last value it popped, see
+  /// MakeEvaluator in vm.h
+  using Evaluator = std::function<absl::StatusOr<Object>(const Bytecode&)>;
+  /// Run the value of top-level lets that only depend on literals, pure
+  /// builtins and earlier top-level lets of pure functions or known values
+  /// through eval, so that they compile to a constant. A let keeps its code if
+  /// eval fails or returns something other than plain data. Off by default.
+  void SetEvaluator(Evaluator eval) { evaluator_ = std::move(eval); }
+  /// Number of lets replaced by their value so far
+  size_t num_evaluated() const noexcept { return num_evaluated_; }
+
+  /// Compile the function literals of top-level lets on DefaultThreadPool
+  /// before the rest of the program, those that only refer to their own name,
+  /// builtins and globals of earlier programs. The output is the same as when
+  /// compiling in order. Off by default.
+  void SetParallel(bool enabled) { parallel_ = enabled; }
+  /// Number of function literals compiled in parallel so far
+  size_t num_parallel() const noexcept { return num_parallel_; }
 
   // Emitted opcode and position in instruction
   struct Emitted {
@@ -36,10 +96,69 @@ class Compiler {
     size_t pos{};
   };
 
+  /// A small function bound by a let whose calls can be replaced by its code
+  struct Inlinable {
+    CompiledFunc func;
+    /// Arguments can only be substituted for parameters never assigned
+    bool assigns_params{false};
+  };
+
+  /// A local function literal that does not escape its scope, compiled with
+  /// the variables it reads from the scope as extra params after its own.
+  /// Calls push a closure constant followed by the arguments and those
+  /// variables, so that no closure is allocated.
+  struct Lifted {
+    size_t index{0};  // of the closure in the constant pool
+    /// The variables as resolved at the let, or the params holding them in
+    /// the body, so that a later let of the same name does not change them
+    std::vector<Symbol> free;
+    bool pure{false};
+    bool self{false};  // called from its own body
+  };
+
+  /// What LiftLets finds out about a let before its scope is compiled
+  struct LiftLet {
+    /// Names the literal reads other than its params, in order, and those
+    /// it defines itself
+    std::vector<std::string> reads;
+    absl::flat_hash_set<std::string> defines;
+  };
+
   struct Scope {
     Instruction ins;
     Emitted last;
     Emitted prev;
+    bool pure{true};  // see CompiledFunc::pure
+
+    /// Lets of function literals directly in this scope and never assigned,
+    /// the ones that compiled to an Inlinable by local index, and the locals
+    /// holding the locals of inlined code
+    absl::flat_hash_set<const LetStmt*> inline_lets;
+    absl::flat_hash_map<size_t, Inlinable> inlinable;
+    std::vector<size_t> inline_slots;
+
+    /// Lets of function literals that do not escape this scope, and the ones
+    /// that compiled to a Lifted by name
+    absl::flat_hash_map<const LetStmt*, LiftLet> lift_lets;
+    absl::flat_hash_map<std::string, Lifted> lifted;
+
+    /// Top-level lets whose value may be known at compile time
+    absl::flat_hash_set<const LetStmt*> known_lets;
+  };
+
+  /// A function literal compiled by a worker, which numbers the constants and
+  /// call sites it adds from 0 and its own global as self, see SetParallel
+  struct Precompiled {
+    std::unique_ptr<Compiler> worker;
+    absl::StatusOr<CompiledFunc> func;
+    size_t self{0};
+  };
+
+  /// A global whose value is known at compile time, see SetEvaluator
+  struct KnownGlobal {
+    size_t index{0};           // of its value in the constant pool
+    bool func{false};          // index is of the CompiledFunc of a closure
+    std::vector<size_t> deps;  // globals read or called by its code
   };
 
   /// Scope related
@@ -60,42 +179,133 @@ class Compiler {
   const SymbolTable& CurrTable() const { return *tables_.back(); }
 
   /// Returns the index of the added instruction
-  size_t Emit(Opcode op, const std::vector<int>& operands = {});
+  size_t Emit(Opcode op, absl::Span<const int> operands = {});
   size_t Emit(Opcode op, int operand);
 
  private:
   absl::Status CompileImpl(const AstNode& node);
 
-  /// Returns the index of the added object
+  /// Returns the index of the added object, or of an equal one added before
   size_t AddConstant(Object obj);
-  /// Returns the index of the added instruction
-  size_t AddInstruction(const Instruction& ins);
+  /// Constants are interned by type and value, compiled functions by their
+  /// code and frame layout, so repeated literals share one slot
+  using ConstKey = std::tuple<ObjectType, IntType, std::string>;
+  static absl::optional<ConstKey> MakeConstKey(const Object& obj);
 
   void SaveEmitted(Opcode op, size_t pos);
   void RemoveLastOp(Opcode expected);
   void ReplaceInstruction(size_t pos, const Instruction& ins);
-  void ChangeOperand(size_t pos, int operand);
+  /// Emit a forward jump with a placeholder target for ChangeOperand
+  size_t EmitJump(Opcode op);
+  /// Returns the number of bytes inserted before the end of the scope, which
+  /// is only non-zero when a jump had to be widened
+  size_t ChangeOperand(size_t pos, int operand);
+  /// Rewrite the scope with the jump at pos widened to target and every other
+  /// jump relocated, widening them as well if needed
+  size_t WidenJump(size_t pos, int target);
 
   /// Compile expression
   absl::Status CompileIfExpr(const ExprNode& expr);
+  absl::Status CompileValueBlock(const BlockStmt& block);
   absl::Status CompileCallExpr(const ExprNode& expr);
   absl::Status CompileIndexExpr(const ExprNode& expr);
   absl::Status CompileInfixExpr(const ExprNode& expr);
   absl::Status CompilePrefixExpr(const ExprNode& expr);
   absl::Status CompileIdentifier(const ExprNode& expr);
-  absl::Status CompileFuncLiteral(const ExprNode& expr);
+  /// A literal bound by a local let can call itself by name
+  absl::Status CompileFuncLiteral(const ExprNode& expr,
+                                  const std::string& name = {});
   /// Compile statement
   absl::Status CompileLetStmt(const StmtNode& stmt);
   absl::Status CompileExprStmt(const StmtNode& stmt);
   absl::Status CompileBlockStmt(const StmtNode& stmt);
   absl::Status CompileReturnStmt(const StmtNode& stmt);
+  absl::Status CompileAssignStmt(const StmtNode& stmt);
+  absl::Status CompileLoop(const ExprNode& cond,
+                           const BlockStmt& body,
+                           const StmtNode& update);
 
   void LoadSymbol(const Symbol& symbol);
 
+  /// Compile the body of literal in a new scope and optimize it, the free
+  /// symbols it captures are returned in free. A lifted literal takes them as
+  /// params instead. Otherwise name, if any, refers to the closure itself.
+  absl::StatusOr<CompiledFunc> CompileFunc(const FuncLiteral& literal,
+                                           std::vector<Symbol>& free,
+                                           const Lifted* lifted = nullptr,
+                                           const std::string& name = {});
+
+  /// Inlining, see Inlinable
+  void AddInlinable(const LetStmt& let, const Symbol& symbol);
+  void AddInlinable(const Symbol& symbol, CompiledFunc func);
+  const Inlinable* FindInlinable(const Symbol& symbol) const;
+  /// Returns false without emitting anything if the call cannot be inlined
+  /// The variables of a lifted callee are passed as extra arguments
+  absl::StatusOr<bool> CompileInlineCall(const CallExpr& call,
+                                         const Symbol& callee,
+                                         absl::Span<const Symbol> extra = {});
+
+  /// Lambda lifting, see Lifted. Returns false without emitting anything if
+  /// the let has to compile to a closure after all.
+  absl::StatusOr<bool> CompileLiftedLet(const LetStmt& let,
+                                        const Symbol& symbol);
+  absl::Status CompileLiftedCall(const CallExpr& call,
+                                 const std::string& name,
+                                 const Lifted& lifted);
+
+  /// Compile-time evaluation, see SetEvaluator. Returns false without
+  /// emitting anything if the value of let is not known.
+  absl::StatusOr<bool> CompileEvaluatedLet(const LetStmt& let);
+  /// Record the value of the global let whose code starts at start if it is
+  /// a single constant or closure
+  void AddKnownGlobal(const LetStmt& let, const Symbol& symbol, size_t start);
+  /// Drop the constants from index size on, which no Bytecode refers to yet
+  void DropConstants(size_t size);
+
+  /// Parallel compilation, see SetParallel. A worker resolves names in globals
+  /// and leaves them unchanged.
+  explicit Compiler(const SymbolTable& globals);
+  void PrecompileFuncs(const std::vector<StmtNode>& stmts);
+  /// Add the constants and call sites of task in the order the worker did
+  /// and renumber its code to match. Returns false without changes if the
+  /// literal has to be compiled here instead.
+  bool MergeFunc(Precompiled& task);
+
   std::vector<Scope> scopes_;
-  std::vector<Object> consts_;
+  std::shared_ptr<Constants> consts_;
+  absl::flat_hash_map<ConstKey, size_t> const_index_;
+  std::shared_ptr<GlobalNames> names_;
+  size_t num_call_sites_{0};  // inline cache slots handed out by OpCallGlobal
+
+  /// Purity analysis, a global let of a pure function literal makes the global
+  /// pure unless the program assigns it. The global being defined counts as
+  /// pure inside its own literal so that recursive functions can be pure.
+  absl::flat_hash_set<size_t> pure_globals_;
+  /// Names assigned anywhere in the program being compiled
+  absl::flat_hash_set<std::string> assigned_names_;
+  absl::optional<size_t> defining_;
+  bool last_func_pure_{false};
   std::vector<SymbolTablePtr> tables_;
 
+  ConstantFolder folder_;
+  bool fold_constants_{true};
+
+  PassManager passes_;
+  bool optimize_{true};
+  /// Global lets that can be inlined into top-level code
+  absl::flat_hash_map<size_t, Inlinable> inlinable_globals_;
+  size_t num_inlined_{0};
+  size_t num_lifted_{0};
+  size_t num_specialized_{0};
+
+  Evaluator evaluator_;
+  absl::flat_hash_map<size_t, KnownGlobal> known_globals_;
+  size_t num_evaluated_{0};
+
+  bool parallel_{false};
+  absl::flat_hash_map<const FuncLiteral*, Precompiled> precompiled_;
+  size_t num_parallel_{0};
+
   mutable TimerManager timers_;
 };
 
@@ -15,6 +15,10 @@ class Environment {
 
   Object Get(absl::string_view name) const;
   Object& Set(absl::string_view name, const Object& obj);
+  /// Only looks at this environment, not the outer ones
+  bool Contains(absl::string_view name) const { return store_.contains(name); }
+  /// The outermost environment, which holds the globals
+  bool IsGlobal() const noexcept { return outer_ == nullptr; }
 
   auto size() const noexcept { return store_.size(); }
   auto empty() const noexcept { return store_.empty(); }
@@ -19,6 +19,11 @@ class Evaluator {
   Object EvalIdentifier(const Identifier& ident, const Environment& env) const;
   Object EvalIfExpr(const IfExpr& expr, Environment& env) const;
   Object EvalBlockStmt(const BlockStmt& block, Environment& env) const;
+  Object EvalAssignStmt(const AssignStmt& stmt, Environment& env) const;
+  Object EvalLoop(const ExprNode& cond,
+                  const BlockStmt& body,
+                  const StmtNode& update,
+                  Environment& env) const;
   Object EvalDictLiteral(const DictLiteral& expr, Environment& env) const;
 
   std::vector<Object> EvalExprs(const std::vector<ExprNode>& exprs,
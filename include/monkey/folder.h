@@ -0,0 +1,57 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/status/statusor.h>
+
+#include <string>
+#include <vector>
+
+#include "monkey/ast.h"
+
+namespace monkey {
+
+/// AST pass run by the compiler before code generation. Operators whose
+/// operands are literals are evaluated with the same semantics as the vm, lets
+/// bound to literals and never assigned are substituted at every use in their
+/// scope, and if branches behind a constant condition are dropped. Anything
+/// that would fail at runtime (type mismatch, division by zero, overflow) is
+/// left alone so the error still happens when the code runs.
+///
+/// Globals persist across calls to Fold like in the compiler, until a program
+/// assigns them. They are only substituted at top level, never in function
+/// bodies, which would keep the old value after a later program assigns one.
+class ConstantFolder {
+ public:
+  ConstantFolder();
+
+  absl::StatusOr<Program> Fold(const Program& program);
+
+  /// Number of operators evaluated, identifiers substituted and branches
+  /// dropped so far
+  size_t num_folded() const noexcept { return num_folded_; }
+
+ private:
+  StmtNode FoldStmt(const StmtNode& stmt, bool conditional);
+  BlockStmt FoldBlock(const BlockStmt& block, bool conditional);
+  ExprNode FoldExpr(const ExprNode& expr);
+  ExprNode FoldIdentifier(const ExprNode& expr);
+  ExprNode FoldPrefixExpr(const PrefixExpr& expr);
+  ExprNode FoldInfixExpr(const InfixExpr& expr);
+  ExprNode FoldIfExpr(const IfExpr& expr);
+  ExprNode FoldFuncLiteral(const FuncLiteral& func);
+
+  void EnterScope(const std::vector<StmtNode>& stmts);
+  void ExitScope();
+
+  /// Literal bound to each name per function scope, the first one is global.
+  /// An invalid node marks a name that shadows outer ones but is not constant.
+  struct Scope {
+    absl::flat_hash_map<std::string, ExprNode> consts;
+    absl::flat_hash_set<std::string> assigned;  // anywhere in this scope
+  };
+  std::vector<Scope> scopes_;
+  size_t num_folded_{0};
+};
+
+}  // namespace monkey
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <absl/types/span.h>
+
+#include <memory>
+
 #include "monkey/code.h"
 
 namespace monkey {
@@ -16,10 +20,18 @@ struct Instruction {
   Byte ByteAt(size_t n) const { return bytes.at(n); }
   const Byte* BytePtr(size_t n) const { return &bytes.at(n); }
 
-  /// Encode opcode and also allocate enough space for operands
-  size_t EncodeOpcode(Opcode op, size_t total_bytes = 1);
+  /// Encode opcode, preceded by OpWide if wide, and also allocate enough space
+  /// for operands. total_bytes counts the prefix too.
+  size_t EncodeOpcode(Opcode op, size_t total_bytes = 1, bool wide = false);
   void EncodeOperand(size_t offset, size_t nbytes, int operand);
 
+  /// Encode op and its operands at the end in place, in the wide form if wide
+  /// is set or an operand does not fit. Returns the position of the
+  /// instruction, which is also that of the OpWide prefix.
+  size_t Emit(Opcode op,
+              absl::Span<const int> operands = {},
+              bool wide = false);
+
   std::string Repr() const;
   friend std::ostream& operator<<(std::ostream& os, const Instruction& ins);
 
@@ -46,13 +58,20 @@ struct Instruction {
   }
 };
 
+/// Instructions are immutable once compiled, so they are shared by refcount
+/// between Bytecode, compiled functions, closures and frames
+using InstructionPtr = std::shared_ptr<const Instruction>;
+
 struct Decoded {
-  absl::InlinedVector<int, 2> operands;
+  absl::InlinedVector<int, 3> operands;
   size_t nbytes{0};
 };
 
+/// Encode falls back to the wide form when an operand does not fit, EncodeWide
+/// always uses it (e.g. to patch a jump that was already widened)
 Instruction Encode(Opcode op, int operand);
 Instruction Encode(Opcode op, const std::vector<int>& operands = {});
+Instruction EncodeWide(Opcode op, const std::vector<int>& operands);
 Decoded Decode(const Definition& def,
                const Instruction& ins,
                size_t offset = 0);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <absl/container/inlined_vector.h>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "monkey/code.h"
+#include "monkey/instruction.h"
+
+namespace monkey {
+
+/// Instruction of the IR, keeps the stack machine semantics of the bytecode so
+/// operands are still implicit stack slots. Jumps never appear here, they are
+/// the edges between basic blocks.
+struct IrInst {
+  Opcode op;
+  absl::InlinedVector<int, 3> operands{};
+
+  std::string Repr() const;
+  friend bool operator==(const IrInst& lhs, const IrInst& rhs) {
+    return lhs.op == rhs.op && lhs.operands == rhs.operands;
+  }
+};
+
+inline constexpr size_t kNoBlock = std::numeric_limits<size_t>::max();
+
+/// Straight line code with a single entry. A block that returns ends with
+/// OpReturn or OpReturnVal and has no successor. A conditional block pops the
+/// condition at its end and goes to next if it is true and to target
+/// otherwise, bool_cond means the condition is known to be a bool. Any other
+/// block goes to next, the block without a successor is the end of the top
+/// level program.
+struct BasicBlock {
+  bool Returns() const noexcept;
+
+  std::vector<IrInst> insts;
+  size_t next{kNoBlock};
+  size_t target{kNoBlock};
+  bool cond{false};
+  bool bool_cond{false};
+};
+
+/// Control flow graph of the code of one scope, blocks[0] is the entry and the
+/// order of blocks is the layout used when lowering
+struct Cfg {
+  std::string Repr() const;
+
+  std::vector<BasicBlock> blocks;
+};
+
+/// Split ins into basic blocks at jump targets and after jumps and returns
+Cfg BuildCfg(const Instruction& ins);
+
+/// Encode the blocks back in order. Jumps to the following block are left out
+/// and jumps are only widened if their target does not fit. Jump targets are
+/// relative to the start of the scope the code is placed in at origin.
+Instruction LowerCfg(const Cfg& cfg, size_t origin = 0);
+
+}  // namespace monkey
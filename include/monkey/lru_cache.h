@@ -0,0 +1,60 @@
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <list>
+#include <utility>
+
+namespace monkey {
+
+/// Map with a bounded number of entries that evicts the least recently used
+/// one when full. Get and Put are O(1).
+template <typename K, typename V>
+class LruCache {
+ public:
+  explicit LruCache(size_t capacity) : capacity_{capacity} {}
+
+  size_t size() const noexcept { return entries_.size(); }
+  size_t capacity() const noexcept { return capacity_; }
+
+  /// Returns nullptr on a miss, a hit becomes the most recently used entry
+  const V* Get(const K& key) {
+    const auto it = index_.find(key);
+    if (it == index_.end()) return nullptr;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  /// Insert or replace the value of key as the most recently used entry
+  void Put(K key, V value) {
+    if (capacity_ == 0) return;
+
+    const auto it = index_.find(key);
+    if (it != index_.end()) {
+      it->second->second = std::move(value);
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return;
+    }
+
+    if (entries_.size() == capacity_) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    entries_.emplace_front(key, std::move(value));
+    index_.emplace(std::move(key), entries_.begin());
+  }
+
+  void Clear() {
+    index_.clear();
+    entries_.clear();
+  }
+
+ private:
+  using Entry = std::pair<K, V>;
+
+  size_t capacity_{0};
+  std::list<Entry> entries_;  // most recently used first
+  absl::flat_hash_map<K, typename std::list<Entry>::iterator> index_;
+};
+
+}  // namespace monkey
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/hash/hash.h>
 #include <absl/types/any.h>
 #include <absl/types/span.h>
 
+#include <deque>
 #include <functional>
 #include <memory>
 #include <string>
@@ -32,6 +34,8 @@ enum class ObjectType {
   kBuiltinFunc,
   kCompiled,
   kClosure,
+  kGenerator,
+  kChannel,
 };
 
 std::string Repr(ObjectType type);
@@ -100,9 +104,60 @@ struct Object {
 using Array = std::vector<Object>;
 using Dict = absl::flat_hash_map<Object, Object>;
 
+struct Task;
+using WaitQueue = std::deque<std::weak_ptr<Task>>;
+
+/// Interface for builtins that call back into the interpreter that invoked
+/// them, e.g. map or filter calling a user function on each element
+class Caller {
+ public:
+  virtual ~Caller() noexcept = default;
+
+  /// Call func with args, returns the result or an error object
+  virtual Object Call(const Object& func, absl::Span<const Object> args) = 0;
+
+  /// Run generator until its next yield and return the yielded value. Once the
+  /// generator finishes its state becomes kDone and the result is null.
+  virtual Object Resume(const Object& gen);
+
+  /// Schedule func to run as a new task, returns null or an error object
+  virtual Object Spawn(const Object& func);
+
+  /// Park the calling task on queue. The builtin returns right away and is
+  /// called again once the task is woken up. Returns false if the caller
+  /// cannot be suspended.
+  virtual bool Block(WaitQueue& queue);
+
+  /// Make the first live task waiting on queue runnable again
+  virtual void Wake(WaitQueue& queue);
+
+  /// Run task for every index in [0, n), possibly in parallel. Each task gets
+  /// its own Caller, so it must neither share that nor modify shared state.
+  using ParallelTask = std::function<void(size_t, Caller&)>;
+  virtual void Parallel(size_t n, const ParallelTask& task);
+};
+
+/// A native function stored as plain function pointers. Untyped builtins
+/// check their arguments themselves; typed ones (see Register in builtin.h)
+/// keep the user function in target and get a generated invoke that checks and
+/// unpacks the arguments before calling it.
 struct BuiltinFunc {
+  using Fn = Object (*)(absl::Span<const Object>, Caller&);
+  using Invoker = Object (*)(const BuiltinFunc&,
+                             absl::Span<const Object>,
+                             Caller&);
+  using Erased = void (*)();
+
+  BuiltinFunc(std::string name, Fn fn);
+  BuiltinFunc(std::string name, Invoker invoke, Erased target);
+
+  Object operator()(absl::Span<const Object> args, Caller& caller) const {
+    return invoke(*this, args, caller);
+  }
+
   std::string name;
-  std::function<Object(absl::Span<const Object>)> func;
+  Invoker invoke{nullptr};
+  Erased target{nullptr};
 };
 
 struct FuncObject {
@@ -115,10 +170,12 @@ struct FuncObject {
 
 struct CompiledFunc {
   std::string Inspect() const;
+  const Instruction& Ins() const noexcept { return *ins; }
 
-  Instruction ins;
+  InstructionPtr ins;
   size_t num_locals{0};
   size_t num_params{0};
+  bool pure{false};  // only calls pure builtins and pure globals, no yield
 };
 
 struct Closure {
@@ -128,9 +185,67 @@ struct Closure {
   std::vector<Object> free;
 };
 
+struct Frame {
+  const Instruction& Ins() const noexcept { return closure.func.Ins(); }
+
+  Closure closure;
+  size_t bp{0};   // base pointer
+  size_t ip{0};   // instruction pointer
+  size_t ret{0};  // sp after return, where the return value goes
+  bool memo{false};  // cache the return value for memo_args
+  Array memo_args{};
+};
+
+/// Frames and stack window of a suspended call chain, with each bp and ret
+/// relative to the start of stack
+struct Continuation {
+  std::vector<Frame> frames;
+  std::vector<Object> stack;
+};
+
+struct Generator {
+  enum class State { kCreated, kSuspended, kRunning, kDone };
+
+  Object func;
+  State state{State::kCreated};
+  Continuation cont;
+};
+
+using GeneratorPtr = std::shared_ptr<Generator>;
+
+/// A green thread, owns its continuation while not running
+struct Task {
+  Object func;  // invalid for the main program
+  bool started{false};
+  Continuation cont;
+};
+
+using TaskPtr = std::shared_ptr<Task>;
+
+struct Channel {
+  std::deque<Object> buffer;
+  size_t capacity{0};  // 0 for unbounded
+  WaitQueue senders;
+  WaitQueue receivers;
+};
+
+using ChannelPtr = std::shared_ptr<Channel>;
+
+/// Approximate number of bytes owned by obj including nested objects, used for
+/// memory accounting. State shared through pointers (generators, channels) is
+/// only counted the first time it is added to seen. Instructions are shared
+/// and never counted.
+using SeenSet = absl::flat_hash_set<const void*>;
+size_t ObjectBytes(const Object& obj, SeenSet& seen);
+size_t ObjectBytes(const Object& obj);
+size_t ContinuationBytes(const Continuation& cont, SeenSet& seen);
+
 bool IsObjTruthy(const Object& obj);
 bool IsObjError(const Object& obj) noexcept;
 bool IsObjHashable(const Object& obj) noexcept;
+/// Whether obj is or holds a generator or channel, which whoever uses them
+/// changes in place, so threads must not share them
+bool HasMutableState(const Object& obj);
 
 // Use these to create new objects
 Object NullObj();
@@ -147,6 +262,8 @@ Object QuoteObj(const ExprNode& expr);
 Object CompiledObj(CompiledFunc fn);
 Object CompiledObj(const std::vector<Instruction>& ins);
 Object ClosureObj(Closure cl);
+Object GeneratorObj(Object func);
+Object ChannelObj(size_t capacity);
 
 // Directly create object from ast node
 Object ToIntObj(const ExprNode& expr);
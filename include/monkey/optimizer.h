@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "monkey/instruction.h"
+#include "monkey/ir.h"
+#include "monkey/object.h"
+#include "monkey/timer.h"
+
+namespace monkey {
+
+/// The code of one scope while it is being optimized
+struct CodeUnit {
+  Cfg cfg;
+  size_t num_locals{0};
+  /// Code of a function, whose locals are only visible to its own frame. The
+  /// top level program is not, its values stay observable (e.g. the last
+  /// popped one), so only passes that keep them are run on it.
+  bool function{false};
+  /// Constants the code loads, which tells their types. May be null.
+  const std::vector<Object>* consts{nullptr};
+  /// Ops replaced by SpecializeTypes
+  size_t num_specialized{0};
+};
+
+/// Passes return the number of changes they made
+size_t ThreadJumps(CodeUnit& unit);
+size_t PropagateCopies(CodeUnit& unit);
+size_t EliminateDeadCode(CodeUnit& unit);
+/// Reuse values computed more than once in a block through new locals
+size_t EliminateCommonSubexprs(CodeUnit& unit);
+/// Infer which values are ints or bools from constants, operators and the
+/// locals they are stored in, through the whole cfg. Operators on two proven
+/// ints and jumps on a proven bool get the specialized opcode, which skips
+/// the type checks in the vm.
+size_t SpecializeTypes(CodeUnit& unit);
+
+class PassManager {
+ public:
+  using Pass = size_t (*)(CodeUnit& unit);
+
+  /// Starts with all the passes above
+  PassManager();
+
+  void Add(std::string name, Pass pass);
+  void Clear() { passes_.clear(); }
+
+  /// Run every pass in order, each timed under its name, and repeat until a
+  /// round changes nothing. Returns the total number of changes.
+  size_t Run(CodeUnit& unit, TimerManager& timers) const;
+
+  /// Optimize the code of a scope through its cfg, which replaces the one in
+  /// unit. The other fields are read by the passes, num_locals grows by the
+  /// number of locals they add.
+  Instruction Optimize(const Instruction& ins,
+                       CodeUnit& unit,
+                       TimerManager& timers) const;
+
+ private:
+  std::vector<std::pair<std::string, Pass>> passes_;
+};
+
+}  // namespace monkey
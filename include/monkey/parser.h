@@ -36,6 +36,9 @@ class Parser {
   StmtNode ParseLetStmt();
   StmtNode PasreExprStmt();
   StmtNode ParseReturnStmt();
+  StmtNode ParseAssignStmt();
+  StmtNode ParseWhileStmt();
+  StmtNode ParseForStmt();
   BlockStmt ParseBlockStmt();
 
   ExprNode ParseExpression(Precedence precedence);
@@ -48,6 +51,7 @@ class Parser {
   ExprNode ParseArrayLiteral();
 
   ExprNode ParseIfExpr();
+  ExprNode ParseYieldExpr();
   ExprNode ParsePrefixExpr();
   ExprNode ParseGroupedExpr();
   ExprNode PasrseCallExpr(const ExprNode& expr);
@@ -13,6 +13,7 @@ enum class SymbolScope {
   kLocal,
   kBuiltin,
   kFree,
+  kFunction,  // the closure being defined, see DefineFunctionName
 };
 
 std::string Repr(SymbolScope scope);
@@ -40,13 +41,25 @@ struct Symbol {
 
 using SymbolDict = absl::flat_hash_map<std::string, Symbol>;
 
+class SymbolTable;
+using SymbolTablePtr = std::unique_ptr<SymbolTable>;
+
 class SymbolTable {
  public:
   explicit SymbolTable(SymbolTable* outer = nullptr) : outer_{outer} {}
 
+  /// A global table layered on base, which must not change while this one is
+  /// in use, e.g. to compile on another thread. Names not defined here are
+  /// resolved in base, definitions are numbered after those of base.
+  static SymbolTablePtr Overlay(const SymbolTable& base);
+
   Symbol& Define(const std::string& name);
   Symbol& DefineBuiltin(const std::string& name, size_t index);
   Symbol& DefineFree(const Symbol& symbol);
+  /// Bind name to the closure of the function this table belongs to, so that
+  /// a local function literal can call itself. Params and locals of the same
+  /// name defined later shadow it.
+  Symbol& DefineFunctionName(const std::string& name);
   absl::optional<Symbol> Resolve(const std::string& name);
 
   size_t NumDefs() const noexcept { return num_defs_; }
@@ -63,8 +76,7 @@ class SymbolTable {
   size_t num_defs_{0};
   std::vector<Symbol> free_symbols_;
   SymbolTable* outer_{nullptr};
+  const SymbolTable* base_{nullptr};
 };
 
-using SymbolTablePtr = std::unique_ptr<SymbolTable>;
-
 }  // namespace monkey
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace monkey {
+
+/// A fixed size work-stealing thread pool. Every worker owns a queue, takes
+/// jobs from the front of its own queue and steals from the back of the
+/// others when it runs dry.
+class ThreadPool {
+ public:
+  /// A job gets the index of the worker running it, which can be used to pick
+  /// per-worker state without locking
+  using Job = std::function<void(size_t)>;
+
+  explicit ThreadPool(size_t num_workers);
+  /// Runs all queued jobs before joining the workers
+  ~ThreadPool() noexcept;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  size_t NumWorkers() const noexcept { return threads_.size(); }
+
+  /// Whether the calling thread is a worker of this pool
+  bool InWorker() const noexcept;
+
+  /// Queue job, jobs submitted from a worker go to its own queue
+  void Submit(Job job);
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+  };
+
+  void Work(size_t worker);
+  bool TryPop(size_t worker, Job& job);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_{0};     // round-robin queue for external submits
+  std::atomic<size_t> pending_{0};  // number of queued jobs
+  std::mutex mutex_;                // guards stop_ and sleeping workers
+  std::condition_variable cv_;
+  bool stop_{false};
+};
+
+/// Process wide pool with one worker per core, created on first use
+ThreadPool& DefaultThreadPool();
+
+}  // namespace monkey
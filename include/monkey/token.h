@@ -40,7 +40,10 @@ enum class TokenType {
   kIf,
   kElse,
   kReturn,
-  kColon
+  kColon,
+  kYield,
+  kWhile,
+  kFor,
 };
 
 std::string Repr(TokenType type);
@@ -1,29 +1,177 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 
-#include <stack>
+#include <deque>
+#include <limits>
+#include <vector>
 
 #include "monkey/compiler.h"
+#include "monkey/lru_cache.h"
 #include "monkey/object.h"
 
 namespace monkey {
 
-struct Frame {
-  const Instruction& Ins() const noexcept { return closure.func.ins; }
+/// Returned by Run and Continue when the budget ran out, see Continue
+absl::Status SuspendedError();
+bool IsSuspended(const absl::Status& status);
 
-  Closure closure;
-  size_t bp{0};  // base pointer
-  size_t ip{0};  // instruction pointer
+/// Memory accounting of a vm in bytes, see VirtualMachine::MemoryUsage
+struct MemoryStats {
+  size_t live{0};       // reachable from the stack, frames, globals and tasks
+  size_t peak{0};       // highest live bytes measured so far
+  size_t allocated{0};  // total charged by allocations, never decreases
 };
 
-class VirtualMachine {
+/// Memoization counters, see VirtualMachine::SetMemoCapacity
+struct MemoStats {
+  size_t hits{0};
+  size_t misses{0};
+};
+
+class VirtualMachine final : public Caller {
  public:
-  absl::Status Run(const Bytecode& bc);
+  /// Budget and quantum are counted in ticks, one for each call and backward
+  /// jump. Straight-line code between them is bounded by the program size.
+  static constexpr int64_t kUnlimited = std::numeric_limits<int64_t>::max();
+  /// Number of ticks a task runs before it is preempted
+  static constexpr size_t kQuantum = 1000;
+  /// Live bytes are measured by walking all roots, at the latest once this
+  /// many bytes (or the last live bytes if more) were allocated since the
+  /// previous walk, which keeps the cost proportional to allocation
+  static constexpr size_t kMinMeasureBytes = 256 << 10;
+
+  /// Run bc as the main task, switching to spawned tasks when it blocks or
+  /// uses up its quantum. Returns once the main task finishes; tasks that have
+  /// not finished by then keep running in later calls. Once budget ticks are
+  /// used up, returns SuspendedError() with all state kept for Continue.
+  absl::Status Run(const Bytecode& bc, int64_t budget = kUnlimited);
+
+  /// Clear all state of previous runs (stack, frames, globals, tasks, memory
+  /// counters and a suspended run) but keep the allocated stack slots and
+  /// global buckets, so that a pooled vm serves the next script without
+  /// allocating. The memory quota is kept.
+  void Reset();
+  /// Reset and run bc as if on a new vm
+  absl::Status Rebind(const Bytecode& bc, int64_t budget = kUnlimited);
+
+  /// Continue a suspended Run with a new budget
+  absl::Status Continue(int64_t budget = kUnlimited);
+  bool IsSuspended() const noexcept { return run_.main != nullptr; }
+
+  /// Limit live memory to bytes, Run fails once a measurement exceeds it
+  void SetMemoryQuota(size_t bytes) noexcept { quota_ = bytes; }
+  size_t MemoryQuota() const noexcept { return quota_; }
+  /// Measure live bytes now and return the counters
+  MemoryStats MemoryUsage();
+
+  /// Cache the results of functions the compiler marked pure and that have no
+  /// free variables, keyed by their arguments when all of them are hashable.
+  /// Each function gets an LRU table of capacity entries, 0 (the default)
+  /// turns memoization off. Tables are dropped whenever a global is set, and
+  /// memoization stops until Reset once a global holding a function is set,
+  /// functions compiled earlier may have been marked pure because they call it.
+  void SetMemoCapacity(size_t capacity);
+  const MemoStats& memo_stats() const noexcept { return memo_stats_; }
+
   const Object& StackTop(size_t offset = 0) const;
   const Object& Last() const;
 
+  /// Call a closure with args from native code (e.g. a builtin) and run it to
+  /// completion in a nested dispatch loop. Must be called while a Bytecode is
+  /// running (or after one ran) so that constants are available.
+  absl::StatusOr<Object> CallClosure(const Object& closure,
+                                     absl::Span<const Object> args);
+
+  /// Call the closure bound to a global of the bytecode that ran last, e.g. to
+  /// compile and run a script once and then call one of its functions per
+  /// request. Globals and other state persist between calls.
+  absl::StatusOr<Object> CallFunction(size_t index,
+                                      absl::Span<const Object> args);
+  absl::StatusOr<Object> CallFunction(absl::string_view name,
+                                      absl::Span<const Object> args);
+
+  /// Caller interface for higher-order builtins
+  Object Call(const Object& func, absl::Span<const Object> args) override;
+
+  /// Run a generator until it yields or returns. Its frames and stack window
+  /// are moved back onto the vm while it runs and moved out again on yield.
+  Object Resume(const Object& gen) override;
+
+  /// Scheduler interface for spawn and channel builtins
+  Object Spawn(const Object& func) override;
+  bool Block(WaitQueue& queue) override;
+  void Wake(WaitQueue& queue) override;
+
+  /// Run tasks on the default thread pool, each with a vm that shares the
+  /// constants and a copy of the globals of this one. Nested calls from a
+  /// pool worker run sequentially so that workers never wait on each other,
+  /// as do all tasks while a global holds a generator or channel. Tasks
+  /// cannot spawn, nothing would run the tasks they spawned.
+  void Parallel(size_t n, const ParallelTask& task) override;
+
  private:
+  /// Native code re-entering the vm, either a callback from a builtin or a
+  /// generator being resumed. yield suspends the frames above the innermost
+  /// entry, which therefore must be a generator.
+  struct Entry {
+    Generator* gen{nullptr};  // nullptr for a callback
+    size_t depth{0};          // number of frames on entry
+    size_t sp{0};             // sp on entry
+    Object value;             // last value yielded by gen
+  };
+
+  /// The Run in progress, kept while it is suspended
+  struct RunState {
+    TaskPtr main;
+    size_t depth{0};
+    size_t sp{0};
+  };
+
+  /// Run tasks until main finishes, fails or the budget runs out
+  absl::Status Schedule();
+
+  /// Charge a tick, returns whether the dispatch loop should return to
+  /// Schedule, which is only possible when no native code is on the stack
+  bool Tick() {
+    --fuel_;
+    if (--quantum_ == 0) {
+      quantum_ = kQuantum;
+      if (entries_.empty() && !run_queue_.empty()) return true;
+    }
+    return fuel_ <= 0 && entries_.empty();
+  }
+
+  /// Account for bytes allocated by an instruction or builtin, measures live
+  /// memory once enough was allocated or the quota may have been exceeded
+  absl::Status Charge(size_t bytes) {
+    memory_.allocated += bytes;
+    since_measure_ += bytes;
+    const auto estimate = memory_.live + since_measure_;
+    if (since_measure_ < measure_at_ && estimate <= quota_) return kOkStatus;
+    return Measure();
+  }
+
+  /// Walk all roots to update live bytes, fails if they exceed the quota
+  absl::Status Measure();
+  size_t LiveBytes() const;
+
+  /// Dispatch loop, runs until the number of frames drops to depth
+  absl::Status Execute(size_t depth);
+  /// Drop frames above depth and restore sp after a failed call
+  void Unwind(size_t depth, size_t sp);
+
+  /// Move frames above depth and the stack above sp into cont
+  void Suspend(size_t depth, size_t sp, Continuation& cont);
+  /// Move frames and stack of cont back on top of the vm
+  void Restore(Continuation& cont);
+
+  /// Start or restore the next runnable task
+  absl::Status SwitchTask();
+  /// Remove task from the run queue and the blocked set
+  void DropTask(const TaskPtr& task);
+
   absl::Status ExecBinaryOp(Opcode op);
   absl::Status ExecIntBinaryOp(const Object& lhs, Opcode op, const Object& rhs);
   absl::Status ExecStrBinaryOp(const Object& lhs, Opcode op, const Object& rhs);
@@ -33,11 +181,35 @@ class VirtualMachine {
 
   absl::Status ExecComparison(Opcode op);
   absl::Status ExecIntComp(const Object& lhs, Opcode op, const Object& rhs);
+  /// Ops specialized for int operands
+  void ExecIntOp(Opcode op);
 
   absl::Status ExecIndexExpr(const Object& lhs, const Object& index);
   absl::Status ExecDictIndex(const Object& lhs, const Object& index);
   absl::Status ExecArrayIndex(const Object& lhs, const Object& index);
   absl::Status ExecFuncCall(const Object& func, size_t num_args);
+  /// Call the global at index with the num_args values on top of the stack,
+  /// using the inline cache in slot
+  absl::Status ExecGlobalCall(size_t index, size_t num_args, size_t slot);
+  /// Push a frame for closure whose num_args arguments are on top of the stack
+  /// and whose return value goes to ret
+  absl::Status CallFrame(const Closure& closure, size_t num_args, size_t ret);
+
+  /// Memo table of func, cleared if a global was set since it was last used
+  LruCache<Array, Object>& MemoCache(const CompiledFunc& func);
+  /// Cache the return value of a memoized frame
+  void Memoize(Frame& frame, const Object& value);
+  /// Pop the top of the stack into global index
+  void SetGlobal(size_t index);
+  /// Call builtin with the num_args values on top of the stack, which is then
+  /// popped down to base before the result is pushed
+  absl::Status ExecBuiltinCall(const BuiltinFunc& builtin,
+                               size_t num_args,
+                               size_t base);
+
+  /// Replace the num_free values on top of the stack by a closure over the
+  /// compiled function at constant index
+  absl::Status ExecClosure(size_t index, size_t num_free);
 
   Object BuildArray(size_t size);
   Object BuildDict(size_t size);
@@ -50,16 +222,62 @@ class VirtualMachine {
   Frame PopFrame();
   void PushFrame(Frame frame);
 
-  const Frame& CurrFrame() const { return frames_.top(); }
-  Frame& CurrFrame() { return frames_.top(); }
+  const Frame& CurrFrame() const { return frames_.back(); }
+  Frame& CurrFrame() { return frames_.back(); }
 
   void AllocateLocal(size_t num_locals);
 
   size_t sp_{0};  // sp -> last, sp-1 -> top
   Object last_;
+  ConstantsPtr consts_;
+  GlobalNamesPtr names_;
   std::deque<Object> stack_;
-  std::stack<Frame> frames_;
-  absl::flat_hash_map<int, Object> globals_;
+  std::deque<Frame> frames_;  // deque keeps references stable on push
+  std::vector<Entry> entries_;
+
+  TaskPtr curr_task_;
+  std::deque<TaskPtr> run_queue_;
+  bool worker_{false};  // runs a task of Parallel
+  absl::flat_hash_set<TaskPtr> blocked_tasks_;
+  bool blocked_{false};  // set when the running task blocks in a builtin
+  size_t quantum_{kQuantum};
+  int64_t fuel_{kUnlimited};
+  RunState run_;
+  MemoryStats memory_;
+  size_t since_measure_{0};  // bytes charged since the last measurement
+  size_t measure_at_{kMinMeasureBytes};
+  size_t quota_{std::numeric_limits<size_t>::max()};
+  // Indexed by global, deque keeps references stable for the call caches
+  std::deque<Object> globals_;
+
+  /// Inline cache of an OpCallGlobal site. It is valid while no global was set
+  /// since it was filled, and index and num_args also have to match because
+  /// slots of different compilers may collide.
+  struct CallCache {
+    const Closure* closure{nullptr};
+    size_t epoch{0};
+    size_t index{0};
+    size_t num_args{0};
+  };
+  std::vector<CallCache> call_caches_;
+  size_t globals_epoch_{1};  // bumped whenever a global is set
+
+  /// Keyed by the instructions of a function, which the table keeps alive so
+  /// that the address is not reused by another function
+  struct MemoTable {
+    InstructionPtr ins;
+    size_t epoch{0};
+    LruCache<Array, Object> cache;
+  };
+  absl::flat_hash_map<const Instruction*, MemoTable> memo_;
+  size_t memo_capacity_{0};
+  bool memo_stopped_{false};  // a global holding a function was set
+  MemoStats memo_stats_;
 };
 
+/// Evaluator for Compiler::SetEvaluator that runs each program on a new vm,
+/// giving up after budget ticks or once live memory exceeds quota bytes
+Compiler::Evaluator MakeEvaluator(int64_t budget = 1 << 20,
+                                  size_t quota = size_t{64} << 20);
+
 }  // namespace monkey
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <absl/status/statusor.h>
+#include <absl/types/span.h>
+
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "monkey/thread_pool.h"
+#include "monkey/vm.h"
+
+namespace monkey {
+
+/// Calls the entry function of one Bytecode on a pool of worker threads. Every
+/// worker owns a VirtualMachine with its own stack, frames and globals, so the
+/// only state shared between threads is read-only: the instructions and
+/// constants of the Bytecode (which must not be compiled into meanwhile) and
+/// the builtins. Objects only share immutable data (e.g. the instructions of a
+/// closure) through shared_ptr, copying them across threads is safe.
+class VirtualMachinePool {
+ public:
+  using Args = std::vector<Object>;
+  using Result = absl::StatusOr<Object>;
+
+  /// Run bc once on each of num_workers vms. The value of its last expression
+  /// statement must be a function, which becomes the entry function.
+  static absl::StatusOr<std::unique_ptr<VirtualMachinePool>> Create(
+      const Bytecode& bc,
+      size_t num_workers);
+
+  size_t NumWorkers() const noexcept { return workers_.size(); }
+
+  /// Call the entry function with args on any worker
+  std::future<Result> Invoke(Args args);
+
+  /// Call the entry function on every input and wait for all of them, results
+  /// are in the order of inputs. Must not be called from the entry function.
+  std::vector<Result> InvokeAll(absl::Span<const Args> inputs);
+
+ private:
+  struct Worker {
+    VirtualMachine vm;
+    Object entry;
+  };
+
+  explicit VirtualMachinePool(std::vector<std::unique_ptr<Worker>> workers);
+
+  Result Call(size_t worker, absl::Span<const Object> args);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  ThreadPool pool_;  // declared last so that it is joined first
+};
+
+}  // namespace monkey
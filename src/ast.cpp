@@ -2,6 +2,7 @@
 
 #include <absl/container/flat_hash_map.h>
 #include <absl/strings/str_join.h>
+#include <absl/strings/strip.h>
 #include <fmt/core.h>
 
 namespace monkey {
@@ -28,10 +29,14 @@ const auto gNodeTypeStrings = absl::flat_hash_map<NodeType, std::string>{
     {NodeType::kIndexExpr, "IndexExpr"},
     {NodeType::kFuncLiteral, "FuncLiteral"},
     {NodeType::kCallExpr, "CallExpr"},
+    {NodeType::kYieldExpr, "YieldExpr"},
     {NodeType::kExprStmt, "ExprStmt"},
     {NodeType::kLetStmt, "LetStmt"},
     {NodeType::kReturnStmt, "ReturnStmt"},
-    {NodeType::kBlockStmt, "BlockStmt"}};
+    {NodeType::kBlockStmt, "BlockStmt"},
+    {NodeType::kAssignStmt, "AssignStmt"},
+    {NodeType::kWhileStmt, "WhileStmt"},
+    {NodeType::kForStmt, "ForStmt"}};
 }  // namespace
 
 std::string Repr(NodeType type) { return gNodeTypeStrings.at(type); }
@@ -83,6 +88,23 @@ std::string IfExpr::String() const {
   return str;
 }
 
+std::string AssignStmt::String() const {
+  return fmt::format("{} = {};", name.String(), expr.String());
+}
+
+std::string WhileStmt::String() const {
+  return fmt::format("while {} {}", cond.String(), body.String());
+}
+
+std::string ForStmt::String() const {
+  // init ends with ; already, update is printed without it
+  return fmt::format("for ({} {}; {}) {}",
+                     init.String(),
+                     cond.String(),
+                     std::string(absl::StripSuffix(update.String(), ";")),
+                     body.String());
+}
+
 std::string BlockStmt::String() const {
   return fmt::format("{}", absl::StrJoin(statements, "; ", NodeFmt()));
 }
@@ -111,16 +133,232 @@ const ExprNode& GetExpr(const StmtNode& node) {
       return node.PtrCast<LetStmt>()->expr;
     case NodeType::kReturnStmt:
       return node.PtrCast<ReturnStmt>()->expr;
+    case NodeType::kAssignStmt:
+      return node.PtrCast<AssignStmt>()->expr;
     default:
       throw std::runtime_error(
-          "GetExpr can only be called on ExprStmt, LetStmt and ReturnStmt");
+          "GetExpr can only be called on ExprStmt, LetStmt, ReturnStmt and "
+          "AssignStmt");
+  }
+}
+
+void VisitBlock(const BlockStmt& block, const StmtFn& fn) {
+  for (const auto& stmt : block.statements) VisitStmts(stmt, fn);
+}
+
+void VisitStmts(const AstNode& node, const StmtFn& fn) {
+  switch (node.Type()) {
+    case NodeType::kLetStmt:
+    case NodeType::kAssignStmt:
+    case NodeType::kExprStmt:
+    case NodeType::kReturnStmt:
+      fn(node);
+      VisitStmts(GetExpr(node), fn);
+      break;
+    case NodeType::kWhileStmt: {
+      fn(node);
+      const auto* ptr = node.PtrCast<WhileStmt>();
+      VisitStmts(ptr->cond, fn);
+      VisitBlock(ptr->body, fn);
+      break;
+    }
+    case NodeType::kForStmt: {
+      fn(node);
+      const auto* ptr = node.PtrCast<ForStmt>();
+      VisitStmts(ptr->init, fn);
+      VisitStmts(ptr->cond, fn);
+      VisitStmts(ptr->update, fn);
+      VisitBlock(ptr->body, fn);
+      break;
+    }
+    case NodeType::kIfExpr: {
+      const auto* ptr = node.PtrCast<IfExpr>();
+      VisitStmts(ptr->cond, fn);
+      VisitBlock(ptr->true_block, fn);
+      VisitBlock(ptr->false_block, fn);
+      break;
+    }
+    case NodeType::kPrefixExpr:
+      VisitStmts(node.PtrCast<PrefixExpr>()->rhs, fn);
+      break;
+    case NodeType::kInfixExpr: {
+      const auto* ptr = node.PtrCast<InfixExpr>();
+      VisitStmts(ptr->lhs, fn);
+      VisitStmts(ptr->rhs, fn);
+      break;
+    }
+    case NodeType::kCallExpr: {
+      const auto* ptr = node.PtrCast<CallExpr>();
+      VisitStmts(ptr->func, fn);
+      for (const auto& arg : ptr->args) VisitStmts(arg, fn);
+      break;
+    }
+    case NodeType::kIndexExpr: {
+      const auto* ptr = node.PtrCast<IndexExpr>();
+      VisitStmts(ptr->lhs, fn);
+      VisitStmts(ptr->index, fn);
+      break;
+    }
+    case NodeType::kArrayLiteral:
+      for (const auto& elem : node.PtrCast<ArrayLiteral>()->elements) {
+        VisitStmts(elem, fn);
+      }
+      break;
+    case NodeType::kDictLiteral:
+      for (const auto& [k, v] : node.PtrCast<DictLiteral>()->pairs) {
+        VisitStmts(k, fn);
+        VisitStmts(v, fn);
+      }
+      break;
+    case NodeType::kYieldExpr:
+      VisitStmts(node.PtrCast<YieldExpr>()->value, fn);
+      break;
+    default:
+      break;
+  }
+}
+
+absl::flat_hash_set<std::string> AssignedNames(
+    const std::vector<StmtNode>& stmts) {
+  absl::flat_hash_set<std::string> names;
+  for (const auto& stmt : stmts) {
+    VisitStmts(stmt, [&](const StmtNode& node) {
+      if (node.Type() == NodeType::kAssignStmt) {
+        names.insert(node.PtrCast<AssignStmt>()->name.value);
+      }
+    });
+  }
+  return names;
+}
+
+namespace {
+
+void VisitNamesIn(const AstNode& node,
+                  const NameFn& fn,
+                  const FuncLiteral* func) {
+  using Use = NameRef::Use;
+  const auto visit = [&](const AstNode& child) {
+    VisitNamesIn(child, fn, func);
+  };
+  const auto visit_block = [&](const BlockStmt& block) {
+    for (const auto& stmt : block.statements) visit(stmt);
+  };
+
+  switch (node.Type()) {
+    case NodeType::kIdentifier:
+      fn({node.PtrCast<Identifier>()->value, Use::kRead, func});
+      break;
+    case NodeType::kLetStmt: {
+      const auto* ptr = node.PtrCast<LetStmt>();
+      fn({ptr->name.value, Use::kDefine, func});
+      visit(ptr->expr);
+      break;
+    }
+    case NodeType::kAssignStmt: {
+      const auto* ptr = node.PtrCast<AssignStmt>();
+      fn({ptr->name.value, Use::kAssign, func});
+      visit(ptr->expr);
+      break;
+    }
+    case NodeType::kExprStmt:
+    case NodeType::kReturnStmt:
+      visit(GetExpr(node));
+      break;
+    case NodeType::kBlockStmt:
+      visit_block(*node.PtrCast<BlockStmt>());
+      break;
+    case NodeType::kWhileStmt: {
+      const auto* ptr = node.PtrCast<WhileStmt>();
+      visit(ptr->cond);
+      visit_block(ptr->body);
+      break;
+    }
+    case NodeType::kForStmt: {
+      const auto* ptr = node.PtrCast<ForStmt>();
+      visit(ptr->init);
+      visit(ptr->cond);
+      visit(ptr->update);
+      visit_block(ptr->body);
+      break;
+    }
+    case NodeType::kIfExpr: {
+      const auto* ptr = node.PtrCast<IfExpr>();
+      visit(ptr->cond);
+      visit_block(ptr->true_block);
+      visit_block(ptr->false_block);
+      break;
+    }
+    case NodeType::kFuncLiteral: {
+      const auto* ptr = node.PtrCast<FuncLiteral>();
+      for (const auto& param : ptr->params) {
+        fn({param.value, Use::kDefine, ptr});
+      }
+      for (const auto& stmt : ptr->body.statements) {
+        VisitNamesIn(stmt, fn, ptr);
+      }
+      break;
+    }
+    case NodeType::kPrefixExpr:
+      visit(node.PtrCast<PrefixExpr>()->rhs);
+      break;
+    case NodeType::kInfixExpr: {
+      const auto* ptr = node.PtrCast<InfixExpr>();
+      visit(ptr->lhs);
+      visit(ptr->rhs);
+      break;
+    }
+    case NodeType::kCallExpr: {
+      const auto* ptr = node.PtrCast<CallExpr>();
+      if (ptr->func.Type() == NodeType::kIdentifier) {
+        fn({ptr->func.PtrCast<Identifier>()->value,
+            Use::kCall,
+            func,
+            ptr->args.size()});
+      } else {
+        visit(ptr->func);
+      }
+      for (const auto& arg : ptr->args) visit(arg);
+      break;
+    }
+    case NodeType::kIndexExpr: {
+      const auto* ptr = node.PtrCast<IndexExpr>();
+      visit(ptr->lhs);
+      visit(ptr->index);
+      break;
+    }
+    case NodeType::kArrayLiteral:
+      for (const auto& elem : node.PtrCast<ArrayLiteral>()->elements) {
+        visit(elem);
+      }
+      break;
+    case NodeType::kDictLiteral:
+      for (const auto& [k, v] : node.PtrCast<DictLiteral>()->pairs) {
+        visit(k);
+        visit(v);
+      }
+      break;
+    case NodeType::kYieldExpr:
+      visit(node.PtrCast<YieldExpr>()->value);
+      break;
+    default:
+      break;
   }
 }
 
+}  // namespace
+
+void VisitNames(const AstNode& node, const NameFn& fn) {
+  VisitNamesIn(node, fn, nullptr);
+}
+
 std::string IndexExpr::String() const {
   return fmt::format("({}[{}])", lhs.String(), index.String());
 }
 
+std::string YieldExpr::String() const {
+  return fmt::format("{} {}", TokenLiteral(), value.String());
+}
+
 std::string DictLiteral::String() const {
   const auto pf = absl::PairFormatter(NodeFmt(), ": ", NodeFmt());
   return fmt::format("{{{}}}", absl::StrJoin(pairs, ", ", pf));
@@ -1,8 +1,11 @@
 #include "monkey/builtin.h"
 
 #include <fmt/ostream.h>
+#include <glog/logging.h>
 
+#include <algorithm>
 #include <array>
+#include <numeric>
 
 namespace monkey {
 
@@ -10,6 +13,10 @@ namespace {
 
 const std::string kWrongNumArgs = "wrong number of arguments";
 
+// Number of chunks pmap and preduce split their input into, more than the
+// number of cores so that idle workers can steal from busy ones
+constexpr size_t kNumChunks = 64;
+
 const std::array<std::string, static_cast<size_t>(Builtin::kNumBuiltins)>
     gBuiltinStrs = {
         "len",
@@ -18,9 +25,24 @@ const std::array<std::string, static_cast<size_t>(Builtin::kNumBuiltins)>
         "rest",
         "push",
         "puts",
+        "map",
+        "filter",
+        "reduce",
+        "each",
+        "sort_by",
+        "generator",
+        "next",
+        "take",
+        "collect",
+        "spawn",
+        "chan",
+        "send",
+        "recv",
+        "pmap",
+        "preduce",
 };
 
-Object BuiltinLen(absl::Span<const Object> args) {
+Object BuiltinLen(absl::Span<const Object> args, Caller&) {
   if (args.size() != 1) {
     return ErrorObj(
         fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
@@ -38,7 +60,7 @@ Object BuiltinLen(absl::Span<const Object> args) {
   }
 }
 
-Object BuiltinFirst(absl::Span<const Object> args) {
+Object BuiltinFirst(absl::Span<const Object> args, Caller&) {
   if (args.size() != 1) {
     return ErrorObj(
         fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
@@ -55,7 +77,7 @@ Object BuiltinFirst(absl::Span<const Object> args) {
   return arr.front();
 }
 
-Object BuiltinLast(absl::Span<const Object> args) {
+Object BuiltinLast(absl::Span<const Object> args, Caller&) {
   if (args.size() != 1) {
     return ErrorObj(
         fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
@@ -72,7 +94,7 @@ Object BuiltinLast(absl::Span<const Object> args) {
   return arr.back();
 }
 
-Object BuiltinRest(absl::Span<const Object> args) {
+Object BuiltinRest(absl::Span<const Object> args, Caller&) {
   if (args.size() != 1) {
     return ErrorObj(
         fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
@@ -92,7 +114,7 @@ Object BuiltinRest(absl::Span<const Object> args) {
 }
 
 // Object BuiltinPush(const std::vector<Object>& args) {
-Object BuiltinPush(absl::Span<const Object> args) {
+Object BuiltinPush(absl::Span<const Object> args, Caller&) {
   if (args.size() != 2) {
     return ErrorObj(
         fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
@@ -110,13 +132,437 @@ Object BuiltinPush(absl::Span<const Object> args) {
   return ArrayObj(std::move(copy));
 }
 
-Object BuiltinPuts(absl::Span<const Object> args) {
+Object BuiltinPuts(absl::Span<const Object> args, Caller&) {
   for (const auto& arg : args) {
     fmt::print("{}\n", arg.Inspect());
   }
   return NullObj();
 }
 
+/// Higher-order builtins, these iterate in C++ and call back into the
+/// interpreter once per element
+Object CallOne(Caller& caller, const Object& func, const Object& arg) {
+  return caller.Call(func, absl::MakeConstSpan(&arg, 1));
+}
+
+Object BuiltinMap(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(
+        fmt::format("argument to `map` must be ARRAY, got {}", arg0.Type()));
+  }
+
+  const auto& arr = arg0.Cast<Array>();
+  Array res;
+  res.reserve(arr.size());
+  for (const auto& elem : arr) {
+    auto obj = CallOne(caller, args[1], elem);
+    if (IsObjError(obj)) return obj;
+    res.push_back(std::move(obj));
+  }
+  return ArrayObj(std::move(res));
+}
+
+Object BuiltinFilter(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(
+        fmt::format("argument to `filter` must be ARRAY, got {}", arg0.Type()));
+  }
+
+  Array res;
+  for (const auto& elem : arg0.Cast<Array>()) {
+    const auto obj = CallOne(caller, args[1], elem);
+    if (IsObjError(obj)) return obj;
+    if (IsObjTruthy(obj)) res.push_back(elem);
+  }
+  return ArrayObj(std::move(res));
+}
+
+Object BuiltinReduce(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 3) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=3", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(
+        fmt::format("argument to `reduce` must be ARRAY, got {}", arg0.Type()));
+  }
+
+  // Arguments of each call are (accumulated, element)
+  std::array<Object, 2> call_args{args[1], {}};
+  for (const auto& elem : arg0.Cast<Array>()) {
+    call_args[1] = elem;
+    auto obj = caller.Call(args[2], call_args);
+    if (IsObjError(obj)) return obj;
+    call_args[0] = std::move(obj);
+  }
+  return call_args[0];
+}
+
+Object BuiltinEach(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(
+        fmt::format("argument to `each` must be ARRAY, got {}", arg0.Type()));
+  }
+
+  for (const auto& elem : arg0.Cast<Array>()) {
+    const auto obj = CallOne(caller, args[1], elem);
+    if (IsObjError(obj)) return obj;
+  }
+  return NullObj();
+}
+
+bool KeyLess(const Object& lhs, const Object& rhs) {
+  if (lhs.Type() == ObjectType::kInt) {
+    return lhs.Cast<IntType>() < rhs.Cast<IntType>();
+  }
+  return lhs.Cast<StrType>() < rhs.Cast<StrType>();
+}
+
+Object BuiltinSortBy(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(fmt::format("argument to `sort_by` must be ARRAY, got {}",
+                                arg0.Type()));
+  }
+
+  // Compute each key once, then do a stable sort on the indices
+  const auto& arr = arg0.Cast<Array>();
+  std::vector<Object> keys;
+  keys.reserve(arr.size());
+  for (const auto& elem : arr) {
+    auto key = CallOne(caller, args[1], elem);
+    if (IsObjError(key)) return key;
+    if (key.Type() != ObjectType::kInt && key.Type() != ObjectType::kStr) {
+      return ErrorObj(fmt::format(
+          "key of `sort_by` must be INT or STR, got {}", key.Type()));
+    }
+    if (!keys.empty() && keys.front().Type() != key.Type()) {
+      return ErrorObj(fmt::format("keys of `sort_by` have mixed types: {} {}",
+                                  keys.front().Type(),
+                                  key.Type()));
+    }
+    keys.push_back(std::move(key));
+  }
+
+  std::vector<size_t> order(arr.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t i, size_t j) {
+    return KeyLess(keys[i], keys[j]);
+  });
+
+  Array res;
+  res.reserve(arr.size());
+  for (const auto i : order) {
+    res.push_back(arr[i]);
+  }
+  return ArrayObj(std::move(res));
+}
+
+/// Functions of either interpreter, builtins are excluded
+bool IsObjFunc(const Object& obj) noexcept {
+  return obj.Type() == ObjectType::kClosure || obj.Type() == ObjectType::kFunc;
+}
+
+Object BuiltinGenerator(absl::Span<const Object> args, Caller&) {
+  if (args.size() != 1) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg = args.front();
+  if (!IsObjFunc(arg)) {
+    return ErrorObj(fmt::format(
+        "argument to `generator` must be a function, got {}", arg.Type()));
+  }
+  return GeneratorObj(arg);
+}
+
+/// Resume gen once, returns the yielded value or dflt if gen is exhausted. done
+/// is set to whether gen is exhausted.
+Object ResumeOne(Caller& caller,
+                 const Object& gen,
+                 const Object& dflt,
+                 bool& done) {
+  const auto& state = gen.Cast<GeneratorPtr>()->state;
+  done = state == Generator::State::kDone;
+  if (done) return dflt;
+
+  auto obj = caller.Resume(gen);
+  if (IsObjError(obj)) return obj;
+  done = state == Generator::State::kDone;
+  return done ? dflt : obj;
+}
+
+Object BuiltinNext(absl::Span<const Object> args, Caller& caller) {
+  if (args.empty() || args.size() > 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=1 or 2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kGenerator) {
+    return ErrorObj(fmt::format("argument to `next` must be GENERATOR, got {}",
+                                arg0.Type()));
+  }
+
+  bool done = false;
+  return ResumeOne(caller, arg0, args.size() == 2 ? args[1] : NullObj(), done);
+}
+
+Object BuiltinTake(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  const auto& arg1 = args.back();
+  if (arg0.Type() != ObjectType::kGenerator ||
+      arg1.Type() != ObjectType::kInt) {
+    return ErrorObj(
+        fmt::format("arguments to `take` must be GENERATOR and INT, got {} {}",
+                    arg0.Type(),
+                    arg1.Type()));
+  }
+
+  Array res;
+  bool done = false;
+  for (IntType i = 0; i < arg1.Cast<IntType>(); ++i) {
+    auto obj = ResumeOne(caller, arg0, NullObj(), done);
+    if (IsObjError(obj)) return obj;
+    if (done) break;
+    res.push_back(std::move(obj));
+  }
+  return ArrayObj(std::move(res));
+}
+
+Object BuiltinCollect(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 1) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg = args.front();
+  if (arg.Type() != ObjectType::kGenerator) {
+    return ErrorObj(fmt::format(
+        "argument to `collect` must be GENERATOR, got {}", arg.Type()));
+  }
+
+  Array res;
+  bool done = false;
+  while (true) {
+    auto obj = ResumeOne(caller, arg, NullObj(), done);
+    if (IsObjError(obj)) return obj;
+    if (done) break;
+    res.push_back(std::move(obj));
+  }
+  return ArrayObj(std::move(res));
+}
+
+Object BuiltinSpawn(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 1) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg = args.front();
+  if (!IsObjFunc(arg)) {
+    return ErrorObj(fmt::format(
+        "argument to `spawn` must be a function, got {}", arg.Type()));
+  }
+  return caller.Spawn(arg);
+}
+
+Object BuiltinChan(absl::Span<const Object> args, Caller&) {
+  if (args.size() > 1) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=0 or 1", kWrongNumArgs, args.size()));
+  }
+
+  if (args.empty()) return ChannelObj(0);
+
+  const auto& arg = args.front();
+  if (arg.Type() != ObjectType::kInt || arg.Cast<IntType>() <= 0) {
+    return ErrorObj(fmt::format(
+        "argument to `chan` must be a positive INT, got {}", arg.Inspect()));
+  }
+  return ChannelObj(static_cast<size_t>(arg.Cast<IntType>()));
+}
+
+Object BuiltinSend(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kChannel) {
+    return ErrorObj(fmt::format("argument to `send` must be CHANNEL, got {}",
+                                arg0.Type()));
+  }
+
+  auto& chan = *arg0.Cast<ChannelPtr>();
+  if (chan.capacity > 0 && chan.buffer.size() >= chan.capacity) {
+    if (caller.Block(chan.senders)) return NullObj();
+    return ErrorObj("`send` on full channel would block");
+  }
+
+  chan.buffer.push_back(args[1]);
+  caller.Wake(chan.receivers);
+  return NullObj();
+}
+
+Object BuiltinRecv(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 1) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=1", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg = args.front();
+  if (arg.Type() != ObjectType::kChannel) {
+    return ErrorObj(
+        fmt::format("argument to `recv` must be CHANNEL, got {}", arg.Type()));
+  }
+
+  auto& chan = *arg.Cast<ChannelPtr>();
+  if (chan.buffer.empty()) {
+    if (caller.Block(chan.receivers)) return NullObj();
+    return ErrorObj("`recv` on empty channel would block");
+  }
+
+  auto obj = std::move(chan.buffer.front());
+  chan.buffer.pop_front();
+  caller.Wake(chan.senders);
+  return obj;
+}
+
+/// Returns the first error in objs or an invalid object if there is none
+Object FirstError(const std::vector<Object>& objs) {
+  const auto it = std::find_if(objs.begin(), objs.end(), IsObjError);
+  return it == objs.end() ? Object{} : *it;
+}
+
+/// Run task for each chunk with Caller::Parallel, or in order on caller if
+/// objs hold generators or channels, which the workers would share
+void RunChunks(Caller& caller,
+               size_t n,
+               std::initializer_list<Object> objs,
+               const Caller::ParallelTask& task) {
+  if (std::none_of(objs.begin(), objs.end(), HasMutableState)) {
+    caller.Parallel(n, task);
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    task(i, caller);
+  }
+}
+
+Object BuiltinPmap(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 2) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=2", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(
+        fmt::format("argument to `pmap` must be ARRAY, got {}", arg0.Type()));
+  }
+
+  const auto& arr = arg0.Cast<Array>();
+  const auto n = std::min(arr.size(), kNumChunks);
+  Array res(arr.size());
+  std::vector<Object> errors(n);
+
+  RunChunks(caller, n, {arg0, args[1]}, [&](size_t i, Caller& chunk_caller) {
+    const auto end = arr.size() * (i + 1) / n;
+    for (auto j = arr.size() * i / n; j < end; ++j) {
+      auto obj = CallOne(chunk_caller, args[1], arr[j]);
+      if (IsObjError(obj)) {
+        errors[i] = std::move(obj);
+        return;
+      }
+      res[j] = std::move(obj);
+    }
+  });
+
+  auto error = FirstError(errors);
+  if (error.Ok()) return error;
+  return ArrayObj(std::move(res));
+}
+
+Object BuiltinPreduce(absl::Span<const Object> args, Caller& caller) {
+  if (args.size() != 3) {
+    return ErrorObj(
+        fmt::format("{}. got={}, want=3", kWrongNumArgs, args.size()));
+  }
+
+  const auto& arg0 = args.front();
+  if (arg0.Type() != ObjectType::kArray) {
+    return ErrorObj(fmt::format("argument to `preduce` must be ARRAY, got {}",
+                                arg0.Type()));
+  }
+
+  // Reduce each chunk on its own then fold the partial results into the
+  // initial value, which gives the same result as reduce if fn is associative
+  const auto& arr = arg0.Cast<Array>();
+  const auto n = std::min(arr.size(), kNumChunks);
+  std::vector<Object> partials(n);
+
+  RunChunks(caller, n, {arg0, args[2]}, [&](size_t i, Caller& chunk_caller) {
+    const auto end = arr.size() * (i + 1) / n;
+    auto j = arr.size() * i / n;
+    std::array<Object, 2> call_args{arr[j], {}};
+    for (++j; j < end; ++j) {
+      call_args[1] = arr[j];
+      auto obj = chunk_caller.Call(args[2], call_args);
+      if (IsObjError(obj)) {
+        partials[i] = std::move(obj);
+        return;
+      }
+      call_args[0] = std::move(obj);
+    }
+    partials[i] = std::move(call_args[0]);
+  });
+
+  auto error = FirstError(partials);
+  if (error.Ok()) return error;
+
+  std::array<Object, 2> call_args{args[1], {}};
+  for (auto& partial : partials) {
+    call_args[1] = std::move(partial);
+    auto obj = caller.Call(args[2], call_args);
+    if (IsObjError(obj)) return obj;
+    call_args[0] = std::move(obj);
+  }
+  return call_args[0];
+}
+
 }  // namespace
 
 std::vector<Object> MakeBuiltins() {
@@ -127,6 +573,27 @@ std::vector<Object> MakeBuiltins() {
   v[static_cast<size_t>(Builtin::kRest)] = BuiltinObj({"rest", BuiltinRest});
   v[static_cast<size_t>(Builtin::kPush)] = BuiltinObj({"push", BuiltinPush});
   v[static_cast<size_t>(Builtin::kPuts)] = BuiltinObj({"puts", BuiltinPuts});
+  v[static_cast<size_t>(Builtin::kMap)] = BuiltinObj({"map", BuiltinMap});
+  v[static_cast<size_t>(Builtin::kFilter)] =
+      BuiltinObj({"filter", BuiltinFilter});
+  v[static_cast<size_t>(Builtin::kReduce)] =
+      BuiltinObj({"reduce", BuiltinReduce});
+  v[static_cast<size_t>(Builtin::kEach)] = BuiltinObj({"each", BuiltinEach});
+  v[static_cast<size_t>(Builtin::kSortBy)] =
+      BuiltinObj({"sort_by", BuiltinSortBy});
+  v[static_cast<size_t>(Builtin::kGenerator)] =
+      BuiltinObj({"generator", BuiltinGenerator});
+  v[static_cast<size_t>(Builtin::kNext)] = BuiltinObj({"next", BuiltinNext});
+  v[static_cast<size_t>(Builtin::kTake)] = BuiltinObj({"take", BuiltinTake});
+  v[static_cast<size_t>(Builtin::kCollect)] =
+      BuiltinObj({"collect", BuiltinCollect});
+  v[static_cast<size_t>(Builtin::kSpawn)] = BuiltinObj({"spawn", BuiltinSpawn});
+  v[static_cast<size_t>(Builtin::kChan)] = BuiltinObj({"chan", BuiltinChan});
+  v[static_cast<size_t>(Builtin::kSend)] = BuiltinObj({"send", BuiltinSend});
+  v[static_cast<size_t>(Builtin::kRecv)] = BuiltinObj({"recv", BuiltinRecv});
+  v[static_cast<size_t>(Builtin::kPmap)] = BuiltinObj({"pmap", BuiltinPmap});
+  v[static_cast<size_t>(Builtin::kPreduce)] =
+      BuiltinObj({"preduce", BuiltinPreduce});
   return v;
 }
 
@@ -138,9 +605,70 @@ std::ostream& operator<<(std::ostream& os, Builtin bt) {
   return os << Repr(bt);
 }
 
-const std::vector<Object>& GetBuiltins() {
-  static std::vector<Object> builtins = MakeBuiltins();
-  return builtins;
+namespace {
+
+struct Registry {
+  std::vector<Object> builtins;
+  absl::flat_hash_map<std::string, size_t> index;
+};
+
+Registry& GetRegistry() {
+  static Registry registry = []() {
+    Registry r;
+    r.builtins = MakeBuiltins();
+    for (size_t i = 0; i < r.builtins.size(); ++i) {
+      r.index[r.builtins[i].Cast<BuiltinFunc>().name] = i;
+    }
+    return r;
+  }();
+  return registry;
+}
+
+}  // namespace
+
+const std::vector<Object>& GetBuiltins() { return GetRegistry().builtins; }
+
+bool IsPureBuiltin(size_t index) {
+  switch (static_cast<Builtin>(index)) {
+    case Builtin::kLen:
+    case Builtin::kFirst:
+    case Builtin::kLast:
+    case Builtin::kRest:
+    case Builtin::kPush:
+      return true;
+    default:
+      return false;
+  }
+}
+
+int FindBuiltin(absl::string_view name) {
+  const auto& index = GetRegistry().index;
+  const auto it = index.find(name);
+  return it == index.end() ? -1 : static_cast<int>(it->second);
+}
+
+size_t RegisterBuiltin(BuiltinFunc func) {
+  auto& registry = GetRegistry();
+  const auto index = registry.builtins.size();
+  const auto inserted = registry.index.emplace(func.name, index).second;
+  CHECK(inserted) << "builtin already registered: " << func.name;
+  registry.builtins.push_back(BuiltinObj(std::move(func)));
+  return index;
+}
+
+Object WrongNumArgsError(size_t got, size_t want) {
+  return ErrorObj(fmt::format("{}. got={}, want={}", kWrongNumArgs, got, want));
+}
+
+Object ArgTypeError(const BuiltinFunc& func,
+                    size_t index,
+                    ObjectType want,
+                    ObjectType got) {
+  return ErrorObj(fmt::format("argument {} to `{}` must be {}, got {}",
+                              index + 1,
+                              func.name,
+                              want,
+                              got));
 }
 
 }  // namespace monkey
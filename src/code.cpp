@@ -1,51 +1,25 @@
 #include "monkey/code.h"
 
-#include <absl/container/flat_hash_map.h>
 #include <absl/strings/str_join.h>
 #include <fmt/ostream.h>
 
-namespace monkey {
-
-namespace {
-
-const absl::flat_hash_map<Opcode, Definition> gOpcodeDefinitions = {
-    {Opcode::kConst, {"OpConst", {2}}},
-    {Opcode::kPop, {"OpPop"}},
-    {Opcode::kTrue, {"OpTrue"}},
-    {Opcode::kFalse, {"OpFalse"}},
-    {Opcode::kAdd, {"OpAdd"}},
-    {Opcode::kSub, {"OpSub"}},
-    {Opcode::kMul, {"OpMul"}},
-    {Opcode::kDiv, {"OpDiv"}},
-    {Opcode::kEq, {"OpEq"}},
-    {Opcode::kNe, {"OpNe"}},
-    {Opcode::kGt, {"OpGt"}},
-    {Opcode::kMinus, {"OpMinus"}},
-    {Opcode::kBang, {"OpBang"}},
-    {Opcode::kJumpNotTrue, {"OpJumpNotTrue", {2}}},
-    {Opcode::kJump, {"OpJump", {2}}},
-    {Opcode::kNull, {"OpNull"}},
-    {Opcode::kGetGlobal, {"OpGetGlobal", {2}}},
-    {Opcode::kSetGlobal, {"OpSetGlobal", {2}}},
-    {Opcode::kArray, {"OpArray", {2}}},
-    {Opcode::kDict, {"OpDict", {2}}},
-    {Opcode::kIndex, {"OpIndex"}},
-    {Opcode::kCall, {"OpCall", {1}}},
-    {Opcode::kReturn, {"OpReturn"}},
-    {Opcode::kReturnVal, {"OpReturnVal"}},
-    {Opcode::kGetLocal, {"OpGetLocal", {1}}},
-    {Opcode::kSetLocal, {"OpSetLocal", {1}}},
-    {Opcode::kGetBuiltin, {"OpGetBuiltin", {1}}},
-    {Opcode::kClosure, {"OpClosure", {2, 1}}},
-    {Opcode::kGetFree, {"OpGetFree", {1}}},
-};
+#include <numeric>
 
-}  // namespace
+namespace monkey {
 
-std::string Repr(Opcode op) { return gOpcodeDefinitions.at(op).name; }
+std::string Repr(Opcode op) {
+  return std::string(kOpcodeInfos.at(ToByte(op)).name);
+}
 std::ostream& operator<<(std::ostream& os, Opcode op) { return os << Repr(op); }
 
-Definition LookupDefinition(Opcode op) { return gOpcodeDefinitions.at(op); }
+Definition LookupDefinition(Opcode op, bool wide) {
+  const auto& info = kOpcodeInfos.at(ToByte(op));
+  Definition def{info.name};
+  for (size_t i = 0; i < info.num_operands; ++i) {
+    def.operand_bytes.push_back(info.operand_bytes[i] * (wide ? 2 : 1));
+  }
+  return def;
+}
 
 std::string Definition::Repr() const {
   return fmt::format(
@@ -1,17 +1,264 @@
 #include "monkey/compiler.h"
 
+#include <absl/strings/str_cat.h>
 #include <fmt/ostream.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+
 #include "monkey/builtin.h"
+#include "monkey/thread_pool.h"
 
 namespace monkey {
 
 namespace {
 static constexpr int kPlaceHolder = 0;
+
+/// Only functions whose code is about as small as the call are inlined
+constexpr size_t kMaxInlineBytes = 32;
+
+/// Lets of function literals directly in stmts whose name is never assigned,
+/// so the name is bound to the function everywhere after the let
+absl::flat_hash_set<const LetStmt*> InlineLets(
+    const std::vector<StmtNode>& stmts) {
+  const auto assigned = AssignedNames(stmts);
+  absl::flat_hash_set<const LetStmt*> lets;
+  for (const auto& stmt : stmts) {
+    if (stmt.Type() != NodeType::kLetStmt) continue;
+    const auto* let = stmt.PtrCast<LetStmt>();
+    if (let->expr.Type() == NodeType::kFuncLiteral &&
+        !assigned.contains(let->name.value)) {
+      lets.insert(let);
+    }
+  }
+  return lets;
+}
+
+/// Escape analysis of the lets of function literals directly in the body of a
+/// function. A literal does not escape if its name is only ever called with
+/// the right number of arguments, from the body or from the literal itself,
+/// and is defined once. Variables it reads from the body also must not be
+/// assigned, since the closure would have captured them by value. The last
+/// statement is left out, a scope ending in a lifted let would end with the
+/// code of the statement before it.
+absl::flat_hash_map<const LetStmt*, Compiler::LiftLet> LiftLets(
+    const std::vector<StmtNode>& stmts) {
+  using Use = NameRef::Use;
+  absl::flat_hash_map<std::string, const LetStmt*> candidates;
+  for (size_t i = 0; i + 1 < stmts.size(); ++i) {
+    if (stmts[i].Type() != NodeType::kLetStmt) continue;
+    const auto* let = stmts[i].PtrCast<LetStmt>();
+    if (let->expr.Type() == NodeType::kFuncLiteral) {
+      candidates.emplace(let->name.value, let);
+    }
+  }
+  if (candidates.empty()) return {};
+
+  absl::flat_hash_map<std::string, size_t> num_defs;
+  absl::flat_hash_set<std::string> escaped;
+  absl::flat_hash_set<std::string> assigned;
+  const auto visit = [&](const NameRef& ref) {
+    if (ref.use == Use::kAssign) {
+      assigned.emplace(ref.name);
+      return;
+    }
+    const auto it = candidates.find(ref.name);
+    if (it == candidates.end()) return;
+
+    const auto* literal = it->second->expr.PtrCast<FuncLiteral>();
+    if (ref.use == Use::kDefine) {
+      ++num_defs[it->first];
+    } else if (ref.use == Use::kRead ||
+               (ref.func != nullptr && ref.func != literal) ||
+               ref.num_args != literal->params.size()) {
+      escaped.insert(it->first);
+    }
+  };
+  for (const auto& stmt : stmts) VisitNames(stmt, visit);
+
+  absl::flat_hash_map<const LetStmt*, Compiler::LiftLet> lets;
+  for (const auto& [name, let] : candidates) {
+    if (escaped.contains(name) || assigned.contains(name) ||
+        num_defs[name] != 1) {
+      continue;
+    }
+
+    const auto* literal = let->expr.PtrCast<FuncLiteral>();
+    absl::flat_hash_set<std::string> params;
+    for (const auto& param : literal->params) params.insert(param.value);
+
+    Compiler::LiftLet lift;
+    absl::flat_hash_set<std::string> seen;
+    VisitNames(let->expr, [&](const NameRef& ref) {
+      if (ref.use == Use::kDefine) {
+        lift.defines.emplace(ref.name);
+      } else if (ref.use != Use::kAssign && ref.name != name &&
+                 !params.contains(ref.name) && seen.emplace(ref.name).second) {
+        lift.reads.emplace_back(ref.name);
+      }
+    });
+
+    const bool reads_assigned =
+        std::any_of(lift.reads.cbegin(), lift.reads.cend(), [&](auto& read) {
+          return assigned.contains(read) && !lift.defines.contains(read);
+        });
+    if (!reads_assigned) lets.emplace(let, std::move(lift));
+  }
+  return lets;
+}
+
+/// Compiles to a single instruction that only pushes a value
+bool IsSimpleArg(const ExprNode& arg) {
+  switch (arg.Type()) {
+    case NodeType::kIdentifier:
+    case NodeType::kIntLiteral:
+    case NodeType::kBoolLiteral:
+    case NodeType::kStrLiteral:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Values a constant can hold, shared by every run without being copied
+bool IsData(const Object& obj) {
+  switch (obj.Type()) {
+    case ObjectType::kNull:
+    case ObjectType::kInt:
+    case ObjectType::kBool:
+    case ObjectType::kStr:
+      return true;
+    case ObjectType::kArray: {
+      const auto& arr = obj.Cast<Array>();
+      return std::all_of(arr.cbegin(), arr.cend(), IsData);
+    }
+    case ObjectType::kDict:
+      for (const auto& [k, v] : obj.Cast<Dict>()) {
+        if (!IsData(k) || !IsData(v)) return false;
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Add the globals read or called by code to globals, including those of the
+/// functions it makes closures of or calls as a constant (see Lifted). seen
+/// holds the indices of the constants already visited.
+void CollectGlobals(const Constants& consts,
+                    const Instruction& code,
+                    absl::flat_hash_set<size_t>& seen,
+                    absl::flat_hash_set<size_t>& globals) {
+  for (size_t i = 0; i < code.NumBytes();) {
+    const bool wide = ToOpcode(code.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(code.ByteAt(i + wide));
+    const auto dec = Decode(LookupDefinition(op, wide), code, i + wide + 1);
+    i += size_t{1} + wide + dec.nbytes;
+
+    const auto arg =
+        static_cast<size_t>(dec.operands.empty() ? 0 : dec.operands[0]);
+    switch (op) {
+      case Opcode::kGetGlobal:
+      case Opcode::kCallGlobal:
+        globals.insert(arg);
+        break;
+      case Opcode::kConst:
+      case Opcode::kClosure: {
+        if (!seen.insert(arg).second) break;
+        const auto& obj = consts[arg];
+        if (obj.Type() == ObjectType::kCompiled) {
+          CollectGlobals(consts, obj.Cast<CompiledFunc>().Ins(), seen, globals);
+        } else if (obj.Type() == ObjectType::kClosure) {
+          CollectGlobals(
+              consts, obj.Cast<Closure>().func.Ins(), seen, globals);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+/// Maps the operands of code compiled by a worker to the ones it would have
+/// had if compiled in place, see Compiler::SetParallel
+struct Renumbering {
+  std::vector<size_t> consts;  // by local index, of the constants mapped so far
+  size_t self{0};              // provisional index of the global being defined
+  size_t new_self{0};
+  size_t first_call_site{0};
+};
+
+/// Renumber the operands of code in place. Fails if an operand is out of range
+/// or would need a different width, which would move the code after it.
+bool Renumber(Instruction& code, const Renumbering& map) {
+  for (size_t i = 0; i < code.NumBytes();) {
+    const bool wide = ToOpcode(code.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(code.ByteAt(i + wide));
+    const auto def = LookupDefinition(op, wide);
+    const auto dec = Decode(def, code, i + wide + 1);
+    const auto start = i + wide + 1;
+    i += size_t{1} + wide + dec.nbytes;
+
+    auto operands = dec.operands;
+    switch (op) {
+      case Opcode::kConst:
+      case Opcode::kClosure: {
+        const auto local = static_cast<size_t>(operands[0]);
+        if (local >= map.consts.size()) return false;
+        operands[0] = static_cast<int>(map.consts[local]);
+        break;
+      }
+      case Opcode::kGetGlobal:
+        if (static_cast<size_t>(operands[0]) == map.self) {
+          operands[0] = static_cast<int>(map.new_self);
+        }
+        break;
+      case Opcode::kCallGlobal:
+        if (static_cast<size_t>(operands[0]) == map.self) {
+          operands[0] = static_cast<int>(map.new_self);
+        }
+        operands[2] += static_cast<int>(map.first_call_site);
+        break;
+      default:
+        continue;
+    }
+
+    // Encode only goes wide when an operand does not fit the narrow form
+    const auto narrow = LookupDefinition(op);
+    bool fits = true;
+    for (size_t k = 0; k < operands.size(); ++k) {
+      const auto bits = 8 * narrow.operand_bytes[k];
+      fits = fits && (static_cast<uint64_t>(operands[k]) >> bits) == 0;
+    }
+    if (fits == wide) return false;
+
+    auto offset = start;
+    for (size_t k = 0; k < operands.size(); ++k) {
+      code.EncodeOperand(offset, def.operand_bytes[k], operands[k]);
+      offset += def.operand_bytes[k];
+    }
+  }
+  return true;
+}
+
+absl::optional<CompiledFunc> Renumber(const CompiledFunc& func,
+                                      const Renumbering& map) {
+  auto code = func.Ins();
+  if (!Renumber(code, map)) return absl::nullopt;
+  auto renumbered = func;
+  renumbered.ins = std::make_shared<const Instruction>(std::move(code));
+  return renumbered;
+}
+
 }  // namespace
 
-Compiler::Compiler() {
+Compiler::Compiler()
+    : consts_{std::make_shared<Constants>()},
+      names_{std::make_shared<GlobalNames>()} {
   EnterScope();
 
   for (size_t i = 0; i < GetBuiltins().size(); ++i) {
@@ -19,16 +266,67 @@ Compiler::Compiler() {
   }
 }
 
+Compiler::Compiler(const SymbolTable& globals)
+    : consts_{std::make_shared<Constants>()},
+      names_{std::make_shared<GlobalNames>()} {
+  scopes_.push_back({});
+  tables_.push_back(SymbolTable::Overlay(globals));
+}
+
 absl::StatusOr<Bytecode> Compiler::Compile(const Program& program) {
   auto _ = timers_.Scoped("CompileProgram");
+  num_specialized_ = 0;
 
-  for (const auto& stmt : program.statements) {
-    auto status = CompileImpl(stmt);
-    if (!status.ok()) return status;
+  absl::StatusOr<Program> folded = program;
+  if (fold_constants_) {
+    auto timer = timers_.Scoped("FoldConstants");
+    folded = folder_.Fold(program);
+    if (!folded.ok()) return folded.status();
+  }
+
+  assigned_names_ = AssignedNames(folded->statements);
+  if (optimize_) {
+    // Globals assigned in this program may no longer hold their function
+    for (const auto& name : assigned_names_) {
+      const auto symbol = CurrTable().Resolve(name);
+      if (symbol && symbol->IsGlobal()) inlinable_globals_.erase(symbol->index);
+    }
+    CurrScope().inline_lets = InlineLets(folded->statements);
+  }
+  if (evaluator_) {
+    for (const auto& stmt : folded->statements) {
+      if (stmt.Type() != NodeType::kLetStmt) continue;
+      CurrScope().known_lets.insert(stmt.PtrCast<LetStmt>());
+    }
   }
+  if (parallel_) PrecompileFuncs(folded->statements);
 
-  // Maybe don't use move
-  return Bytecode{ScopedIns(), consts_};
+  for (const auto& stmt : folded->statements) {
+    auto status = CompileImpl(stmt);
+    if (!status.ok()) {
+      // Drop the partially compiled program so the next call starts clean,
+      // including the scopes of functions it was compiling
+      while (NumScopes() > 1) ExitScope();
+      CurrScope() = {};
+      precompiled_.clear();
+      return status;
+    }
+  }
+  precompiled_.clear();
+
+  // Move the new code out, leave an empty scope for the next call
+  auto ins = std::make_shared<const Instruction>(std::move(ScopedIns()));
+  CurrScope() = {};
+  if (optimize_) {
+    // Globals are not allocated by the scope, so the count is unused
+    CodeUnit unit;
+    unit.consts = consts_.get();
+    auto timer = timers_.Scoped("Optimize");
+    ins = std::make_shared<const Instruction>(
+        passes_.Optimize(*ins, unit, timers_));
+    num_specialized_ += unit.num_specialized;
+  }
+  return Bytecode{std::move(ins), consts_, names_};
 }
 
 void Compiler::EnterScope() {
@@ -62,6 +360,19 @@ absl::Status Compiler::CompileImpl(const AstNode& node) {
     case NodeType::kReturnStmt: {
       return CompileReturnStmt(node);
     }
+    case NodeType::kAssignStmt: {
+      return CompileAssignStmt(node);
+    }
+    case NodeType::kWhileStmt: {
+      const auto* ptr = node.PtrCast<WhileStmt>();
+      return CompileLoop(ptr->cond, ptr->body, {});
+    }
+    case NodeType::kForStmt: {
+      const auto* ptr = node.PtrCast<ForStmt>();
+      auto status = CompileImpl(ptr->init);
+      if (!status.ok()) return status;
+      return CompileLoop(ptr->cond, ptr->body, ptr->update);
+    }
     case NodeType::kIdentifier: {
       return CompileIdentifier(node);
     }
@@ -123,6 +434,14 @@ absl::Status Compiler::CompileImpl(const AstNode& node) {
     case NodeType::kFuncLiteral: {
       return CompileFuncLiteral(node);
     }
+    case NodeType::kYieldExpr: {
+      // Evaluates to null once the generator is resumed
+      auto status = CompileImpl(node.PtrCast<YieldExpr>()->value);
+      if (!status.ok()) return status;
+      CurrScope().pure = false;
+      Emit(Opcode::kYield);
+      break;
+    }
     default:
       return MakeError("Internal Compiler Error: Unhandled ast node: " +
                        Repr(node.Type()));
@@ -131,28 +450,53 @@ absl::Status Compiler::CompileImpl(const AstNode& node) {
   return kOkStatus;
 }
 
-size_t Compiler::AddConstant(Object obj) {
-  consts_.push_back(std::move(obj));
-  return consts_.size() - 1;
+absl::optional<Compiler::ConstKey> Compiler::MakeConstKey(const Object& obj) {
+  switch (obj.Type()) {
+    case ObjectType::kInt:
+      return ConstKey{obj.Type(), obj.Cast<IntType>(), {}};
+    case ObjectType::kStr:
+      return ConstKey{obj.Type(), 0, obj.Cast<StrType>()};
+    case ObjectType::kCompiled: {
+      // Same code can still differ in the number of params or locals
+      const auto& func = obj.Cast<CompiledFunc>();
+      const auto& bytes = func.Ins().bytes;
+      return ConstKey{
+          obj.Type(),
+          0,
+          absl::StrCat(func.num_locals,
+                       ",",
+                       func.num_params,
+                       ",",
+                       func.pure,
+                       ";",
+                       absl::string_view{
+                           reinterpret_cast<const char*>(bytes.data()),
+                           bytes.size()})};
+    }
+    default:
+      return absl::nullopt;
+  }
 }
 
-size_t Compiler::AddInstruction(const Instruction& ins) {
-  auto& curr_ins = ScopedIns();
-  const auto pos = curr_ins.NumBytes();
-  curr_ins.Append(ins);
-  return pos;
+size_t Compiler::AddConstant(Object obj) {
+  if (auto key = MakeConstKey(obj)) {
+    const auto [it, inserted] =
+        const_index_.try_emplace(std::move(*key), consts_->size());
+    if (!inserted) return it->second;
+  }
+
+  consts_->push_back(std::move(obj));
+  return consts_->size() - 1;
 }
 
-size_t Compiler::Emit(Opcode op, const std::vector<int>& operands) {
-  const auto pos = AddInstruction(Encode(op, operands));
+size_t Compiler::Emit(Opcode op, absl::Span<const int> operands) {
+  const auto pos = ScopedIns().Emit(op, operands);
   SaveEmitted(op, pos);
   return pos;
 }
 
 size_t Compiler::Emit(Opcode op, int operand) {
-  const auto pos = AddInstruction(Encode(op, operand));
-  SaveEmitted(op, pos);
-  return pos;
+  return Emit(op, absl::MakeConstSpan(&operand, 1));
 }
 
 void Compiler::SaveEmitted(Opcode op, size_t pos) {
@@ -178,22 +522,134 @@ void Compiler::ReplaceInstruction(size_t pos, const Instruction& ins) {
   }
 }
 
-void Compiler::ChangeOperand(size_t pos, int operand) {
-  const auto op = ToOpcode(ScopedIns().bytes.at(pos));
-  const auto new_ins = Encode(op, operand);
-  ReplaceInstruction(pos, new_ins);
+size_t Compiler::EmitJump(Opcode op) {
+  // Every forward target is past the end, so it can only be reached wide
+  if (ScopedIns().NumBytes() > std::numeric_limits<uint16_t>::max()) {
+    const auto pos = ScopedIns().Emit(op, {kPlaceHolder}, true);
+    SaveEmitted(op, pos);
+    return pos;
+  }
+  return Emit(op, kPlaceHolder);
+}
+
+size_t Compiler::ChangeOperand(size_t pos, int operand) {
+  const auto& ins = ScopedIns();
+  const bool wide = ToOpcode(ins.bytes.at(pos)) == Opcode::kWide;
+  const auto op = ToOpcode(ins.bytes.at(pos + wide));
+  const auto new_ins = wide ? EncodeWide(op, {operand}) : Encode(op, operand);
+  if (new_ins.ByteAt(0) == ins.ByteAt(pos)) {
+    ReplaceInstruction(pos, new_ins);
+    return 0;
+  }
+  return WidenJump(pos, operand);
+}
+
+size_t Compiler::WidenJump(size_t pos, int target) {
+  struct Op {
+    size_t pos;
+    size_t nbytes;
+    Opcode op;
+    bool wide;
+    size_t target;  // of jumps
+  };
+
+  const auto is_jump = [](Opcode op) {
+    return op == Opcode::kJump || op == Opcode::kJumpNotTrue;
+  };
+
+  // Positions and jump targets are the old ones until the layout is stable
+  auto& ins = ScopedIns();
+  std::vector<Op> ops;
+  for (size_t i = 0; i < ins.NumBytes();) {
+    const bool wide = ToOpcode(ins.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(ins.ByteAt(i + wide));
+    const auto dec = Decode(LookupDefinition(op, wide), ins, i + wide + 1);
+    const auto nbytes = size_t{1} + wide + dec.nbytes;
+    const auto target = is_jump(op) ? dec.operands[0] : 0;
+    ops.push_back({i, nbytes, op, wide, static_cast<size_t>(target)});
+    i += nbytes;
+  }
+
+  const auto index_of = [&ops](size_t old_pos) {
+    const auto it = std::lower_bound(
+        ops.cbegin(), ops.cend(), old_pos, [](const Op& op, size_t p) {
+          return op.pos < p;
+        });
+    CHECK(it == ops.cend() || it->pos == old_pos) << old_pos;
+    return static_cast<size_t>(it - ops.cbegin());
+  };
+
+  const auto widen = [](Op& op) {
+    op.wide = true;
+    op.nbytes = 6;  // prefix, opcode and 4 byte target
+  };
+  auto& patched = ops[index_of(pos)];
+  CHECK(is_jump(patched.op));
+  patched.target = static_cast<size_t>(target);
+  widen(patched);
+
+  // Widening shifts everything after it, which can push more jump targets out
+  // of the narrow range, so repeat until the layout is stable
+  std::vector<size_t> new_pos(ops.size() + 1);
+  for (bool changed = true; changed;) {
+    size_t p = 0;
+    for (size_t i = 0; i < ops.size(); ++i) {
+      new_pos[i] = p;
+      p += ops[i].nbytes;
+    }
+    new_pos.back() = p;
+
+    changed = false;
+    for (auto& op : ops) {
+      if (!is_jump(op.op) || op.wide) continue;
+      if (new_pos[index_of(op.target)] > std::numeric_limits<uint16_t>::max()) {
+        widen(op);
+        changed = true;
+      }
+    }
+  }
+
+  // Only jumps are encoded again, the rest is copied as is
+  Instruction out;
+  out.bytes.reserve(new_pos.back());
+  for (const auto& op : ops) {
+    if (is_jump(op.op)) {
+      const auto dst = static_cast<int>(new_pos[index_of(op.target)]);
+      out += op.wide ? EncodeWide(op.op, {dst}) : Encode(op.op, dst);
+    } else {
+      const auto begin = ins.bytes.cbegin() + static_cast<ptrdiff_t>(op.pos);
+      out.bytes.insert(
+          out.bytes.end(), begin, begin + static_cast<ptrdiff_t>(op.nbytes));
+    }
+  }
+  out.num_ops = ins.num_ops;
+
+  const auto growth = out.NumBytes() - ins.NumBytes();
+  ins = std::move(out);
+  CurrScope().last.pos = new_pos[index_of(CurrScope().last.pos)];
+  CurrScope().prev.pos = new_pos[index_of(CurrScope().prev.pos)];
+  return growth;
 }
 
 absl::Status Compiler::CompileIfExpr(const ExprNode& expr) {
   const auto* ptr = expr.PtrCast<IfExpr>();
   CHECK_NOTNULL(ptr);
 
+  // The folder leaves a constant condition with an empty dead branch
+  if (fold_constants_ && ptr->cond.Type() == NodeType::kBoolLiteral) {
+    const bool cond = ptr->cond.PtrCast<BoolLiteral>()->value;
+    const auto& dead = cond ? ptr->false_block : ptr->true_block;
+    if (dead.empty()) {
+      return CompileValueBlock(cond ? ptr->true_block : ptr->false_block);
+    }
+  }
+
   // Compile condition
   auto status = CompileImpl(ptr->cond);
   if (!status.ok()) return status;
 
   // Emit an `OpJumpNotTruthy` with a bogus value
-  const auto jnt_pos = Emit(Opcode::kJumpNotTrue, kPlaceHolder);
+  const auto jnt_pos = EmitJump(Opcode::kJumpNotTrue);
 
   // Compile true block
   status.Update(CompileImpl(ptr->true_block));
@@ -202,8 +658,9 @@ absl::Status Compiler::CompileIfExpr(const ExprNode& expr) {
   if (ScopedLast().op == Opcode::kPop) RemoveLastOp(Opcode::kPop);
 
   // Emit an `OpJump` with a bogus value
-  const auto jmp_pos = Emit(Opcode::kJump, kPlaceHolder);
-  ChangeOperand(jnt_pos, static_cast<int>(ScopedIns().NumBytes()));
+  auto jmp_pos = EmitJump(Opcode::kJump);
+  // The jump is the last instruction, so widening the other one shifts it
+  jmp_pos += ChangeOperand(jnt_pos, static_cast<int>(ScopedIns().NumBytes()));
 
   if (ptr->false_block.empty()) {
     Emit(Opcode::kNull);
@@ -218,19 +675,77 @@ absl::Status Compiler::CompileIfExpr(const ExprNode& expr) {
   return kOkStatus;
 }
 
+absl::Status Compiler::CompileValueBlock(const BlockStmt& block) {
+  if (block.empty()) {
+    Emit(Opcode::kNull);
+    return kOkStatus;
+  }
+
+  auto status = CompileImpl(block);
+  if (!status.ok()) return status;
+  if (ScopedLast().op == Opcode::kPop) RemoveLastOp(Opcode::kPop);
+  return kOkStatus;
+}
+
 absl::Status Compiler::CompileCallExpr(const ExprNode& expr) {
   const auto* ptr = expr.PtrCast<CallExpr>();
   CHECK_NOTNULL(ptr);
+  const auto num_args = static_cast<int>(ptr->args.size());
+
+  // Checked first, resolving the name of a lifted literal in its own body
+  // would capture it
+  if (ptr->func.Type() == NodeType::kIdentifier) {
+    const auto name = ptr->func.TokenLiteral();
+    const auto it = CurrScope().lifted.find(name);
+    if (it != CurrScope().lifted.end()) {
+      return CompileLiftedCall(*ptr, name, it->second);
+    }
+  }
+
+  // Builtins and globals are called directly without pushing the function
+  // first, calls to globals get an inline cache slot in the vm
+  absl::optional<Symbol> callee;
+  if (ptr->func.Type() == NodeType::kIdentifier) {
+    callee = CurrTable().Resolve(ptr->func.TokenLiteral());
+    if (callee && callee->scope != SymbolScope::kBuiltin &&
+        callee->scope != SymbolScope::kGlobal) {
+      callee.reset();
+    }
+  }
+
+  if (optimize_ && ptr->func.Type() == NodeType::kIdentifier) {
+    if (const auto symbol = CurrTable().Resolve(ptr->func.TokenLiteral())) {
+      const auto inlined = CompileInlineCall(*ptr, *symbol);
+      if (!inlined.ok()) return inlined.status();
+      if (*inlined) return kOkStatus;
+    }
+  }
+
   auto status = kOkStatus;
-  status.Update(CompileImpl(ptr->func));
-  if (!status.ok()) return status;
+  if (!callee) {
+    status.Update(CompileImpl(ptr->func));
+    if (!status.ok()) return status;
+  }
 
   for (const auto& arg : ptr->args) {
     status.Update(CompileImpl(arg));
     if (!status.ok()) return status;
   }
 
-  Emit(Opcode::kCall, static_cast<int>(ptr->args.size()));
+  const auto index = callee ? static_cast<int>(callee->index) : 0;
+  if (!callee) {
+    CurrScope().pure = false;  // callee is not known at compile time
+    Emit(Opcode::kCall, num_args);
+  } else if (callee->scope == SymbolScope::kBuiltin) {
+    if (!IsPureBuiltin(callee->index)) CurrScope().pure = false;
+    Emit(Opcode::kCallBuiltin, {index, num_args});
+  } else {
+    if (defining_ != callee->index && !pure_globals_.contains(callee->index)) {
+      CurrScope().pure = false;
+    }
+    const auto slot = static_cast<int>(num_call_sites_++);
+    Emit(Opcode::kCallGlobal, {index, num_args, slot});
+  }
   return status;
 }
 
@@ -314,22 +829,63 @@ absl::Status Compiler::CompileIdentifier(const ExprNode& expr) {
   return kOkStatus;
 }
 
-absl::Status Compiler::CompileFuncLiteral(const ExprNode& expr) {
-  EnterScope();
-
+absl::Status Compiler::CompileFuncLiteral(const ExprNode& expr,
+                                          const std::string& name) {
   const auto* ptr = expr.PtrCast<FuncLiteral>();
   CHECK_NOTNULL(ptr);
 
+  std::vector<Symbol> free_symbols;
+  absl::StatusOr<CompiledFunc> func;
+  const auto it = precompiled_.find(ptr);
+  if (it != precompiled_.end() && MergeFunc(it->second)) {
+    func = std::move(it->second.func);
+  } else {
+    func = CompileFunc(*ptr, free_symbols, nullptr, name);
+  }
+  if (it != precompiled_.end()) precompiled_.erase(it);
+  if (!func.ok()) return func.status();
+
+  // Load free symbols
+  for (const auto& sym : free_symbols) {
+    LoadSymbol(sym);
+  }
+
+  const auto index =
+      static_cast<int>(AddConstant(CompiledObj(*std::move(func))));
+  Emit(Opcode::kClosure, {index, static_cast<int>(free_symbols.size())});
+  return kOkStatus;
+}
+
+absl::StatusOr<CompiledFunc> Compiler::CompileFunc(const FuncLiteral& literal,
+                                                   std::vector<Symbol>& free,
+                                                   const Lifted* lifted,
+                                                   const std::string& name) {
+  EnterScope();
+
+  // Defined first so that params of the same name shadow it
+  if (lifted == nullptr && !name.empty()) {
+    CurrTable().DefineFunctionName(name);
+  }
+
   // After entering a new scope and right before compiling the functions' body
   // we define each parameter in the scope of the function.
   // This allows the symbol table to resolve the new refernces and treat them as
   // locals when compiling the function's body
-  for (const auto& param : ptr->params) {
+  for (const auto& param : literal.params) {
     CurrTable().Define(param.String());
   }
+  if (lifted != nullptr) {
+    auto& self = CurrScope().lifted[name] = *lifted;
+    self.self = true;
+    for (auto& var : self.free) var = CurrTable().Define(var.name);
+  }
+  if (optimize_) {
+    CurrScope().inline_lets = InlineLets(literal.body.statements);
+    CurrScope().lift_lets = LiftLets(literal.body.statements);
+  }
 
   // Compile function body
-  auto status = CompileImpl(ptr->body);
+  auto status = CompileImpl(literal.body);
   if (!status.ok()) return status;
 
   if (ScopedLast().op == Opcode::kPop) {
@@ -342,36 +898,75 @@ absl::Status Compiler::CompileFuncLiteral(const ExprNode& expr) {
 
   // copy free symbols before exiting the scope (since we pop the table when
   // exiting this scope)
-  const auto free_symbols = CurrTable().GetFreeSymbols();
-  const auto num_locals = CurrTable().NumDefs();
-  const auto num_params = ptr->params.size();
+  free = CurrTable().GetFreeSymbols();
+  auto num_locals = CurrTable().NumDefs();
+  const auto num_params =
+      literal.params.size() + (lifted != nullptr ? lifted->free.size() : 0);
+  last_func_pure_ = CurrScope().pure;
 
   // Exit scope
   auto ins = ExitScope();
-
-  // Load free symbols
-  for (const auto& sym : free_symbols) {
-    LoadSymbol(sym);
+  if (optimize_) {
+    CodeUnit unit;
+    unit.num_locals = num_locals;
+    unit.function = true;
+    unit.consts = consts_.get();
+    auto timer = timers_.Scoped("Optimize");
+    ins = passes_.Optimize(ins, unit, timers_);
+    num_locals = unit.num_locals;
+    num_specialized_ += unit.num_specialized;
   }
 
-  const auto index = static_cast<int>(
-      AddConstant(CompiledObj({std::move(ins), num_locals, num_params})));
-  Emit(Opcode::kClosure, {index, static_cast<int>(free_symbols.size())});
-
-  return status;
+  return CompiledFunc{std::make_shared<const Instruction>(std::move(ins)),
+                      num_locals,
+                      num_params,
+                      last_func_pure_};
 }
 
 absl::Status Compiler::CompileLetStmt(const StmtNode& stmt) {
   const auto* ptr = stmt.PtrCast<LetStmt>();
   CHECK_NOTNULL(ptr);
 
-  const auto& symbol = CurrTable().Define(ptr->name.value);
-  auto status = CompileImpl(ptr->expr);
-  if (!status.ok()) return status;
+  // A copy, compiling the value may define free symbols in the table
+  const auto symbol = CurrTable().Define(ptr->name.value);
+  if (optimize_) {
+    const auto lifted = CompileLiftedLet(*ptr, symbol);
+    if (!lifted.ok()) return lifted.status();
+    if (*lifted) return kOkStatus;
+  }
+
+  const bool known = CurrScope().known_lets.contains(ptr);
+  const auto start = ScopedIns().NumBytes();
+  const auto evaluated = known ? CompileEvaluatedLet(*ptr) : false;
+  if (!evaluated.ok()) return evaluated.status();
+  if (!*evaluated) {
+    // Only a literal is the value of the global, a call of another function
+    // on it may return something else
+    const bool func = ptr->expr.Type() == NodeType::kFuncLiteral;
+    const auto outer = defining_;
+    if (symbol.IsGlobal() && func) defining_ = symbol.index;
+    // Globals are called by index, a local literal calls its own closure
+    const bool local_func = !symbol.IsGlobal() && func;
+    auto status = local_func ? CompileFuncLiteral(ptr->expr, symbol.name)
+                             : CompileImpl(ptr->expr);
+    defining_ = outer;
+    if (!status.ok()) return status;
+
+    if (optimize_) AddInlinable(*ptr, symbol);
+  }
 
   // Add to symbol table
   const auto index = static_cast<int>(symbol.index);
   if (symbol.IsGlobal()) {
+    // The value of an assigned global may be impure by the time it is called
+    if (ptr->expr.Type() == NodeType::kFuncLiteral && last_func_pure_ &&
+        !assigned_names_.contains(symbol.name)) {
+      pure_globals_.insert(symbol.index);
+    } else {
+      pure_globals_.erase(symbol.index);
+    }
+    if (known) AddKnownGlobal(*ptr, symbol, start);
+    (*names_)[symbol.name] = symbol.index;
     Emit(Opcode::kSetGlobal, index);
   } else {
     Emit(Opcode::kSetLocal, index);
@@ -414,6 +1009,78 @@ absl::Status Compiler::CompileReturnStmt(const StmtNode& stmt) {
   return kOkStatus;
 }
 
+absl::Status Compiler::CompileAssignStmt(const StmtNode& stmt) {
+  const auto* ptr = stmt.PtrCast<AssignStmt>();
+  CHECK_NOTNULL(ptr);
+
+  const auto& name = ptr->name.value;
+  const auto symbol = CurrTable().Resolve(name);
+  if (!symbol.has_value()) {
+    return MakeError("Undefined variable " + name);
+  }
+  if (symbol->scope == SymbolScope::kBuiltin) {
+    return MakeError("cannot assign to builtin " + name);
+  }
+  // Closures capture free variables by value, so only the scope that defined
+  // a variable may assign to it
+  if (symbol->scope == SymbolScope::kFree ||
+      symbol->scope == SymbolScope::kFunction ||
+      (symbol->IsGlobal() && !CurrTable().IsGlobal())) {
+    return MakeError(
+        fmt::format("cannot assign to {} outside the scope that defines it",
+                    name));
+  }
+
+  // Later lets may run after the new value is set
+  if (symbol->IsGlobal()) known_globals_.erase(symbol->index);
+
+  const auto outer = defining_;
+  if (symbol->IsGlobal() && ptr->expr.Type() == NodeType::kFuncLiteral) {
+    defining_ = symbol->index;
+  }
+  auto status = CompileImpl(ptr->expr);
+  defining_ = outer;
+  if (!status.ok()) return status;
+
+  const auto index = static_cast<int>(symbol->index);
+  if (symbol->IsGlobal()) {
+    // Functions compiled earlier may still be marked pure because they call
+    // this global, the vm stops memoizing once it is set
+    pure_globals_.erase(symbol->index);
+    Emit(Opcode::kSetGlobal, index);
+  } else {
+    Emit(Opcode::kSetLocal, index);
+  }
+  return kOkStatus;
+}
+
+absl::Status Compiler::CompileLoop(const ExprNode& cond,
+                                   const BlockStmt& body,
+                                   const StmtNode& update) {
+  const auto start = static_cast<int>(ScopedIns().NumBytes());
+  auto status = CompileImpl(cond);
+  if (!status.ok()) return status;
+
+  const auto jnt_pos = EmitJump(Opcode::kJumpNotTrue);
+
+  status.Update(CompileImpl(body));
+  if (!status.ok()) return status;
+  if (update.Ok()) {
+    status.Update(CompileImpl(update));
+    if (!status.ok()) return status;
+  }
+
+  // The vm ticks the scheduler on backward jumps, so loops can be preempted
+  Emit(Opcode::kJump, start);
+  ChangeOperand(jnt_pos, static_cast<int>(ScopedIns().NumBytes()));
+
+  // Like an expression statement that evaluates to null, so a loop can end
+  // an if block or a function body
+  Emit(Opcode::kNull);
+  Emit(Opcode::kPop);
+  return kOkStatus;
+}
+
 void Compiler::LoadSymbol(const Symbol& symbol) {
   const auto index = static_cast<int>(symbol.index);
   switch (symbol.scope) {
@@ -429,6 +1096,9 @@ void Compiler::LoadSymbol(const Symbol& symbol) {
     case SymbolScope::kFree:
       Emit(Opcode::kGetFree, index);
       break;
+    case SymbolScope::kFunction:
+      Emit(Opcode::kCurrentClosure);
+      break;
     default:
       // Shouldn't reach here
       CHECK(false) << "should not reach here";
@@ -436,4 +1106,517 @@ void Compiler::LoadSymbol(const Symbol& symbol) {
   }
 }
 
+void Compiler::AddInlinable(const LetStmt& let, const Symbol& symbol) {
+  if (!CurrScope().inline_lets.contains(&let)) return;
+
+  // The literal was just compiled, it must not capture anything
+  const auto& ins = ScopedIns();
+  const auto pos = ScopedLast().pos;
+  const bool wide = ToOpcode(ins.ByteAt(pos)) == Opcode::kWide;
+  CHECK_EQ(ToOpcode(ins.ByteAt(pos + wide)), Opcode::kClosure);
+  const auto closure =
+      Decode(LookupDefinition(Opcode::kClosure, wide), ins, pos + wide + 1);
+  if (closure.operands[1] != 0) return;
+
+  const auto index = static_cast<size_t>(closure.operands[0]);
+  AddInlinable(symbol, (*consts_)[index].Cast<CompiledFunc>());
+}
+
+void Compiler::AddInlinable(const Symbol& symbol, CompiledFunc func) {
+  Inlinable inlinable{std::move(func)};
+  const auto& code = inlinable.func.Ins();
+  if (code.NumBytes() > kMaxInlineBytes) return;
+
+  for (size_t i = 0; i < code.NumBytes();) {
+    const bool wide_op = ToOpcode(code.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(code.ByteAt(i + wide_op));
+    const auto dec =
+        Decode(LookupDefinition(op, wide_op), code, i + wide_op + 1);
+    i += size_t{1} + wide_op + dec.nbytes;
+
+    switch (op) {
+      case Opcode::kReturn:
+      case Opcode::kReturnVal:
+        // Inlined code falls through to the caller instead of returning, so
+        // it can only return at the end
+        if (i != code.NumBytes()) return;
+        break;
+      case Opcode::kYield:
+      case Opcode::kCurrentClosure:  // would be the closure of the caller
+        return;
+      case Opcode::kSetLocal:
+        inlinable.assigns_params |=
+            static_cast<size_t>(dec.operands[0]) < inlinable.func.num_params;
+        break;
+      case Opcode::kGetGlobal:
+      case Opcode::kCallGlobal:
+        // Recursive
+        if (symbol.IsGlobal() &&
+            static_cast<size_t>(dec.operands[0]) == symbol.index) {
+          return;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (symbol.IsGlobal()) {
+    inlinable_globals_[symbol.index] = std::move(inlinable);
+  } else {
+    CurrScope().inlinable[symbol.index] = std::move(inlinable);
+  }
+}
+
+const Compiler::Inlinable* Compiler::FindInlinable(const Symbol& symbol) const {
+  if (symbol.IsGlobal()) {
+    const auto it = inlinable_globals_.find(symbol.index);
+    return it == inlinable_globals_.end() ? nullptr : &it->second;
+  }
+  if (symbol.scope == SymbolScope::kLocal) {
+    const auto& inlinable = CurrScope().inlinable;
+    const auto it = inlinable.find(symbol.index);
+    return it == inlinable.end() ? nullptr : &it->second;
+  }
+  return nullptr;
+}
+
+absl::StatusOr<bool> Compiler::CompileInlineCall(
+    const CallExpr& call,
+    const Symbol& callee,
+    absl::Span<const Symbol> extra) {
+  const auto* inlinable = FindInlinable(callee);
+  if (inlinable == nullptr) return false;
+  const auto& func = inlinable->func;
+  // Leave calls with the wrong number of arguments to fail when they run
+  const auto num_params = func.num_params;
+  const auto num_args = call.args.size();
+  if (num_args + extra.size() != num_params) return false;
+
+  // Simple arguments are substituted into the code, the others are stored in
+  // locals, which the top level does not have
+  const bool substitute = !inlinable->assigns_params;
+  const bool has_frame = !CurrTable().IsGlobal();
+  // A later program may assign the global, a function has to call it by then
+  if (callee.IsGlobal() && has_frame) return false;
+  if (!has_frame) {
+    const bool all_simple = std::all_of(
+        call.args.cbegin(), call.args.cend(), IsSimpleArg);
+    if (func.num_locals > num_params || !substitute || !all_simple) {
+      return false;
+    }
+  }
+
+  std::vector<absl::optional<IrInst>> subs(num_params);
+  for (size_t i = 0; i < num_params; ++i) {
+    const auto start = ScopedIns().NumBytes();
+    const auto last = ScopedLast();
+    const auto prev = ScopedPrev();
+    // A loaded symbol is a simple argument
+    if (i < num_args) {
+      auto status = CompileImpl(call.args[i]);
+      if (!status.ok()) return status;
+      if (!IsSimpleArg(call.args[i])) continue;
+    } else {
+      LoadSymbol(extra[i - num_args]);
+    }
+    if (!substitute) continue;
+
+    // Take the instruction back out
+    auto& ins = ScopedIns();
+    const bool wide = ToOpcode(ins.ByteAt(start)) == Opcode::kWide;
+    const auto op = ToOpcode(ins.ByteAt(start + wide));
+    auto dec = Decode(LookupDefinition(op, wide), ins, start + wide + 1);
+    CHECK_EQ(start + 1 + wide + dec.nbytes, ins.NumBytes());
+    subs[i] = IrInst{op, std::move(dec.operands)};
+    ins.bytes.resize(start);
+    --ins.num_ops;
+    CurrScope().last = last;
+    CurrScope().prev = prev;
+  }
+
+  // Locals of the inlined code, shared by every call inlined in this scope
+  auto& slots = CurrScope().inline_slots;
+  while (has_frame && slots.size() < func.num_locals) {
+    const auto name = fmt::format("$inline{}", slots.size());
+    slots.push_back(CurrTable().Define(name).index);
+  }
+  for (size_t i = num_params; i-- > 0;) {
+    if (!subs[i]) Emit(Opcode::kSetLocal, static_cast<int>(slots[i]));
+  }
+
+  auto cfg = BuildCfg(func.Ins());
+  const auto end = cfg.blocks.size() - 1;
+  for (auto& block : cfg.blocks) {
+    if (block.Returns()) {
+      const auto ret = block.insts.back().op;
+      block.insts.pop_back();
+      if (ret == Opcode::kReturn) block.insts.push_back({Opcode::kNull});
+      block.next = end;
+    }
+    for (auto& inst : block.insts) {
+      if (inst.op != Opcode::kGetLocal && inst.op != Opcode::kSetLocal) {
+        continue;
+      }
+      const auto local = static_cast<size_t>(inst.operands[0]);
+      if (inst.op == Opcode::kGetLocal && local < num_params && subs[local]) {
+        inst = *subs[local];
+      } else {
+        inst.operands[0] = static_cast<int>(slots[local]);
+      }
+    }
+  }
+
+  const auto code = LowerCfg(cfg, ScopedIns().NumBytes());
+  for (size_t i = 0; i < code.NumBytes();) {
+    const bool wide = ToOpcode(code.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(code.ByteAt(i + wide));
+    const auto dec = Decode(LookupDefinition(op, wide), code, i + wide + 1);
+    Emit(op, dec.operands);
+    i += size_t{1} + wide + dec.nbytes;
+  }
+
+  if (!func.pure) CurrScope().pure = false;
+  ++num_inlined_;
+  return true;
+}
+
+absl::StatusOr<bool> Compiler::CompileLiftedLet(const LetStmt& let,
+                                                const Symbol& symbol) {
+  const auto it = CurrScope().lift_lets.find(&let);
+  if (it == CurrScope().lift_lets.end()) return false;
+  const auto& lift = it->second;
+
+  // Only the variables of the enclosing scopes become params, globals and
+  // builtins are loaded the same way from anywhere
+  Lifted lifted;
+  for (const auto& name : lift.reads) {
+    const auto read = CurrTable().Resolve(name);
+    // Leave undefined names to the closure to report
+    if (!read.has_value()) return false;
+    if (read->IsGlobal() || read->scope == SymbolScope::kBuiltin) continue;
+    // Whether the read comes before or after the literal defines the name
+    // is up to the order of the code, which a param would not respect
+    if (lift.defines.contains(name)) return false;
+    lifted.free.push_back(*read);
+  }
+
+  // Reserve the constant so that the body can call itself
+  lifted.index = consts_->size();
+  consts_->push_back(NullObj());
+
+  std::vector<Symbol> free;
+  auto func = CompileFunc(
+      *let.expr.PtrCast<FuncLiteral>(), free, &lifted, let.name.value);
+  if (!func.ok()) return func.status();
+  CHECK(free.empty()) << let.String();
+
+  lifted.pure = func->pure;
+  (*consts_)[lifted.index] = ClosureObj({*func, {}});
+  CurrScope().lifted[let.name.value] = std::move(lifted);
+  if (CurrScope().inline_lets.contains(&let)) {
+    AddInlinable(symbol, *std::move(func));
+  }
+  ++num_lifted_;
+  return true;
+}
+
+absl::Status Compiler::CompileLiftedCall(const CallExpr& call,
+                                         const std::string& name,
+                                         const Lifted& lifted) {
+  // The variables are passed as trailing arguments of the call
+  if (!lifted.self) {
+    const auto symbol = CurrTable().Resolve(name);
+    CHECK(symbol.has_value()) << name;
+    const auto inlined = CompileInlineCall(call, *symbol, lifted.free);
+    if (!inlined.ok()) return inlined.status();
+    if (*inlined) return kOkStatus;
+  }
+
+  Emit(Opcode::kConst, static_cast<int>(lifted.index));
+  for (const auto& arg : call.args) {
+    auto status = CompileImpl(arg);
+    if (!status.ok()) return status;
+  }
+  for (const auto& var : lifted.free) LoadSymbol(var);
+
+  // Calls within the body are like recursive calls to a pure global
+  if (!lifted.self && !lifted.pure) CurrScope().pure = false;
+  const auto num_args = call.args.size() + lifted.free.size();
+  Emit(Opcode::kCall, static_cast<int>(num_args));
+  return kOkStatus;
+}
+
+absl::StatusOr<bool> Compiler::CompileEvaluatedLet(const LetStmt& let) {
+  // Literals compile to a constant already, function literals to a closure
+  switch (let.expr.Type()) {
+    case NodeType::kIntLiteral:
+    case NodeType::kStrLiteral:
+    case NodeType::kFuncLiteral:
+      return false;
+    default:
+      break;
+  }
+
+  // Names defined in the expression would be globals, which it cannot set
+  // when it is not run
+  bool known = true;
+  std::vector<size_t> roots;
+  VisitNames(let.expr, [&](const NameRef& ref) {
+    if (!known) return;
+    if (ref.func != nullptr || ref.use == NameRef::Use::kDefine ||
+        ref.use == NameRef::Use::kAssign) {
+      known = false;
+      return;
+    }
+    const auto symbol = CurrTable().Resolve(std::string(ref.name));
+    if (!symbol.has_value()) {
+      known = false;
+    } else if (symbol->scope == SymbolScope::kBuiltin) {
+      known = IsPureBuiltin(symbol->index);
+    } else {
+      known = known_globals_.contains(symbol->index);
+      roots.push_back(symbol->index);
+    }
+  });
+  if (!known) return false;
+
+  // Set every global the code depends on, then call the expression compiled
+  // as a function without optimizations, which only matter at run time
+  Instruction main;
+  absl::flat_hash_set<size_t> set;
+  while (!roots.empty()) {
+    const auto global = roots.back();
+    roots.pop_back();
+    if (!set.insert(global).second) continue;
+    const auto it = known_globals_.find(global);
+    // A dependency of a known function assigned since
+    if (it == known_globals_.end()) return false;
+    const auto& value = it->second;
+    const auto index = static_cast<int>(value.index);
+    main.Append(value.func ? Encode(Opcode::kClosure, {index, 0})
+                           : Encode(Opcode::kConst, index));
+    main.Append(Encode(Opcode::kSetGlobal, static_cast<int>(global)));
+    roots.insert(roots.end(), value.deps.cbegin(), value.deps.cend());
+  }
+
+  const auto num_consts = consts_->size();
+  const auto num_call_sites = num_call_sites_;
+  const bool optimize = optimize_;
+  optimize_ = false;
+  EnterScope();
+  auto status = CompileImpl(let.expr);
+  if (status.ok()) Emit(Opcode::kReturnVal);
+  const bool pure = CurrScope().pure;
+  const auto num_locals = CurrTable().NumDefs();
+  auto ins = ExitScope();
+  optimize_ = optimize;
+
+  absl::StatusOr<Object> value = MakeError("impure");
+  if (status.ok() && pure) {
+    auto timer = timers_.Scoped("Evaluate");
+    consts_->push_back(CompiledObj(CompiledFunc{
+        std::make_shared<const Instruction>(std::move(ins)), num_locals}));
+    main.Append(Encode(Opcode::kClosure,
+                       {static_cast<int>(consts_->size() - 1), 0}));
+    main.Append(Encode(Opcode::kCall, 0));
+    main.Append(Encode(Opcode::kPop));
+    auto code = std::make_shared<const Instruction>(std::move(main));
+    value = evaluator_({std::move(code), consts_, names_});
+  }
+  DropConstants(num_consts);
+  num_call_sites_ = num_call_sites;
+  // Errors are left to the code to report when it runs
+  if (!status.ok()) return status;
+  if (!value.ok() || !IsData(*value)) return false;
+
+  Emit(Opcode::kConst, static_cast<int>(AddConstant(*std::move(value))));
+  ++num_evaluated_;
+  return true;
+}
+
+void Compiler::AddKnownGlobal(const LetStmt& let,
+                              const Symbol& symbol,
+                              size_t start) {
+  // The value must be the only instruction, not e.g. the last one of a branch
+  const auto& ins = ScopedIns();
+  const auto pos = ScopedLast().pos;
+  if (pos != start || ins.NumBytes() == start) return;
+  const bool wide = ToOpcode(ins.ByteAt(pos)) == Opcode::kWide;
+  const auto op = ToOpcode(ins.ByteAt(pos + wide));
+  const auto dec = Decode(LookupDefinition(op, wide), ins, pos + wide + 1);
+
+  if (op == Opcode::kConst) {
+    known_globals_[symbol.index] = {
+        static_cast<size_t>(dec.operands[0]), false, {}};
+    return;
+  }
+  // Only a pure function can be called with a result known in advance
+  const bool pure_func =
+      let.expr.Type() == NodeType::kFuncLiteral && last_func_pure_;
+  if (op != Opcode::kClosure || dec.operands[1] != 0 || !pure_func) return;
+
+  const auto index = static_cast<size_t>(dec.operands[0]);
+  absl::flat_hash_set<size_t> seen = {index};
+  absl::flat_hash_set<size_t> globals;
+  const auto& func = (*consts_)[index].Cast<CompiledFunc>();
+  CollectGlobals(*consts_, func.Ins(), seen, globals);
+  KnownGlobal known{index, true, {}};
+  for (const auto global : globals) {
+    if (global != symbol.index && !known_globals_.contains(global)) return;
+    known.deps.push_back(global);
+  }
+  known_globals_[symbol.index] = std::move(known);
+}
+
+void Compiler::DropConstants(size_t size) {
+  for (size_t i = size; i < consts_->size(); ++i) {
+    const auto key = MakeConstKey((*consts_)[i]);
+    if (!key) continue;
+    const auto it = const_index_.find(*key);
+    if (it != const_index_.end() && it->second >= size) const_index_.erase(it);
+  }
+  consts_->erase(consts_->begin() + static_cast<ptrdiff_t>(size),
+                 consts_->end());
+}
+
+void Compiler::PrecompileFuncs(const std::vector<StmtNode>& stmts) {
+  auto& pool = DefaultThreadPool();
+  if (pool.InWorker()) return;
+  auto _ = timers_.Scoped("CompileParallel");
+
+  // Globals of this program are numbered as it compiles, so a literal can
+  // only refer to its own name among them
+  absl::flat_hash_set<std::string> defined;
+  for (const auto& stmt : stmts) {
+    VisitStmts(stmt, [&](const StmtNode& node) {
+      if (node.Type() == NodeType::kLetStmt) {
+        defined.insert(node.PtrCast<LetStmt>()->name.value);
+      }
+    });
+  }
+
+  std::vector<const LetStmt*> lets;
+  for (const auto& stmt : stmts) {
+    if (stmt.Type() != NodeType::kLetStmt) continue;
+    const auto* let = stmt.PtrCast<LetStmt>();
+    const auto* literal = let->expr.PtrCast<FuncLiteral>();
+    if (literal == nullptr || precompiled_.contains(literal)) continue;
+
+    const auto& self = let->name.value;
+    absl::flat_hash_set<std::string> locals;
+    VisitNames(let->expr, [&](const NameRef& ref) {
+      if (ref.use == NameRef::Use::kDefine) locals.emplace(ref.name);
+    });
+
+    bool independent = true;
+    absl::flat_hash_set<size_t> pure;
+    VisitNames(let->expr, [&](const NameRef& ref) {
+      if (!independent || ref.name == self) return;
+      const auto name = std::string(ref.name);
+      if (defined.contains(name)) {
+        independent = false;
+        return;
+      }
+      if (locals.contains(name)) return;
+      const auto symbol = CurrTable().Resolve(name);
+      if (!symbol.has_value()) {
+        independent = false;
+      } else if (symbol->IsGlobal() && pure_globals_.contains(symbol->index)) {
+        pure.insert(symbol->index);
+      }
+    });
+    if (!independent) continue;
+
+    Precompiled task;
+    task.worker.reset(new Compiler(CurrTable()));
+    task.worker->fold_constants_ = fold_constants_;
+    task.worker->optimize_ = optimize_;
+    task.worker->pure_globals_ = std::move(pure);
+    precompiled_[literal] = std::move(task);
+    lets.push_back(let);
+  }
+  if (lets.size() < 2) {
+    precompiled_.clear();
+    return;
+  }
+
+  // The symbol table and globals of this compiler are only read while it
+  // waits
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t remaining = lets.size();
+
+  for (const auto* let : lets) {
+    const auto* literal = let->expr.PtrCast<FuncLiteral>();
+    auto* task = &precompiled_.at(literal);
+    pool.Submit([&, let, literal, task](size_t) {
+      auto& worker = *task->worker;
+      task->self = worker.CurrTable().Define(let->name.value).index;
+      worker.defining_ = task->self;
+      std::vector<Symbol> free;
+      task->func = worker.CompileFunc(*literal, free);
+
+      std::lock_guard<std::mutex> lock{mutex};
+      if (--remaining == 0) cv.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock{mutex};
+  cv.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+bool Compiler::MergeFunc(Precompiled& task) {
+  // Errors are reported by compiling the literal again
+  if (!task.func.ok() || !defining_.has_value()) return false;
+  const auto& worker = *task.worker;
+  const auto& local = *worker.consts_;
+
+  Renumbering map;
+  map.self = task.self;
+  map.new_self = *defining_;
+  map.first_call_site = num_call_sites_;
+
+  // Add the constants in the order the worker did, so they get the same
+  // indices as they would have here. Lifted closures are set after their
+  // body like in CompileLiftedLet.
+  const auto start = consts_->size();
+  std::vector<size_t> lifted;
+  bool ok = true;
+  for (size_t i = 0; ok && i < local.size(); ++i) {
+    const auto& obj = local[i];
+    if (obj.Type() == ObjectType::kCompiled) {
+      auto func = Renumber(obj.Cast<CompiledFunc>(), map);
+      ok = func.has_value();
+      if (ok) map.consts.push_back(AddConstant(CompiledObj(*std::move(func))));
+    } else if (obj.Type() == ObjectType::kClosure) {
+      lifted.push_back(i);
+      map.consts.push_back(consts_->size());
+      consts_->push_back(NullObj());
+    } else {
+      map.consts.push_back(AddConstant(obj));
+    }
+  }
+  for (const auto i : lifted) {
+    if (!ok) break;
+    auto func = Renumber(local[i].Cast<Closure>().func, map);
+    ok = func.has_value();
+    if (ok) (*consts_)[map.consts[i]] = ClosureObj({*std::move(func), {}});
+  }
+  auto func = ok ? Renumber(*task.func, map) : absl::nullopt;
+  if (!func) {
+    DropConstants(start);
+    return false;
+  }
+
+  task.func = *std::move(func);
+  num_call_sites_ += worker.num_call_sites_;
+  num_inlined_ += worker.num_inlined_;
+  num_lifted_ += worker.num_lifted_;
+  num_specialized_ += worker.num_specialized_;
+  last_func_pure_ = worker.last_func_pure_;
+  ++num_parallel_;
+  return true;
+}
+
 }  // namespace monkey
@@ -37,6 +37,20 @@ Object UnwrapReturn(const Object& obj) {
   return obj.Type() == ObjectType::kReturn ? obj.Cast<Object>() : obj;
 }
 
+/// Lets higher-order builtins call back into the evaluator
+template <typename F>
+class FuncCaller final : public Caller {
+ public:
+  explicit FuncCaller(F func) : func_{std::move(func)} {}
+
+  Object Call(const Object& func, absl::Span<const Object> args) override {
+    return func_(func, args);
+  }
+
+ private:
+  F func_;
+};
+
 }  // namespace
 
 Object Evaluator::Evaluate(const Program& program, Environment& env) const {
@@ -60,6 +74,19 @@ Object Evaluator::Evaluate(const AstNode& node, Environment& env) const {
       if (IsObjError(obj)) return obj;
       return env.Set(node.PtrCast<LetStmt>()->name.String(), obj);
     }
+    case NodeType::kAssignStmt: {
+      return EvalAssignStmt(*node.PtrCast<AssignStmt>(), env);
+    }
+    case NodeType::kWhileStmt: {
+      const auto* ptr = node.PtrCast<WhileStmt>();
+      return EvalLoop(ptr->cond, ptr->body, {}, env);
+    }
+    case NodeType::kForStmt: {
+      const auto* ptr = node.PtrCast<ForStmt>();
+      auto obj = Evaluate(ptr->init, env);
+      if (IsObjError(obj)) return obj;
+      return EvalLoop(ptr->cond, ptr->body, ptr->update, env);
+    }
     case NodeType::kIntLiteral: {
       return ToIntObj(node);
     }
@@ -96,8 +123,15 @@ Object Evaluator::Evaluate(const AstNode& node, Environment& env) const {
     }
     case NodeType::kFuncLiteral: {
       const auto* ptr = node.PtrCast<FuncLiteral>();
-      return FuncObj(
-          {ptr->params, ptr->body, std::make_shared<Environment>(env)});
+      // Globals are shared like in the vm, so functions see later lets and
+      // assignments of them. The caller keeps the global environment alive
+      // while the program runs, so it is not owned.
+      auto captured =
+          env.IsGlobal()
+              ? std::shared_ptr<const Environment>{std::shared_ptr<void>{},
+                                                   &env}
+              : std::make_shared<Environment>(env);
+      return FuncObj({ptr->params, ptr->body, std::move(captured)});
     }
     case NodeType::kArrayLiteral: {
       const auto* ptr = node.PtrCast<ArrayLiteral>();
@@ -138,6 +172,9 @@ Object Evaluator::Evaluate(const AstNode& node, Environment& env) const {
 
       return ApplyFunc(func, args);
     }
+    case NodeType::kYieldExpr: {
+      return ErrorObj("yield is only supported by the vm");
+    }
     default:
       return NullObj();
   }
@@ -161,11 +198,8 @@ Object Evaluator::EvalIdentifier(const Identifier& ident,
   if (obj.Ok()) return obj;
 
   // see if it is built in
-  auto it = std::find_if(
-      GetBuiltins().begin(), GetBuiltins().end(), [&ident](const Object& obj) {
-        return obj.Cast<BuiltinFunc>().name == ident.value;
-      });
-  if (it != GetBuiltins().end()) return *it;
+  const auto index = FindBuiltin(ident.value);
+  if (index >= 0) return GetBuiltins()[static_cast<size_t>(index)];
 
   obj = ErrorObj(fmt::format("{}: {}", kIdentNotFound, ident.value));
   return obj;
@@ -268,6 +302,50 @@ Object Evaluator::EvalBlockStmt(const BlockStmt& block,
   return obj;
 }
 
+Object Evaluator::EvalAssignStmt(const AssignStmt& stmt,
+                                 Environment& env) const {
+  const auto& name = stmt.name.value;
+  if (!env.Contains(name)) {
+    // Functions see a copy of the locals of the scope they were defined in, so
+    // only the scope that defined a variable may assign to it (same as the vm)
+    if (env.Get(name).Ok()) {
+      return ErrorObj(fmt::format(
+          "cannot assign to {} outside the scope that defines it", name));
+    }
+    if (FindBuiltin(name) >= 0) {
+      return ErrorObj("cannot assign to builtin " + name);
+    }
+    return ErrorObj(fmt::format("{}: {}", kIdentNotFound, name));
+  }
+
+  auto obj = Evaluate(stmt.expr, env);
+  if (IsObjError(obj)) return obj;
+  return env.Set(name, obj);
+}
+
+Object Evaluator::EvalLoop(const ExprNode& cond,
+                           const BlockStmt& body,
+                           const StmtNode& update,
+                           Environment& env) const {
+  while (true) {
+    auto obj = Evaluate(cond, env);
+    if (IsObjError(obj)) return obj;
+    if (!IsObjTruthy(obj)) break;
+
+    obj = EvalBlockStmt(body, env);
+    if (obj.Type() == ObjectType::kReturn || obj.Type() == ObjectType::kError) {
+      return obj;
+    }
+
+    if (update.Ok()) {
+      obj = Evaluate(update, env);
+      if (IsObjError(obj)) return obj;
+    }
+  }
+
+  return NullObj();
+}
+
 Object Evaluator::EvalDictLiteral(const DictLiteral& expr,
                                   Environment& env) const {
   Dict dict;
@@ -359,13 +437,23 @@ Object Evaluator::ApplyFunc(const Object& obj,
   switch (obj.Type()) {
     case ObjectType::kFunc: {
       const auto& fn_obj = obj.Cast<FuncObject>();
+      if (fn_obj.params.size() != args.size()) {
+        return ErrorObj(
+            fmt::format("wrong number of arguments: want={}, got={}",
+                        fn_obj.params.size(),
+                        args.size()));
+      }
       auto fn_env = ExtendFunctionEnv(fn_obj, args);
       const auto ret_obj = EvalBlockStmt(fn_obj.body, fn_env);
       return UnwrapReturn(ret_obj);
     }
     case ObjectType::kBuiltinFunc: {
       const auto& fn_obj = obj.Cast<BuiltinFunc>();
-      return fn_obj.func(args);
+      FuncCaller caller{[this](const Object& func,
+                               absl::Span<const Object> call_args) {
+        return ApplyFunc(func, {call_args.begin(), call_args.end()});
+      }};
+      return fn_obj(args, caller);
     }
     default:
       return ErrorObj(fmt::format("{}: {}", kNotAFunc, obj.Type()));
@@ -0,0 +1,321 @@
+#include "monkey/folder.h"
+
+#include <glog/logging.h>
+
+#include <limits>
+
+namespace monkey {
+
+namespace {
+
+bool DefinesNames(const BlockStmt& block) {
+  bool found = false;
+  VisitBlock(block, [&](const StmtNode& node) {
+    found = found || node.Type() == NodeType::kLetStmt;
+  });
+  return found;
+}
+
+bool IsLiteral(const ExprNode& expr) {
+  switch (expr.Type()) {
+    case NodeType::kIntLiteral:
+    case NodeType::kBoolLiteral:
+    case NodeType::kStrLiteral:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Same as IsObjTruthy, literals are never null
+bool IsTruthy(const ExprNode& literal) {
+  if (literal.Type() != NodeType::kBoolLiteral) return true;
+  return literal.PtrCast<BoolLiteral>()->value;
+}
+
+ExprNode MakeInt(IntType value) {
+  IntLiteral lit;
+  lit.token = {TokenType::kInt, std::to_string(value)};
+  lit.value = value;
+  return lit;
+}
+
+ExprNode MakeBool(BoolType value) {
+  BoolLiteral lit;
+  lit.token = value ? Token{TokenType::kTrue, "true"}
+                    : Token{TokenType::kFalse, "false"};
+  lit.value = value;
+  return lit;
+}
+
+ExprNode MakeStr(StrType value) {
+  StrLiteral lit;
+  lit.token = {TokenType::kStr, value};
+  lit.value = std::move(value);
+  return lit;
+}
+
+/// Mirrors VirtualMachine::ExecIntBinaryOp and ExecIntComp, returns an invalid
+/// node if the op is unknown or would overflow or divide by zero
+ExprNode FoldIntOp(IntType lv, const std::string& op, IntType rv) {
+  IntType res{};
+  if (op == "+") {
+    if (__builtin_add_overflow(lv, rv, &res)) return {};
+  } else if (op == "-") {
+    if (__builtin_sub_overflow(lv, rv, &res)) return {};
+  } else if (op == "*") {
+    if (__builtin_mul_overflow(lv, rv, &res)) return {};
+  } else if (op == "/") {
+    if (rv == 0) return {};
+    if (lv == std::numeric_limits<IntType>::min() && rv == -1) return {};
+    res = lv / rv;
+  } else if (op == ">") {
+    return MakeBool(lv > rv);
+  } else if (op == "<") {
+    return MakeBool(lv < rv);
+  } else if (op == "==") {
+    return MakeBool(lv == rv);
+  } else if (op == "!=") {
+    return MakeBool(lv != rv);
+  } else {
+    return {};
+  }
+  return MakeInt(res);
+}
+
+}  // namespace
+
+ConstantFolder::ConstantFolder() { scopes_.emplace_back(); }
+
+absl::StatusOr<Program> ConstantFolder::Fold(const Program& program) {
+  CHECK_EQ(scopes_.size(), 1);
+
+  // Globals assigned anywhere in the program are not constant, including ones
+  // folded by an earlier program
+  auto& global = scopes_.front();
+  global.assigned = AssignedNames(program.statements);
+  for (const auto& name : global.assigned) global.consts.erase(name);
+
+  Program folded;
+  for (const auto& stmt : program.statements) {
+    folded.statements.push_back(FoldStmt(stmt, false));
+  }
+  return folded;
+}
+
+StmtNode ConstantFolder::FoldStmt(const StmtNode& stmt, bool conditional) {
+  switch (stmt.Type()) {
+    case NodeType::kLetStmt: {
+      auto let = *stmt.PtrCast<LetStmt>();
+      const auto& name = let.name.value;
+      // The compiler defines the name before compiling the value
+      scopes_.back().consts[name] = {};
+      let.expr = FoldExpr(let.expr);
+
+      auto& scope = scopes_.back();
+      const auto constant = !conditional && !scope.assigned.contains(name);
+      if (constant && IsLiteral(let.expr)) scope.consts[name] = let.expr;
+      return let;
+    }
+    case NodeType::kAssignStmt: {
+      auto assign = *stmt.PtrCast<AssignStmt>();
+      assign.expr = FoldExpr(assign.expr);
+      return assign;
+    }
+    case NodeType::kExprStmt: {
+      auto expr_stmt = *stmt.PtrCast<ExprStmt>();
+      expr_stmt.expr = FoldExpr(expr_stmt.expr);
+      return expr_stmt;
+    }
+    case NodeType::kReturnStmt: {
+      auto ret = *stmt.PtrCast<ReturnStmt>();
+      ret.expr = FoldExpr(ret.expr);
+      return ret;
+    }
+    case NodeType::kWhileStmt: {
+      auto loop = *stmt.PtrCast<WhileStmt>();
+      loop.cond = FoldExpr(loop.cond);
+      loop.body = FoldBlock(loop.body, true);
+      return loop;
+    }
+    case NodeType::kForStmt: {
+      auto loop = *stmt.PtrCast<ForStmt>();
+      loop.init = FoldStmt(loop.init, conditional);
+      loop.cond = FoldExpr(loop.cond);
+      if (loop.update.Ok()) loop.update = FoldStmt(loop.update, true);
+      loop.body = FoldBlock(loop.body, true);
+      return loop;
+    }
+    default:
+      return stmt;
+  }
+}
+
+BlockStmt ConstantFolder::FoldBlock(const BlockStmt& block, bool conditional) {
+  auto folded = block;
+  for (auto& stmt : folded.statements) stmt = FoldStmt(stmt, conditional);
+  return folded;
+}
+
+ExprNode ConstantFolder::FoldExpr(const ExprNode& expr) {
+  switch (expr.Type()) {
+    case NodeType::kIdentifier:
+      return FoldIdentifier(expr);
+    case NodeType::kPrefixExpr:
+      return FoldPrefixExpr(*expr.PtrCast<PrefixExpr>());
+    case NodeType::kInfixExpr:
+      return FoldInfixExpr(*expr.PtrCast<InfixExpr>());
+    case NodeType::kIfExpr:
+      return FoldIfExpr(*expr.PtrCast<IfExpr>());
+    case NodeType::kFuncLiteral:
+      return FoldFuncLiteral(*expr.PtrCast<FuncLiteral>());
+    case NodeType::kCallExpr: {
+      auto call = *expr.PtrCast<CallExpr>();
+      call.func = FoldExpr(call.func);
+      for (auto& arg : call.args) arg = FoldExpr(arg);
+      return call;
+    }
+    case NodeType::kIndexExpr: {
+      auto index = *expr.PtrCast<IndexExpr>();
+      index.lhs = FoldExpr(index.lhs);
+      index.index = FoldExpr(index.index);
+      return index;
+    }
+    case NodeType::kArrayLiteral: {
+      auto arr = *expr.PtrCast<ArrayLiteral>();
+      for (auto& elem : arr.elements) elem = FoldExpr(elem);
+      return arr;
+    }
+    case NodeType::kDictLiteral: {
+      auto dict = *expr.PtrCast<DictLiteral>();
+      for (auto& [k, v] : dict.pairs) {
+        k = FoldExpr(k);
+        v = FoldExpr(v);
+      }
+      return dict;
+    }
+    case NodeType::kYieldExpr: {
+      auto yield = *expr.PtrCast<YieldExpr>();
+      yield.value = FoldExpr(yield.value);
+      return yield;
+    }
+    default:
+      return expr;
+  }
+}
+
+ExprNode ConstantFolder::FoldIdentifier(const ExprNode& expr) {
+  const auto& name = expr.PtrCast<Identifier>()->value;
+  for (auto it = scopes_.rbegin(); it != scopes_.rend(); ++it) {
+    const auto found = it->consts.find(name);
+    if (found == it->consts.end()) continue;
+    if (!found->second.Ok()) return expr;
+    // The vm reads globals when the function runs, a later program may have
+    // assigned them by then
+    if (std::next(it) == scopes_.rend() && scopes_.size() > 1) return expr;
+
+    ++num_folded_;
+    return found->second;
+  }
+  // Builtin or undefined, the compiler deals with it
+  return expr;
+}
+
+ExprNode ConstantFolder::FoldPrefixExpr(const PrefixExpr& expr) {
+  auto folded = expr;
+  folded.rhs = FoldExpr(expr.rhs);
+  const auto& rhs = folded.rhs;
+  if (!IsLiteral(rhs)) return folded;
+
+  // Mirrors VirtualMachine::ExecBangOp and ExecMinusOp
+  if (expr.op == "!") {
+    ++num_folded_;
+    return MakeBool(!IsTruthy(rhs));
+  }
+  if (expr.op == "-" && rhs.Type() == NodeType::kIntLiteral) {
+    const auto value = rhs.PtrCast<IntLiteral>()->value;
+    if (value == std::numeric_limits<IntType>::min()) return folded;
+    ++num_folded_;
+    return MakeInt(-value);
+  }
+  return folded;
+}
+
+ExprNode ConstantFolder::FoldInfixExpr(const InfixExpr& expr) {
+  auto folded = expr;
+  folded.lhs = FoldExpr(expr.lhs);
+  folded.rhs = FoldExpr(expr.rhs);
+  const auto& lhs = folded.lhs;
+  const auto& rhs = folded.rhs;
+  if (lhs.Type() != rhs.Type()) return folded;
+
+  ExprNode res;
+  switch (lhs.Type()) {
+    case NodeType::kIntLiteral:
+      res = FoldIntOp(lhs.PtrCast<IntLiteral>()->value,
+                      expr.op,
+                      rhs.PtrCast<IntLiteral>()->value);
+      break;
+    case NodeType::kBoolLiteral: {
+      // Mirrors VirtualMachine::ExecComparison
+      const auto lv = lhs.PtrCast<BoolLiteral>()->value;
+      const auto rv = rhs.PtrCast<BoolLiteral>()->value;
+      if (expr.op == "==") res = MakeBool(lv == rv);
+      if (expr.op == "!=") res = MakeBool(lv != rv);
+      break;
+    }
+    case NodeType::kStrLiteral:
+      // Mirrors VirtualMachine::ExecStrBinaryOp
+      if (expr.op == "+") {
+        res = MakeStr(lhs.PtrCast<StrLiteral>()->value +
+                      rhs.PtrCast<StrLiteral>()->value);
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!res.Ok()) return folded;
+  ++num_folded_;
+  return res;
+}
+
+ExprNode ConstantFolder::FoldIfExpr(const IfExpr& expr) {
+  auto folded = expr;
+  folded.cond = FoldExpr(expr.cond);
+  folded.true_block = FoldBlock(expr.true_block, true);
+  folded.false_block = FoldBlock(expr.false_block, true);
+  if (!IsLiteral(folded.cond)) return folded;
+
+  // Lets define their names even if the branch never runs, so a dead branch
+  // with lets has to stay
+  const auto truthy = IsTruthy(folded.cond);
+  auto& dead = truthy ? folded.false_block : folded.true_block;
+  if (DefinesNames(dead)) return folded;
+
+  // The compiler emits no jumps for a bool condition with an empty dead block
+  if (!dead.empty()) ++num_folded_;
+  folded.cond = MakeBool(truthy);
+  dead.statements.clear();
+  return folded;
+}
+
+ExprNode ConstantFolder::FoldFuncLiteral(const FuncLiteral& func) {
+  auto folded = func;
+  EnterScope(func.body.statements);
+  for (const auto& param : func.params) scopes_.back().consts[param.value] = {};
+  folded.body = FoldBlock(func.body, false);
+  ExitScope();
+  return folded;
+}
+
+void ConstantFolder::EnterScope(const std::vector<StmtNode>& stmts) {
+  scopes_.push_back({{}, AssignedNames(stmts)});
+}
+
+void ConstantFolder::ExitScope() {
+  CHECK_GT(scopes_.size(), 1);
+  scopes_.pop_back();
+}
+
+}  // namespace monkey
@@ -2,7 +2,7 @@
 
 #include <absl/strings/str_join.h>
 #include <absl/types/span.h>
-#include <fmt/core.h>
+#include <fmt/ostream.h>
 #include <glog/logging.h>
 
 namespace monkey {
@@ -16,11 +16,14 @@ std::string FormatInstruction(const Definition& def,
 
   switch (num_operands) {
     case 0:
-      return def.name;
+      return std::string(def.name);
     case 1:
       return fmt::format("{} {}", def.name, operands[0]);
     case 2:
       return fmt::format("{} {} {}", def.name, operands[0], operands[1]);
+    case 3:
+      return fmt::format(
+          "{} {} {} {}", def.name, operands[0], operands[1], operands[2]);
     default:
       CHECK(false) << "Should not reach here";
   }
@@ -31,8 +34,8 @@ std::string FormatInstruction(const Definition& def,
 }  // namespace
 
 void Instruction::Append(const Instruction& ins) {
-  // just be sure we call reserve explicitly
-  bytes.reserve(bytes.size() + ins.NumBytes());
+  // No reserve, an exact one would defeat the geometric growth of insert and
+  // make appending one instruction at a time quadratic
   bytes.insert(bytes.end(), ins.bytes.cbegin(), ins.bytes.cend());
   ++num_ops;
 }
@@ -44,10 +47,11 @@ Byte Instruction::PopBack() {
   return byte;
 }
 
-size_t Instruction::EncodeOpcode(Opcode op, size_t total_bytes) {
+size_t Instruction::EncodeOpcode(Opcode op, size_t total_bytes, bool wide) {
   ++num_ops;
   auto nbytes = NumBytes();
   bytes.resize(nbytes + total_bytes);
+  if (wide) bytes[nbytes++] = ToByte(Opcode::kWide);
   bytes[nbytes] = ToByte(op);
   return nbytes + 1;
 }
@@ -64,21 +68,52 @@ void Instruction::EncodeOperand(size_t offset, size_t nbytes, int operand) {
       CHECK_LE(operand, std::numeric_limits<uint16_t>::max());
       PutUint16(&bytes[offset], static_cast<uint16_t>(operand));
       break;
+    case 4:
+      PutUint32(&bytes[offset], static_cast<uint32_t>(operand));
+      break;
     default:
       CHECK(false) << "Should not reach here";
   }
 }
 
+size_t Instruction::Emit(Opcode op, absl::Span<const int> operands, bool wide) {
+  const auto& info = GetOpcodeInfo(op);
+  CHECK_EQ(info.num_operands, operands.size()) << monkey::Repr(op);
+  size_t operand_bytes = 0;
+  for (size_t i = 0; i < operands.size(); ++i) {
+    const auto max = info.operand_bytes[i] == 1
+                         ? std::numeric_limits<uint8_t>::max()
+                         : std::numeric_limits<uint16_t>::max();
+    wide = wide || operands[i] > max;
+    operand_bytes += info.operand_bytes[i];
+  }
+
+  const auto pos = NumBytes();
+  const auto total_bytes = wide ? 2 + 2 * operand_bytes : 1 + operand_bytes;
+  auto offset = EncodeOpcode(op, total_bytes, wide);
+  const size_t scale = wide ? 2 : 1;
+  for (size_t i = 0; i < operands.size(); ++i) {
+    EncodeOperand(offset, info.operand_bytes[i] * scale, operands[i]);
+    offset += info.operand_bytes[i] * scale;
+  }
+  return pos;
+}
+
 std::string Instruction::Repr() const {
   std::vector<std::string> strs;
   strs.reserve(NumOps());
 
   size_t i = 0;
   while (i < bytes.size()) {
-    const auto def = LookupDefinition(ToOpcode(bytes[i]));
+    const bool wide = ToOpcode(bytes[i]) == Opcode::kWide;
+    const auto start = i;
+    if (wide) ++i;  // the prefix is shown with the instruction it widens
+    const auto def = LookupDefinition(ToOpcode(bytes[i]), wide);
     const auto dec = Decode(def, *this, i + 1);  // +1 is to skip the opcode
-    strs.push_back(
-        fmt::format("{:04d} {}", i, FormatInstruction(def, dec.operands)));
+    strs.push_back(fmt::format("{:04d} {}{}",
+                               start,
+                               wide ? "OpWide " : "",
+                               FormatInstruction(def, dec.operands)));
     i += size_t{1} + dec.nbytes;  // opcode (1) + num bytes
   }
   return absl::StrJoin(strs, "\n");
@@ -97,31 +132,20 @@ Instruction ConcatInstructions(const std::vector<Instruction>& instrs) {
 }
 
 Instruction Encode(Opcode op, int operand) {
-  const auto def = LookupDefinition(op);
-  CHECK_EQ(def.NumOperands(), 1) << def;
-  const auto total_bytes = def.SumOperandBytes() + 1;
-
   Instruction ins;
-  const auto offset = ins.EncodeOpcode(op, total_bytes);
-  const auto nbytes = def.operand_bytes.at(0);
-  ins.EncodeOperand(offset, nbytes, operand);
+  ins.Emit(op, {operand});
   return ins;
 }
 
 Instruction Encode(Opcode op, const std::vector<int>& operands) {
-  const auto def = LookupDefinition(op);
-  CHECK_EQ(def.NumOperands(), operands.size()) << def;
-  const auto total_bytes = def.SumOperandBytes() + 1;
-
   Instruction ins;
-  auto offset = ins.EncodeOpcode(op, total_bytes);
-
-  for (size_t i = 0; i < operands.size(); ++i) {
-    const auto nbytes = def.operand_bytes[i];
-    ins.EncodeOperand(offset, nbytes, operands[i]);
-    offset += nbytes;
-  }
+  ins.Emit(op, operands);
+  return ins;
+}
 
+Instruction EncodeWide(Opcode op, const std::vector<int>& operands) {
+  Instruction ins;
+  ins.Emit(op, operands, true);
   return ins;
 }
 
@@ -140,6 +164,10 @@ Decoded Decode(const Definition& def, const Instruction& ins, size_t offset) {
       case 2:
         dec.operands.push_back(ReadUint16(ins.BytePtr(dec.nbytes + offset)));
         break;
+      case 4:
+        dec.operands.push_back(
+            static_cast<int>(ReadUint32(ins.BytePtr(dec.nbytes + offset))));
+        break;
       default:
         CHECK(false) << "Should not reach here";
     }
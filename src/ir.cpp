@@ -0,0 +1,181 @@
+#include "monkey/ir.h"
+
+#include <absl/strings/str_join.h>
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+namespace monkey {
+
+namespace {
+
+bool IsJump(Opcode op) {
+  return op == Opcode::kJump || op == Opcode::kJumpNotTrue ||
+         op == Opcode::kJumpNotTrueBool;
+}
+
+bool IsReturn(Opcode op) {
+  return op == Opcode::kReturn || op == Opcode::kReturnVal;
+}
+
+void AppendInst(Instruction& ins, const IrInst& inst) {
+  ins.Emit(inst.op, inst.operands);
+}
+
+}  // namespace
+
+std::string IrInst::Repr() const {
+  auto str = monkey::Repr(op);
+  if (!operands.empty()) str += " " + absl::StrJoin(operands, " ");
+  return str;
+}
+
+bool BasicBlock::Returns() const noexcept {
+  return !insts.empty() && IsReturn(insts.back().op);
+}
+
+std::string Cfg::Repr() const {
+  std::vector<std::string> strs;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const auto& block = blocks[i];
+    strs.push_back(fmt::format("B{}", i));
+    for (const auto& inst : block.insts) strs.push_back("  " + inst.Repr());
+    if (block.cond) {
+      strs.push_back(
+          fmt::format("  if B{} else B{}", block.next, block.target));
+    } else if (block.next != kNoBlock) {
+      strs.push_back(fmt::format("  goto B{}", block.next));
+    }
+  }
+  return absl::StrJoin(strs, "\n");
+}
+
+Cfg BuildCfg(const Instruction& ins) {
+  struct Entry {
+    size_t pos;
+    size_t end;  // position of the next instruction
+    IrInst inst;
+  };
+
+  // Decode everything first to find where blocks start
+  const auto size = ins.NumBytes();
+  std::vector<Entry> entries;
+  std::vector<bool> leader(size + 1, false);
+  leader[0] = true;
+  for (size_t i = 0; i < size;) {
+    const bool wide = ToOpcode(ins.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(ins.ByteAt(i + wide));
+    auto dec = Decode(LookupDefinition(op, wide), ins, i + wide + 1);
+    const auto end = i + size_t{1} + wide + dec.nbytes;
+    if (IsJump(op)) leader[static_cast<size_t>(dec.operands[0])] = true;
+    if (IsJump(op) || IsReturn(op)) leader[end] = true;
+    entries.push_back({i, end, {op, std::move(dec.operands)}});
+    i = end;
+  }
+
+  // Number the blocks in layout order, the end of the code gets the last one
+  std::vector<size_t> block_of(size + 1, kNoBlock);
+  size_t num_blocks = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (leader[i]) block_of[i] = num_blocks++;
+  }
+  block_of[size] = num_blocks++;
+
+  Cfg cfg;
+  cfg.blocks.resize(num_blocks);
+  size_t curr = 0;
+  bool open = true;  // whether curr can still fall through
+  for (const auto& entry : entries) {
+    if (entry.pos != 0 && leader[entry.pos]) {
+      if (open) cfg.blocks[curr].next = block_of[entry.pos];
+      curr = block_of[entry.pos];
+      open = true;
+    }
+
+    auto& block = cfg.blocks[curr];
+    const auto op = entry.inst.op;
+    if (op == Opcode::kJump) {
+      block.next = block_of[static_cast<size_t>(entry.inst.operands[0])];
+      open = false;
+    } else if (op == Opcode::kJumpNotTrue || op == Opcode::kJumpNotTrueBool) {
+      block.cond = true;
+      block.bool_cond = op == Opcode::kJumpNotTrueBool;
+      block.target = block_of[static_cast<size_t>(entry.inst.operands[0])];
+      block.next = block_of[entry.end];
+      open = false;
+    } else {
+      block.insts.push_back(entry.inst);
+      if (IsReturn(op)) open = false;
+    }
+  }
+  if (open && !entries.empty()) cfg.blocks[curr].next = num_blocks - 1;
+
+  return cfg;
+}
+
+Instruction LowerCfg(const Cfg& cfg, size_t origin) {
+  struct Jump {
+    Opcode op;
+    size_t block;
+    bool wide;
+  };
+
+  const auto num_blocks = cfg.blocks.size();
+  std::vector<Instruction> bodies(num_blocks);
+  std::vector<std::vector<Jump>> jumps(num_blocks);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    const auto& block = cfg.blocks[i];
+    for (const auto& inst : block.insts) AppendInst(bodies[i], inst);
+
+    if (block.Returns()) continue;
+    const auto following = i + 1 < num_blocks ? i + 1 : kNoBlock;
+    if (block.cond) {
+      const auto op =
+          block.bool_cond ? Opcode::kJumpNotTrueBool : Opcode::kJumpNotTrue;
+      jumps[i].push_back({op, block.target, false});
+    }
+    if (block.next != following) {
+      // Only the end of the program has nowhere to go, it must come last
+      CHECK_NE(block.next, kNoBlock) << "block " << i << " falls off the end";
+      jumps[i].push_back({Opcode::kJump, block.next, false});
+    }
+  }
+
+  // Start with narrow jumps and widen the ones whose target is out of range,
+  // which moves later blocks, until the layout is stable
+  std::vector<size_t> starts(num_blocks + 1);
+  for (bool changed = true; changed;) {
+    size_t pos = origin;
+    for (size_t i = 0; i < num_blocks; ++i) {
+      starts[i] = pos;
+      pos += bodies[i].NumBytes();
+      for (const auto& jump : jumps[i]) pos += jump.wide ? 6 : 3;
+    }
+    starts.back() = pos;
+
+    changed = false;
+    for (auto& block_jumps : jumps) {
+      for (auto& jump : block_jumps) {
+        if (!jump.wide &&
+            starts[jump.block] > std::numeric_limits<uint16_t>::max()) {
+          jump.wide = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  Instruction out;
+  out.bytes.reserve(starts.back() - origin);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    const auto& body = bodies[i].bytes;
+    out.bytes.insert(out.bytes.end(), body.cbegin(), body.cend());
+    out.num_ops += bodies[i].NumOps();
+    for (const auto& jump : jumps[i]) {
+      const auto dst = static_cast<int>(starts[jump.block]);
+      out.Emit(jump.op, {dst}, jump.wide);
+    }
+  }
+  return out;
+}
+
+}  // namespace monkey
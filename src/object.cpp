@@ -5,6 +5,8 @@
 #include <fmt/ostream.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+
 namespace monkey {
 
 namespace {
@@ -30,6 +32,8 @@ const auto gObjectTypeStrings = absl::flat_hash_map<ObjectType, std::string>{
     {ObjectType::kCompiled, "COMPILED"},
     {ObjectType::kBuiltinFunc, "BUILTIN_FUNC"},
     {ObjectType::kClosure, "CLOSURE"},
+    {ObjectType::kGenerator, "GENERATOR"},
+    {ObjectType::kChannel, "CHANNEL"},
 };
 
 }  // namespace
@@ -53,7 +57,25 @@ std::string FuncObject::Inspect() const {
 
 std::string CompiledFunc::Inspect() const {
   //  return fmt::format("{}", fmt::ptr(this));
-  return ins.Repr();
+  return ins == nullptr ? std::string{} : ins->Repr();
+}
+
+Object Caller::Resume(const Object&) {
+  return ErrorObj("generators are only supported by the vm");
+}
+
+Object Caller::Spawn(const Object&) {
+  return ErrorObj("tasks are only supported by the vm");
+}
+
+bool Caller::Block(WaitQueue&) { return false; }
+
+void Caller::Wake(WaitQueue&) {}
+
+void Caller::Parallel(size_t n, const ParallelTask& task) {
+  for (size_t i = 0; i < n; ++i) {
+    task(i, *this);
+  }
 }
 
 std::string Object::Inspect() const {
@@ -86,6 +108,10 @@ std::string Object::Inspect() const {
       return Cast<CompiledFunc>().Inspect();
     case ObjectType::kClosure:
       return Cast<Closure>().Inspect();
+    case ObjectType::kGenerator:
+      return fmt::format("generator({})", fmt::ptr(Cast<GeneratorPtr>()));
+    case ObjectType::kChannel:
+      return fmt::format("chan({})", fmt::ptr(Cast<ChannelPtr>()));
     default:
       return fmt::format("Unknown type: {}", Type());
   }
@@ -105,6 +131,18 @@ Object FuncObj(const FuncObject& fn) { return {ObjectType::kFunc, fn}; }
 Object ArrayObj(Array arr) { return {ObjectType::kArray, std::move(arr)}; }
 Object DictObj(Dict dict) { return {ObjectType::kDict, std::move(dict)}; }
 Object QuoteObj(const ExprNode& expr) { return {ObjectType::kQuote, expr}; }
+BuiltinFunc::BuiltinFunc(std::string name, Fn fn)
+    : BuiltinFunc{std::move(name),
+                  [](const BuiltinFunc& self,
+                     absl::Span<const Object> args,
+                     Caller& caller) {
+                    return reinterpret_cast<Fn>(self.target)(args, caller);
+                  },
+                  reinterpret_cast<Erased>(fn)} {}
+
+BuiltinFunc::BuiltinFunc(std::string name, Invoker invoke, Erased target)
+    : name{std::move(name)}, invoke{invoke}, target{target} {}
+
 Object BuiltinObj(BuiltinFunc fn) {
   return {ObjectType::kBuiltinFunc, std::move(fn)};
 }
@@ -112,9 +150,21 @@ Object CompiledObj(CompiledFunc fn) {
   return {ObjectType::kCompiled, std::move(fn)};
 }
 Object CompiledObj(const std::vector<Instruction>& ins) {
-  return {ObjectType::kCompiled, CompiledFunc{ConcatInstructions(ins)}};
+  return {ObjectType::kCompiled,
+          CompiledFunc{std::make_shared<const Instruction>(
+              ConcatInstructions(ins))}};
 }
 Object ClosureObj(Closure cl) { return {ObjectType::kClosure, std::move(cl)}; }
+Object GeneratorObj(Object func) {
+  auto gen = std::make_shared<Generator>();
+  gen->func = std::move(func);
+  return {ObjectType::kGenerator, std::move(gen)};
+}
+Object ChannelObj(size_t capacity) {
+  auto chan = std::make_shared<Channel>();
+  chan->capacity = capacity;
+  return {ObjectType::kChannel, std::move(chan)};
+}
 
 Object ToIntObj(const ExprNode& expr) {
   const auto* ptr = expr.PtrCast<IntLiteral>();
@@ -134,6 +184,88 @@ Object ToStrObj(const ExprNode& expr) {
   return StrObj(ptr->value);
 }
 
+size_t ObjectBytes(const Object& obj, SeenSet& seen) {
+  auto bytes = sizeof(Object);
+  switch (obj.Type()) {
+    case ObjectType::kStr:
+    case ObjectType::kError:
+      bytes += obj.Cast<std::string>().capacity();
+      break;
+    case ObjectType::kReturn:
+      bytes += ObjectBytes(obj.Cast<Object>(), seen);
+      break;
+    case ObjectType::kArray: {
+      const auto& arr = obj.Cast<Array>();
+      bytes += (arr.capacity() - arr.size()) * sizeof(Object);
+      for (const auto& elem : arr) {
+        bytes += ObjectBytes(elem, seen);
+      }
+      break;
+    }
+    case ObjectType::kDict: {
+      const auto& dict = obj.Cast<Dict>();
+      bytes += dict.capacity();  // one control byte per slot
+      for (const auto& pair : dict) {
+        bytes += ObjectBytes(pair.first, seen) + ObjectBytes(pair.second, seen);
+      }
+      break;
+    }
+    case ObjectType::kFunc:
+      bytes += sizeof(FuncObject);
+      break;
+    case ObjectType::kBuiltinFunc:
+      bytes += sizeof(BuiltinFunc);
+      break;
+    case ObjectType::kCompiled:
+      bytes += sizeof(CompiledFunc);
+      break;
+    case ObjectType::kClosure: {
+      bytes += sizeof(Closure);
+      for (const auto& free : obj.Cast<Closure>().free) {
+        bytes += ObjectBytes(free, seen);
+      }
+      break;
+    }
+    case ObjectType::kGenerator: {
+      const auto& gen = obj.Cast<GeneratorPtr>();
+      if (!seen.insert(gen.get()).second) break;
+      bytes += sizeof(Generator) + ObjectBytes(gen->func, seen) +
+               ContinuationBytes(gen->cont, seen);
+      break;
+    }
+    case ObjectType::kChannel: {
+      const auto& chan = obj.Cast<ChannelPtr>();
+      if (!seen.insert(chan.get()).second) break;
+      bytes += sizeof(Channel);
+      for (const auto& elem : chan->buffer) {
+        bytes += ObjectBytes(elem, seen);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return bytes;
+}
+
+size_t ObjectBytes(const Object& obj) {
+  SeenSet seen;
+  return ObjectBytes(obj, seen);
+}
+
+size_t ContinuationBytes(const Continuation& cont, SeenSet& seen) {
+  auto bytes = cont.frames.size() * sizeof(Frame);
+  for (const auto& frame : cont.frames) {
+    for (const auto& free : frame.closure.free) {
+      bytes += ObjectBytes(free, seen);
+    }
+  }
+  for (const auto& obj : cont.stack) {
+    bytes += ObjectBytes(obj, seen);
+  }
+  return bytes;
+}
+
 bool IsObjTruthy(const Object& obj) {
   switch (obj.Type()) {
     case ObjectType::kNull:
@@ -155,6 +287,30 @@ bool IsObjHashable(const Object& obj) noexcept {
          type == ObjectType::kStr;
 }
 
+bool HasMutableState(const Object& obj) {
+  switch (obj.Type()) {
+    case ObjectType::kGenerator:
+    case ObjectType::kChannel:
+      return true;
+    case ObjectType::kArray: {
+      const auto& arr = obj.Cast<Array>();
+      return std::any_of(arr.begin(), arr.end(), HasMutableState);
+    }
+    case ObjectType::kDict: {
+      const auto& dict = obj.Cast<Dict>();
+      return std::any_of(dict.begin(), dict.end(), [](const auto& pair) {
+        return HasMutableState(pair.second);
+      });
+    }
+    case ObjectType::kClosure: {
+      const auto& free = obj.Cast<Closure>().free;
+      return std::any_of(free.begin(), free.end(), HasMutableState);
+    }
+    default:
+      return false;
+  }
+}
+
 bool operator==(const Object& lhs, const Object& rhs) {
   // If not same type return false
   if (lhs.Type() != rhs.Type()) return false;
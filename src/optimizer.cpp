@@ -0,0 +1,699 @@
+#include "monkey/optimizer.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/types/optional.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <tuple>
+
+namespace monkey {
+
+namespace {
+
+constexpr size_t kMaxRounds = 8;
+constexpr size_t kUnknown = kNoBlock;
+
+/// Pushes one value without popping anything or any other effect
+bool IsPurePush(const IrInst& inst) {
+  switch (inst.op) {
+    case Opcode::kConst:
+    case Opcode::kTrue:
+    case Opcode::kFalse:
+    case Opcode::kNull:
+    case Opcode::kGetLocal:
+    case Opcode::kGetGlobal:
+    case Opcode::kGetFree:
+    case Opcode::kGetBuiltin:
+    case Opcode::kCurrentClosure:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool IsClosureWithoutFree(const IrInst& inst) {
+  return inst.op == Opcode::kClosure && inst.operands[1] == 0;
+}
+
+/// Operators whose result only depends on their operands. They can still
+/// fail, but then the first evaluation already stopped the program.
+size_t PureOpArity(Opcode op) {
+  switch (op) {
+    case Opcode::kAdd:
+    case Opcode::kSub:
+    case Opcode::kMul:
+    case Opcode::kDiv:
+    case Opcode::kEq:
+    case Opcode::kNe:
+    case Opcode::kGt:
+    case Opcode::kIndex:
+    case Opcode::kAddInt:
+    case Opcode::kSubInt:
+    case Opcode::kMulInt:
+    case Opcode::kEqInt:
+    case Opcode::kNeInt:
+    case Opcode::kGtInt:
+      return 2;
+    case Opcode::kMinus:
+    case Opcode::kBang:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/// Number of edges from reachable blocks to each block, plus one for the
+/// entry. Zero means unreachable.
+std::vector<size_t> CountPredecessors(const std::vector<BasicBlock>& blocks) {
+  std::vector<size_t> preds(blocks.size(), 0);
+  std::vector<bool> visited(blocks.size(), false);
+  std::vector<size_t> todo = {0};
+  preds[0] = 1;
+  while (!todo.empty()) {
+    const auto b = todo.back();
+    todo.pop_back();
+    if (visited[b]) continue;
+    visited[b] = true;
+    for (const auto succ : {blocks[b].next, blocks[b].target}) {
+      if (succ == kNoBlock) continue;
+      ++preds[succ];
+      todo.push_back(succ);
+    }
+  }
+  return preds;
+}
+
+/// What SpecializeTypes knows about the type of a value
+enum class Known { kAny, kInt, kBool };
+
+/// Types of the locals and of the stack at a point in the code
+struct TypeState {
+  std::vector<Known> locals;
+  std::vector<Known> stack;
+};
+
+/// The opcode of op for int operands, op itself if there is none
+Opcode IntOpcode(Opcode op) {
+  switch (op) {
+    case Opcode::kAdd:
+      return Opcode::kAddInt;
+    case Opcode::kSub:
+      return Opcode::kSubInt;
+    case Opcode::kMul:
+      return Opcode::kMulInt;
+    case Opcode::kEq:
+      return Opcode::kEqInt;
+    case Opcode::kNe:
+      return Opcode::kNeInt;
+    case Opcode::kGt:
+      return Opcode::kGtInt;
+    default:
+      return op;
+  }
+}
+
+/// Apply the effect of inst on the types in state. Returns false for code the
+/// state cannot follow, which leaves the whole unit as it is.
+bool StepTypes(const IrInst& inst, const CodeUnit& unit, TypeState& state) {
+  auto& stack = state.stack;
+  const auto arg = [&inst](size_t i) {
+    return static_cast<size_t>(inst.operands[i]);
+  };
+  const auto pop = [&stack](size_t n) {
+    if (stack.size() < n) return false;
+    stack.resize(stack.size() - n);
+    return true;
+  };
+  const auto pop_push = [&](size_t n, Known type) {
+    if (!pop(n)) return false;
+    stack.push_back(type);
+    return true;
+  };
+
+  switch (inst.op) {
+    case Opcode::kConst: {
+      const auto* consts = unit.consts;
+      const bool is_int = consts != nullptr && arg(0) < consts->size() &&
+                          (*consts)[arg(0)].Type() == ObjectType::kInt;
+      stack.push_back(is_int ? Known::kInt : Known::kAny);
+      return true;
+    }
+    case Opcode::kTrue:
+    case Opcode::kFalse:
+      stack.push_back(Known::kBool);
+      return true;
+    case Opcode::kNull:
+    case Opcode::kGetGlobal:
+    case Opcode::kGetFree:
+    case Opcode::kGetBuiltin:
+    case Opcode::kCurrentClosure:
+      stack.push_back(Known::kAny);
+      return true;
+    case Opcode::kGetLocal:
+      if (arg(0) >= state.locals.size()) return false;
+      stack.push_back(state.locals[arg(0)]);
+      return true;
+    case Opcode::kSetLocal:
+      if (arg(0) >= state.locals.size() || stack.empty()) return false;
+      state.locals[arg(0)] = stack.back();
+      return pop(1);
+    case Opcode::kSetGlobal:
+    case Opcode::kPop:
+    case Opcode::kReturnVal:
+      return pop(1);
+    case Opcode::kReturn:
+      return true;
+    case Opcode::kAdd:
+    case Opcode::kSub:
+    case Opcode::kMul:
+    case Opcode::kDiv:
+    case Opcode::kAddInt:
+    case Opcode::kSubInt:
+    case Opcode::kMulInt: {
+      // Other types either fail or are not ints (e.g. strings)
+      const auto n = stack.size();
+      const bool ints = n >= 2 && stack[n - 1] == Known::kInt &&
+                        stack[n - 2] == Known::kInt;
+      return pop_push(2, ints ? Known::kInt : Known::kAny);
+    }
+    case Opcode::kEq:
+    case Opcode::kNe:
+    case Opcode::kGt:
+    case Opcode::kEqInt:
+    case Opcode::kNeInt:
+    case Opcode::kGtInt:
+      return pop_push(2, Known::kBool);
+    case Opcode::kMinus: {
+      const bool is_int = !stack.empty() && stack.back() == Known::kInt;
+      return pop_push(1, is_int ? Known::kInt : Known::kAny);
+    }
+    case Opcode::kBang:
+      return pop_push(1, Known::kBool);
+    case Opcode::kIndex:
+      return pop_push(2, Known::kAny);
+    case Opcode::kArray:
+      return pop_push(arg(0), Known::kAny);
+    case Opcode::kDict:
+      return pop_push(2 * arg(0), Known::kAny);
+    case Opcode::kCall:
+      return pop_push(arg(0) + 1, Known::kAny);
+    case Opcode::kCallBuiltin:
+    case Opcode::kCallGlobal:
+    case Opcode::kClosure:
+      return pop_push(arg(1), Known::kAny);
+    case Opcode::kYield:
+      return pop_push(1, Known::kAny);
+    default:
+      return false;
+  }
+}
+
+/// Merge from into into, false if they cannot be merged
+bool JoinTypes(const TypeState& from, TypeState& into, bool& changed) {
+  if (from.stack.size() != into.stack.size()) return false;
+  const auto join = [&changed](Known lhs, Known& rhs) {
+    if (lhs != rhs && rhs != Known::kAny) {
+      rhs = Known::kAny;
+      changed = true;
+    }
+  };
+  for (size_t i = 0; i < from.locals.size(); ++i) {
+    join(from.locals[i], into.locals[i]);
+  }
+  for (size_t i = 0; i < from.stack.size(); ++i) {
+    join(from.stack[i], into.stack[i]);
+  }
+  return true;
+}
+
+}  // namespace
+
+size_t ThreadJumps(CodeUnit& unit) {
+  auto& blocks = unit.cfg.blocks;
+
+  // Where a jump to b ends up, skipping blocks that only jump on. The number
+  // of hops is bounded since empty loops form cycles.
+  const auto resolve = [&blocks](size_t b) {
+    for (size_t hops = 0; b != kNoBlock && hops < blocks.size(); ++hops) {
+      const auto& block = blocks[b];
+      if (!block.insts.empty() || block.cond || block.next == kNoBlock) break;
+      b = block.next;
+    }
+    return b;
+  };
+
+  size_t changes = 0;
+  for (auto& block : blocks) {
+    // A condition known when compiling (e.g. while (true)) or a branch that
+    // goes to the same block either way. The condition is still popped, which
+    // dead code elimination removes where it is not observable.
+    if (block.cond) {
+      const auto op =
+          block.insts.empty() ? Opcode::kPop : block.insts.back().op;
+      if (op == Opcode::kFalse || op == Opcode::kNull) {
+        block.next = block.target;
+      }
+      if (op == Opcode::kTrue || op == Opcode::kConst ||
+          block.next == block.target) {
+        block.insts.push_back({Opcode::kPop});
+        block.cond = false;
+        block.bool_cond = false;
+        block.target = kNoBlock;
+        ++changes;
+      }
+    }
+
+    const auto next = resolve(block.next);
+    if (next != block.next) {
+      block.next = next;
+      ++changes;
+    }
+    if (block.cond) {
+      const auto target = resolve(block.target);
+      if (target != block.target) {
+        block.target = target;
+        ++changes;
+      }
+    }
+  }
+  return changes;
+}
+
+size_t PropagateCopies(CodeUnit& unit) {
+  // Variable (by its load) -> load of the value it was last set to, and the
+  // variables copied from each source. Functions cannot assign globals or
+  // free variables, but top-level code can assign a global while this code
+  // is suspended in a yield or waits in a call (e.g. a task blocked in recv),
+  // so those end every copy of or from a global.
+  using Var = std::pair<Opcode, int>;
+  absl::flat_hash_map<Var, IrInst> copies;
+  absl::flat_hash_map<Var, std::vector<Var>> users;
+
+  const auto kill = [&copies, &users](Var var) {
+    copies.erase(var);
+    const auto it = users.find(var);
+    if (it == users.end()) return;
+    for (const auto& user : it->second) {
+      const auto copy = copies.find(user);
+      if (copy != copies.end() && copy->second.op == var.first &&
+          copy->second.operands[0] == var.second) {
+        copies.erase(copy);
+      }
+    }
+    users.erase(it);
+  };
+
+  size_t changes = 0;
+  for (auto& block : unit.cfg.blocks) {
+    copies.clear();
+    users.clear();
+    for (size_t i = 0; i < block.insts.size(); ++i) {
+      auto& inst = block.insts[i];
+      if (inst.op == Opcode::kGetLocal || inst.op == Opcode::kGetGlobal) {
+        const auto it = copies.find(Var{inst.op, inst.operands[0]});
+        if (it != copies.end() && !(it->second == inst)) {
+          inst = it->second;
+          ++changes;
+        }
+        continue;
+      }
+      if (inst.op == Opcode::kYield || inst.op == Opcode::kCall ||
+          inst.op == Opcode::kCallBuiltin || inst.op == Opcode::kCallGlobal) {
+        for (auto it = copies.begin(); it != copies.end();) {
+          const bool global = it->first.first == Opcode::kGetGlobal ||
+                              it->second.op == Opcode::kGetGlobal;
+          if (global) {
+            copies.erase(it++);
+          } else {
+            ++it;
+          }
+        }
+        continue;
+      }
+      if (inst.op != Opcode::kSetLocal && inst.op != Opcode::kSetGlobal) {
+        continue;
+      }
+
+      const auto get = inst.op == Opcode::kSetLocal ? Opcode::kGetLocal
+                                                    : Opcode::kGetGlobal;
+      const Var var{get, inst.operands[0]};
+      kill(var);
+      if (i == 0) continue;
+      const auto& src = block.insts[i - 1];
+      if (IsPurePush(src) && !(src == IrInst{get, {var.second}})) {
+        copies[var] = src;
+        if (!src.operands.empty()) {
+          users[Var{src.op, src.operands[0]}].push_back(var);
+        }
+      }
+    }
+  }
+  return changes;
+}
+
+size_t EliminateDeadCode(CodeUnit& unit) {
+  auto& blocks = unit.cfg.blocks;
+  size_t changes = 0;
+
+  // Append a block to its only predecessor when that one always goes there.
+  // The absorbed block becomes unreachable and is dropped below.
+  auto preds = CountPredecessors(blocks);
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    auto& block = blocks[b];
+    if (preds[b] == 0) continue;
+    while (!block.cond && block.next != kNoBlock && block.next != b &&
+           preds[block.next] == 1) {
+      auto& next = blocks[block.next];
+      // The end of the program has to stay last
+      if (next.next == kNoBlock && !next.Returns()) break;
+      block.insts.insert(block.insts.end(), next.insts.cbegin(),
+                         next.insts.cend());
+      block.cond = next.cond;
+      block.bool_cond = next.bool_cond;
+      block.target = next.target;
+      block.next = next.next;
+      ++changes;
+    }
+  }
+
+  // Drop unreachable blocks, keeping the order of the others
+  preds = CountPredecessors(blocks);
+  std::vector<size_t> remap(blocks.size(), kNoBlock);
+  size_t num_kept = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (preds[b] > 0) remap[b] = num_kept++;
+  }
+  if (num_kept < blocks.size()) {
+    changes += blocks.size() - num_kept;
+    std::vector<BasicBlock> kept;
+    kept.reserve(num_kept);
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      if (preds[b] == 0) continue;
+      auto& block = kept.emplace_back(std::move(blocks[b]));
+      if (block.next != kNoBlock) block.next = remap[block.next];
+      if (block.cond) block.target = remap[block.target];
+    }
+    blocks = std::move(kept);
+  }
+
+  if (!unit.function) return changes;
+
+  // Stores to locals that are never loaded again
+  absl::flat_hash_set<int> loaded;
+  for (const auto& block : blocks) {
+    for (const auto& inst : block.insts) {
+      if (inst.op == Opcode::kGetLocal) loaded.insert(inst.operands[0]);
+    }
+  }
+
+  for (auto& block : blocks) {
+    std::vector<IrInst> insts;
+    insts.reserve(block.insts.size());
+    for (auto& inst : block.insts) {
+      if (inst.op == Opcode::kSetLocal && !loaded.contains(inst.operands[0])) {
+        inst = {Opcode::kPop};
+        ++changes;
+      }
+      // Values pushed only to be popped, which can make more of them adjacent.
+      // That includes closures that capture nothing, e.g. once every call to
+      // them was inlined.
+      if (inst.op == Opcode::kPop && !insts.empty() &&
+          (IsPurePush(insts.back()) || IsClosureWithoutFree(insts.back()))) {
+        insts.pop_back();
+        ++changes;
+        continue;
+      }
+      insts.push_back(std::move(inst));
+    }
+    block.insts = std::move(insts);
+  }
+  return changes;
+}
+
+size_t EliminateCommonSubexprs(CodeUnit& unit) {
+  if (!unit.function) return 0;
+
+  // A value on the simulated stack and the instructions that computed it. An
+  // expression is clean if it is exactly [start, end] and made of pure pushes
+  // and pure operators only, so it can be replaced by a load.
+  struct Value {
+    size_t vn;
+    size_t start{kUnknown};
+    size_t end{kUnknown};
+    bool clean{false};
+  };
+  struct Expr {
+    size_t start;
+    size_t end;
+    bool clean;
+  };
+  // Opcode, operand and value numbers of the operands
+  using Key = std::tuple<Opcode, int, size_t, size_t>;
+
+  size_t changes = 0;
+  for (auto& block : unit.cfg.blocks) {
+    const auto& insts = block.insts;
+    // Nothing to share without at least two operators
+    const auto num_ops = std::count_if(
+        insts.cbegin(), insts.cend(), [](const IrInst& inst) {
+          return PureOpArity(inst.op) > 0;
+        });
+    if (num_ops < 2) continue;
+
+    absl::flat_hash_map<Key, size_t> numbers;
+    absl::flat_hash_map<int, size_t> versions;  // of locals
+    absl::flat_hash_map<size_t, std::vector<Expr>> exprs;
+    std::vector<Value> stack;
+    size_t num_values = 0;
+    size_t epoch = 0;  // of globals
+
+    const auto number = [&](const Key& key) {
+      const auto [it, inserted] = numbers.try_emplace(key, num_values);
+      if (inserted) ++num_values;
+      return it->second;
+    };
+    const auto pop = [&stack, &num_values]() -> Value {
+      if (stack.empty()) return {num_values++};
+      auto value = stack.back();
+      stack.pop_back();
+      return value;
+    };
+
+    for (size_t i = 0; i < insts.size(); ++i) {
+      const auto& inst = insts[i];
+      const int operand = inst.operands.empty() ? 0 : inst.operands[0];
+      if (IsPurePush(inst)) {
+        size_t version = 0;
+        if (inst.op == Opcode::kGetLocal) version = versions[operand];
+        if (inst.op == Opcode::kGetGlobal) version = epoch;
+        stack.push_back({number({inst.op, operand, version, 0}), i, i, true});
+        continue;
+      }
+
+      const auto arity = PureOpArity(inst.op);
+      if (arity > 0) {
+        // A unary operator has an empty right hand side just before it
+        const auto rhs = arity == 2 ? pop() : Value{0, i, i - 1, true};
+        const auto lhs = pop();
+        if (lhs.start == kUnknown || rhs.start == kUnknown) {
+          stack.push_back({num_values++});
+          continue;
+        }
+        const bool clean = lhs.clean && rhs.clean &&
+                           rhs.start == lhs.end + 1 && rhs.end + 1 == i;
+        const auto vn = number({inst.op, 0, lhs.vn, rhs.vn});
+        exprs[vn].push_back({lhs.start, i, clean});
+        stack.push_back({vn, lhs.start, i, clean});
+        continue;
+      }
+
+      if (inst.op == Opcode::kPop) {
+        pop();
+      } else if (inst.op == Opcode::kSetLocal) {
+        pop();
+        versions[operand] = num_values++;
+      } else {
+        // Anything else is a barrier, forget the stack and globals
+        stack.clear();
+        ++epoch;
+      }
+    }
+
+    // A load replaces each later clean occurrence, at the cost of storing
+    // the first one in a new local
+    struct Replace {
+      size_t start;
+      size_t end;
+      size_t vn;
+    };
+    std::vector<Replace> replaces;
+    for (const auto& [vn, occurrences] : exprs) {
+      size_t saved = 0;
+      for (size_t k = 1; k < occurrences.size(); ++k) {
+        const auto& expr = occurrences[k];
+        if (expr.clean) saved += expr.end - expr.start;
+      }
+      if (saved <= 2) continue;
+      for (size_t k = 1; k < occurrences.size(); ++k) {
+        const auto& expr = occurrences[k];
+        if (expr.clean) replaces.push_back({expr.start, expr.end, vn});
+      }
+    }
+    if (replaces.empty()) continue;
+
+    // Drop the ones inside another replaced expression
+    std::sort(replaces.begin(),
+              replaces.end(),
+              [](const auto& lhs, const auto& rhs) {
+                return lhs.start < rhs.start ||
+                       (lhs.start == rhs.start && lhs.end > rhs.end);
+              });
+    std::vector<Replace> kept;
+    for (const auto& replace : replaces) {
+      if (!kept.empty() && replace.start <= kept.back().end) continue;
+      kept.push_back(replace);
+    }
+
+    absl::flat_hash_map<size_t, int> locals;  // vn -> new local
+    absl::flat_hash_map<size_t, int> stores;  // end of first occurrence
+    for (const auto& replace : kept) {
+      if (locals.contains(replace.vn)) continue;
+      const auto local = static_cast<int>(unit.num_locals++);
+      locals[replace.vn] = local;
+      stores[exprs[replace.vn].front().end] = local;
+    }
+
+    std::vector<IrInst> out;
+    out.reserve(insts.size());
+    auto it = kept.cbegin();
+    for (size_t i = 0; i < insts.size(); ++i) {
+      if (it != kept.cend() && it->start == i) {
+        out.push_back({Opcode::kGetLocal, {locals[it->vn]}});
+        i = it->end;
+        ++it;
+        ++changes;
+        continue;
+      }
+      out.push_back(insts[i]);
+      if (const auto store = stores.find(i); store != stores.end()) {
+        out.push_back({Opcode::kSetLocal, {store->second}});
+        out.push_back({Opcode::kGetLocal, {store->second}});
+      }
+    }
+    block.insts = std::move(out);
+  }
+  return changes;
+}
+
+size_t SpecializeTypes(CodeUnit& unit) {
+  auto& blocks = unit.cfg.blocks;
+  if (blocks.empty()) return 0;
+
+  // Forward dataflow to a fixed point, the state at the start of a block is
+  // what holds on every path to it. Nothing is known about params and
+  // locals not set yet.
+  std::vector<absl::optional<TypeState>> in(blocks.size());
+  in[0] = TypeState{std::vector<Known>(unit.num_locals, Known::kAny), {}};
+  std::vector<size_t> todo = {0};
+  std::vector<bool> queued(blocks.size(), false);
+  queued[0] = true;
+  while (!todo.empty()) {
+    const auto b = todo.back();
+    todo.pop_back();
+    queued[b] = false;
+
+    const auto& block = blocks[b];
+    auto state = *in[b];
+    for (const auto& inst : block.insts) {
+      if (!StepTypes(inst, unit, state)) return 0;
+    }
+    if (block.cond) {
+      if (state.stack.empty()) return 0;
+      state.stack.pop_back();
+    }
+
+    for (const auto succ : {block.next, block.target}) {
+      if (succ == kNoBlock) continue;
+      bool changed = false;
+      if (!in[succ]) {
+        in[succ] = state;
+        changed = true;
+      } else if (!JoinTypes(state, *in[succ], changed)) {
+        return 0;
+      }
+      if (changed && !queued[succ]) {
+        queued[succ] = true;
+        todo.push_back(succ);
+      }
+    }
+  }
+
+  size_t changes = 0;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    if (!in[b]) continue;  // unreachable
+    auto& block = blocks[b];
+    auto& state = *in[b];
+    for (auto& inst : block.insts) {
+      const auto& stack = state.stack;
+      const auto n = stack.size();
+      const auto int_op = IntOpcode(inst.op);
+      if (int_op != inst.op && stack[n - 1] == Known::kInt &&
+          stack[n - 2] == Known::kInt) {
+        inst.op = int_op;
+        ++changes;
+      }
+      StepTypes(inst, unit, state);
+    }
+    if (block.cond && !block.bool_cond &&
+        state.stack.back() == Known::kBool) {
+      block.bool_cond = true;
+      ++changes;
+    }
+  }
+  unit.num_specialized += changes;
+  return changes;
+}
+
+PassManager::PassManager() {
+  Add("ThreadJumps", ThreadJumps);
+  Add("PropagateCopies", PropagateCopies);
+  Add("EliminateDeadCode", EliminateDeadCode);
+  Add("EliminateCommonSubexprs", EliminateCommonSubexprs);
+  Add("SpecializeTypes", SpecializeTypes);
+}
+
+void PassManager::Add(std::string name, Pass pass) {
+  passes_.emplace_back(std::move(name), pass);
+}
+
+size_t PassManager::Run(CodeUnit& unit, TimerManager& timers) const {
+  size_t total = 0;
+  for (size_t round = 0; round < kMaxRounds; ++round) {
+    size_t changes = 0;
+    for (const auto& [name, pass] : passes_) {
+      auto timer = timers.Scoped(name);
+      changes += pass(unit);
+    }
+    if (changes == 0) break;
+    total += changes;
+  }
+  return total;
+}
+
+Instruction PassManager::Optimize(const Instruction& ins,
+                                  CodeUnit& unit,
+                                  TimerManager& timers) const {
+  {
+    auto timer = timers.Scoped("BuildCfg");
+    unit.cfg = BuildCfg(ins);
+  }
+
+  Run(unit, timers);
+
+  auto timer = timers.Scoped("LowerCfg");
+  return LowerCfg(unit.cfg);
+}
+
+}  // namespace monkey
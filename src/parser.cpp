@@ -45,6 +45,7 @@ Parser::Parser(Lexer lexer) : lexer_(std::move(lexer)) {
 
 void Parser::RegisterParseFns() {
   RegisterPrefix(TokenType::kIf, [this]() { return ParseIfExpr(); });
+  RegisterPrefix(TokenType::kYield, [this]() { return ParseYieldExpr(); });
   RegisterPrefix(TokenType::kStr, [this]() { return ParseStrLiteral(); });
   RegisterPrefix(TokenType::kInt, [this]() { return ParseIntLiteral(); });
   RegisterPrefix(TokenType::kFunc, [this]() { return ParseFuncLiteral(); });
@@ -102,6 +103,13 @@ StmtNode Parser::ParseStatement() {
       return ParseLetStmt();
     case TokenType::kReturn:
       return ParseReturnStmt();
+    case TokenType::kWhile:
+      return ParseWhileStmt();
+    case TokenType::kFor:
+      return ParseForStmt();
+    case TokenType::kIdent:
+      if (IsPeekToken(TokenType::kAssign)) return ParseAssignStmt();
+      return PasreExprStmt();
     default:
       return PasreExprStmt();
   }
@@ -157,6 +165,110 @@ StmtNode Parser::ParseReturnStmt() {
   return ret_stmt;
 }
 
+StmtNode Parser::ParseAssignStmt() {
+  AssignStmt assign;
+  assign.token = curr_token_;
+  assign.name.token = curr_token_;
+  assign.name.value = curr_token_.literal;
+
+  if (!ExpectPeek(TokenType::kAssign)) {
+    return {};
+  }
+
+  NextToken();
+  assign.expr = ParseExpression(Precedence::kLowest);
+  if (!assign.expr.Ok()) return {};
+
+  // Optional like in expression statements, the update of a for loop has none
+  if (IsPeekToken(TokenType::kSemicolon)) {
+    NextToken();
+  }
+
+  return assign;
+}
+
+StmtNode Parser::ParseWhileStmt() {
+  WhileStmt loop;
+  loop.token = curr_token_;
+
+  if (!ExpectPeek(TokenType::kLParen)) {
+    return {};
+  }
+
+  NextToken();
+  loop.cond = ParseExpression(Precedence::kLowest);
+
+  if (!ExpectPeek(TokenType::kRParen)) {
+    return {};
+  }
+  if (!ExpectPeek(TokenType::kLBrace)) {
+    return {};
+  }
+  loop.body = ParseBlockStmt();
+
+  if (IsPeekToken(TokenType::kSemicolon)) {
+    NextToken();
+  }
+
+  return loop;
+}
+
+StmtNode Parser::ParseForStmt() {
+  ForStmt loop;
+  loop.token = curr_token_;
+
+  if (!ExpectPeek(TokenType::kLParen)) {
+    return {};
+  }
+
+  // for (init; cond; update), init is a let or an assignment
+  NextToken();
+  if (IsCurrToken(TokenType::kLet)) {
+    loop.init = ParseLetStmt();
+  } else if (IsCurrToken(TokenType::kIdent) &&
+             IsPeekToken(TokenType::kAssign)) {
+    loop.init = ParseAssignStmt();
+  } else {
+    errors_.push_back(fmt::format(
+        "for loop init must be a let or an assignment, got {}",
+        curr_token_.type));
+    return {};
+  }
+  if (!loop.init.Ok()) return {};
+  if (!IsCurrToken(TokenType::kSemicolon)) {
+    errors_.push_back("failed to parse for loop init, missing ;");
+    return {};
+  }
+
+  NextToken();
+  loop.cond = ParseExpression(Precedence::kLowest);
+  if (!ExpectPeek(TokenType::kSemicolon)) {
+    return {};
+  }
+
+  NextToken();
+  if (IsCurrToken(TokenType::kIdent) && IsPeekToken(TokenType::kAssign)) {
+    loop.update = ParseAssignStmt();
+  } else {
+    loop.update = PasreExprStmt();
+  }
+  if (!loop.update.Ok()) return {};
+
+  if (!ExpectPeek(TokenType::kRParen)) {
+    return {};
+  }
+  if (!ExpectPeek(TokenType::kLBrace)) {
+    return {};
+  }
+  loop.body = ParseBlockStmt();
+
+  if (IsPeekToken(TokenType::kSemicolon)) {
+    NextToken();
+  }
+
+  return loop;
+}
+
 StmtNode Parser::PasreExprStmt() {
   ExprStmt expr_stmt;
   expr_stmt.token = curr_token_;
@@ -390,6 +502,17 @@ ExprNode Parser::ParseIfExpr() {
   return if_expr;
 }
 
+ExprNode Parser::ParseYieldExpr() {
+  YieldExpr yield;
+  yield.token = curr_token_;
+
+  NextToken();
+  yield.value = ParseExpression(Precedence::kLowest);
+  if (!yield.value.Ok()) return {};
+
+  return yield;
+}
+
 ExprNode Parser::PasrseCallExpr(const ExprNode& expr) {
   CallExpr call;
   call.token = curr_token_;
@@ -25,6 +25,8 @@ std::string Repr(SymbolScope scope) {
       return "local";
     case SymbolScope::kFree:
       return "free";
+    case SymbolScope::kFunction:
+      return "function";
     default:
       return "unknown scope";
   }
@@ -42,6 +44,14 @@ std::ostream& operator<<(std::ostream& os, const Symbol& symbol) {
   return os << symbol.Repr();
 }
 
+SymbolTablePtr SymbolTable::Overlay(const SymbolTable& base) {
+  CHECK(base.IsGlobal());
+  auto table = std::make_unique<SymbolTable>();
+  table->base_ = &base;
+  table->num_defs_ = base.num_defs_;
+  return table;
+}
+
 Symbol& SymbolTable::Define(const std::string& name) {
   return store_[name] = {
              name,
@@ -60,14 +70,23 @@ Symbol& SymbolTable::DefineFree(const Symbol& symbol) {
              Symbol{symbol.name, SymbolScope::kFree, NumFree() - 1};
 }
 
+Symbol& SymbolTable::DefineFunctionName(const std::string& name) {
+  return store_[name] = {name, SymbolScope::kFunction, 0};
+}
+
 absl::optional<Symbol> SymbolTable::Resolve(const std::string& name) {
   // Is it found in the current scope?
   const auto it = store_.find(name);
   // Yes, return
   if (it != store_.end()) return it->second;
 
-  // This is the global scope, and not found, return nullopt
-  if (outer_ == nullptr) return absl::nullopt;
+  // This is the global scope, and not found, try the table below if any
+  if (outer_ == nullptr) {
+    if (base_ == nullptr) return absl::nullopt;
+    const auto base_it = base_->store_.find(name);
+    if (base_it == base_->store_.end()) return absl::nullopt;
+    return base_it->second;
+  }
 
   // There is an outer scope, look in there
   auto res = outer_->Resolve(name);
@@ -0,0 +1,105 @@
+#include "monkey/thread_pool.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+namespace monkey {
+
+namespace {
+
+// Pool and worker index of the current thread, used to keep jobs submitted by
+// a worker on its own queue
+thread_local const ThreadPool* tPool = nullptr;
+thread_local size_t tWorker = 0;
+
+}  // namespace
+
+ThreadPool::ThreadPool(size_t num_workers) {
+  CHECK_GT(num_workers, 0);
+
+  queues_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+
+  threads_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; ++i) {
+    threads_.emplace_back([this, i]() { Work(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() noexcept {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+bool ThreadPool::InWorker() const noexcept { return tPool == this; }
+
+void ThreadPool::Submit(Job job) {
+  // Count first so that pending_ never drops below the number of queued jobs
+  ++pending_;
+  const auto i = tPool == this ? tWorker : next_++ % queues_.size();
+  {
+    auto& queue = *queues_[i];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    queue.jobs.push_back(std::move(job));
+  }
+
+  // Lock so that a worker cannot miss the notification between checking
+  // pending_ and going to sleep
+  { std::lock_guard<std::mutex> lock{mutex_}; }
+  cv_.notify_one();
+}
+
+bool ThreadPool::TryPop(size_t worker, Job& job) {
+  const auto n = queues_.size();
+  for (size_t k = 0; k < n; ++k) {
+    auto& queue = *queues_[(worker + k) % n];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    if (queue.jobs.empty()) continue;
+
+    if (k == 0) {
+      job = std::move(queue.jobs.front());
+      queue.jobs.pop_front();
+    } else {
+      job = std::move(queue.jobs.back());
+      queue.jobs.pop_back();
+    }
+    --pending_;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::Work(size_t worker) {
+  tPool = this;
+  tWorker = worker;
+
+  Job job;
+  while (true) {
+    if (TryPop(worker, job)) {
+      job(worker);
+      job = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock{mutex_};
+    cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+    if (stop_ && pending_ == 0) return;
+  }
+}
+
+ThreadPool& DefaultThreadPool() {
+  static ThreadPool pool{std::max(1U, std::thread::hardware_concurrency())};
+  return pool;
+}
+
+}  // namespace monkey
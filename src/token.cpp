@@ -15,7 +15,10 @@ const auto gKeywords =
                                                 {"else", TokenType::kElse},
                                                 {"true", TokenType::kTrue},
                                                 {"false", TokenType::kFalse},
-                                                {"return", TokenType::kReturn}};
+                                                {"return", TokenType::kReturn},
+                                                {"yield", TokenType::kYield},
+                                                {"while", TokenType::kWhile},
+                                                {"for", TokenType::kFor}};
 
 const auto gTokenTypeStrings = absl::flat_hash_map<TokenType, std::string>{
     {TokenType::kIllegal, "ILLEGAL"}, {TokenType::kEof, "EOF"},
@@ -34,7 +37,8 @@ const auto gTokenTypeStrings = absl::flat_hash_map<TokenType, std::string>{
     {TokenType::kLet, "LET"},         {TokenType::kTrue, "TRUE"},
     {TokenType::kFalse, "FALSE"},     {TokenType::kIf, "IF"},
     {TokenType::kElse, "ELSE"},       {TokenType::kReturn, "RETURN"},
-    {TokenType::kColon, "COLON"},
+    {TokenType::kColon, "COLON"},     {TokenType::kYield, "YIELD"},
+    {TokenType::kWhile, "WHILE"},     {TokenType::kFor, "FOR"},
 };
 
 }  // namespace
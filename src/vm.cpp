@@ -1,21 +1,451 @@
 #include "monkey/vm.h"
 
+#include <absl/container/inlined_vector.h>
 #include <fmt/ostream.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <iterator>
+
 #include "monkey/builtin.h"
+#include "monkey/thread_pool.h"
 
 namespace monkey {
 
-absl::Status VirtualMachine::Run(const Bytecode& bc) {
-  frames_.push(Frame{Closure{CompiledFunc{bc.ins}}});
+namespace {
+
+absl::Status WrongNumArgs(size_t want, size_t got) {
+  return MakeError(
+      fmt::format("wrong number of arguments: want={}, got={}", want, got));
+}
+
+}  // namespace
+
+absl::Status SuspendedError() {
+  return absl::UnavailableError("suspended: budget exhausted");
+}
+
+bool IsSuspended(const absl::Status& status) {
+  return absl::IsUnavailable(status);
+}
+
+absl::Status VirtualMachine::Run(const Bytecode& bc, int64_t budget) {
+  if (IsSuspended()) return MakeError("a suspended run must be continued");
+
+  // Tasks an earlier run left behind refer to the constants of its bytecode
+  run_queue_.clear();
+  blocked_tasks_.clear();
+
+  consts_ = bc.consts;
+  names_ = bc.names;
+  run_ = {std::make_shared<Task>(), frames_.size(), sp_};
+  run_.main->started = true;
+  curr_task_ = run_.main;
+  PushFrame(Frame{Closure{CompiledFunc{bc.ins}, {}}});
+
+  fuel_ = budget;
+  return Schedule();
+}
+
+void VirtualMachine::Reset() {
+  CHECK(entries_.empty()) << "Reset called from native code";
+
+  // Overwrite instead of clearing so that the slots stay allocated
+  for (auto& obj : stack_) {
+    obj = Object{};
+  }
+  sp_ = 0;
+  last_ = Object{};
+  consts_ = nullptr;
+  names_ = nullptr;
+  frames_.clear();
+  for (auto& obj : globals_) {
+    obj = Object{};
+  }
+  ++globals_epoch_;
+
+  curr_task_ = nullptr;
+  run_queue_.clear();
+  blocked_tasks_.clear();
+  blocked_ = false;
+  quantum_ = kQuantum;
+  fuel_ = kUnlimited;
+  run_ = {};
+
+  memo_.clear();
+  memo_stopped_ = false;
+  memo_stats_ = {};
+  memory_ = {};
+  since_measure_ = 0;
+  measure_at_ = kMinMeasureBytes;
+}
+
+absl::Status VirtualMachine::Rebind(const Bytecode& bc, int64_t budget) {
+  Reset();
+  return Run(bc, budget);
+}
+
+void VirtualMachine::SetMemoCapacity(size_t capacity) {
+  memo_capacity_ = capacity;
+  memo_.clear();
+}
+
+absl::Status VirtualMachine::Continue(int64_t budget) {
+  if (!IsSuspended()) return MakeError("no suspended run to continue");
+
+  fuel_ = budget;
+  return Schedule();
+}
+
+absl::Status VirtualMachine::Schedule() {
+  const auto depth = run_.depth;
+  const auto sp = run_.sp;
+
+  auto status = kOkStatus;
+  while (true) {
+    status = Execute(depth);
+    if (!status.ok()) break;
+
+    // Leave everything in place, the running task goes on in Continue
+    if (frames_.size() > depth && !blocked_ && fuel_ <= 0) {
+      return SuspendedError();
+    }
+
+    if (frames_.size() > depth) {
+      // Task blocked in a builtin or used up its quantum
+      Suspend(depth, sp, curr_task_->cont);
+      if (!blocked_) run_queue_.push_back(curr_task_);
+      blocked_ = false;
+    } else if (curr_task_ == run_.main) {
+      break;
+    } else {
+      sp_ = sp;  // drop return value of the finished task
+    }
+
+    status = SwitchTask();
+    if (!status.ok()) break;
+  }
+
+  if (!status.ok()) {
+    Unwind(depth, sp);
+    // Release values left above sp by the failed run
+    if (stack_.size() > sp + 1) stack_.resize(sp + 1);
+  }
+  DropTask(run_.main);
+  curr_task_ = nullptr;
+  run_ = {};
+  return status;
+}
+
+absl::Status VirtualMachine::SwitchTask() {
+  if (run_queue_.empty()) return MakeError("deadlock: all tasks are blocked");
+
+  curr_task_ = std::move(run_queue_.front());
+  run_queue_.pop_front();
+  quantum_ = kQuantum;
+
+  if (curr_task_->started) {
+    Restore(curr_task_->cont);
+    return kOkStatus;
+  }
+
+  curr_task_->started = true;
+  PushStack(curr_task_->func);
+  return ExecFuncCall(curr_task_->func, 0);
+}
+
+void VirtualMachine::DropTask(const TaskPtr& task) {
+  blocked_tasks_.erase(task);
+  run_queue_.erase(std::remove(run_queue_.begin(), run_queue_.end(), task),
+                   run_queue_.end());
+}
+
+Object VirtualMachine::Spawn(const Object& func) {
+  if (worker_) return ErrorObj("`spawn` is not supported in parallel tasks");
+  if (func.Type() != ObjectType::kClosure) {
+    return ErrorObj(fmt::format("argument to `spawn` must be CLOSURE, got {}",
+                                func.Type()));
+  }
+
+  const auto& closure = func.Cast<Closure>();
+  if (closure.func.num_params != 0) {
+    return ErrorObj(fmt::format("wrong number of arguments: want={}, got=0",
+                                closure.func.num_params));
+  }
+
+  auto task = std::make_shared<Task>();
+  task->func = func;
+  run_queue_.push_back(std::move(task));
+  return NullObj();
+}
+
+bool VirtualMachine::Block(WaitQueue& queue) {
+  // Only a builtin called directly by a task can be retried later
+  if (curr_task_ == nullptr || !entries_.empty()) return false;
+
+  queue.push_back(curr_task_);
+  blocked_tasks_.insert(curr_task_);
+  blocked_ = true;
+  return true;
+}
+
+void VirtualMachine::Wake(WaitQueue& queue) {
+  while (!queue.empty()) {
+    auto task = queue.front().lock();
+    queue.pop_front();
+
+    // Skip tasks that are gone or were already woken up
+    if (task == nullptr || blocked_tasks_.erase(task) == 0) continue;
+
+    run_queue_.push_back(std::move(task));
+    return;
+  }
+}
+
+absl::StatusOr<Object> VirtualMachine::CallClosure(
+    const Object& closure,
+    absl::Span<const Object> args) {
+  if (closure.Type() != ObjectType::kClosure) {
+    return MakeError("calling non-closure: " + Repr(closure.Type()));
+  }
+  if (consts_ == nullptr) return MakeError("no bytecode has been run");
+
+  const auto depth = frames_.size();
+  const auto sp = sp_;
+
+  // Same stack layout as OpCall, closure followed by its arguments
+  PushStack(closure);
+  for (const auto& arg : args) {
+    PushStack(arg);
+  }
+
+  entries_.push_back({nullptr, depth, sp, {}});
+  auto status = ExecFuncCall(StackTop(args.size()), args.size());
+  if (status.ok()) status = Execute(depth);
+  entries_.pop_back();
+  if (!status.ok()) {
+    Unwind(depth, sp);
+    return status;
+  }
+
+  return PopStack();
+}
+
+absl::StatusOr<Object> VirtualMachine::CallFunction(
+    size_t index,
+    absl::Span<const Object> args) {
+  if (index >= globals_.size() ||
+      globals_[index].Type() == ObjectType::kInvalid) {
+    return MakeError(fmt::format("undefined global: {}", index));
+  }
+  return CallClosure(globals_[index], args);
+}
+
+absl::StatusOr<Object> VirtualMachine::CallFunction(
+    absl::string_view name,
+    absl::Span<const Object> args) {
+  if (names_ == nullptr) return MakeError("no bytecode has been run");
+
+  const auto it = names_->find(name);
+  if (it == names_->end()) {
+    return MakeError(fmt::format("undefined function: {}", name));
+  }
+  return CallFunction(it->second, args);
+}
+
+Object VirtualMachine::Call(const Object& func, absl::Span<const Object> args) {
+  if (func.Type() == ObjectType::kBuiltinFunc) {
+    entries_.push_back({nullptr, frames_.size(), sp_, {}});
+    auto res = func.Cast<BuiltinFunc>()(args, *this);
+    entries_.pop_back();
+    return res;
+  }
+
+  auto res = CallClosure(func, args);
+  if (!res.ok()) return ErrorObj(std::string{res.status().message()});
+  return *std::move(res);
+}
+
+void VirtualMachine::Parallel(size_t n, const ParallelTask& task) {
+  auto& pool = DefaultThreadPool();
+  if (n < 2 || consts_ == nullptr || pool.InWorker() ||
+      std::any_of(globals_.begin(), globals_.end(), HasMutableState)) {
+    Caller::Parallel(n, task);
+    return;
+  }
+
+  // Globals are not modified while this vm waits, so workers can copy them
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t remaining = n;
+
+  for (size_t i = 0; i < n; ++i) {
+    pool.Submit([&, i](size_t) {
+      VirtualMachine vm;
+      vm.consts_ = consts_;
+      vm.globals_ = globals_;
+      vm.quota_ = quota_;
+      vm.memo_capacity_ = memo_capacity_;
+      vm.worker_ = true;
+      task(i, vm);
+
+      std::lock_guard<std::mutex> lock{mutex};
+      if (--remaining == 0) cv.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock{mutex};
+  cv.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+Object VirtualMachine::Resume(const Object& obj) {
+  if (consts_ == nullptr) return ErrorObj("no bytecode has been run");
+
+  auto& gen = *obj.Cast<GeneratorPtr>();
+  switch (gen.state) {
+    case Generator::State::kRunning:
+      return ErrorObj("generator is already running");
+    case Generator::State::kDone:
+      return NullObj();
+    default:
+      break;
+  }
+
+  const auto depth = frames_.size();
+  const auto sp = sp_;
+
+  auto status = kOkStatus;
+  if (gen.state == Generator::State::kCreated) {
+    PushStack(gen.func);
+    status = ExecFuncCall(gen.func, 0);
+  } else {
+    Restore(gen.cont);
+  }
+
+  gen.state = Generator::State::kRunning;
+  entries_.push_back({&gen, depth, sp, {}});
+  if (status.ok()) status = Execute(depth);
+  auto value = std::move(entries_.back().value);
+  entries_.pop_back();
+
+  if (!status.ok()) {
+    Unwind(depth, sp);
+    gen.state = Generator::State::kDone;
+    return ErrorObj(std::string{status.message()});
+  }
+
+  if (gen.state == Generator::State::kSuspended) return value;
+
+  // Function returned, drop its return value
+  gen.state = Generator::State::kDone;
+  sp_ = sp;
+  return NullObj();
+}
+
+MemoryStats VirtualMachine::MemoryUsage() {
+  Measure().IgnoreError();
+  return memory_;
+}
+
+absl::Status VirtualMachine::Measure() {
+  memory_.live = LiveBytes();
+  memory_.peak = std::max(memory_.peak, memory_.live);
+  since_measure_ = 0;
+  measure_at_ = std::max(memory_.live, kMinMeasureBytes);
+
+  if (memory_.live > quota_) {
+    return MakeError(fmt::format("memory quota exceeded: {} > {} bytes",
+                                 memory_.live,
+                                 quota_));
+  }
+  return kOkStatus;
+}
+
+size_t VirtualMachine::LiveBytes() const {
+  SeenSet seen;
+  // Slots above sp still hold values until they are overwritten
+  auto bytes = ObjectBytes(last_, seen);
+  for (const auto& obj : stack_) {
+    bytes += ObjectBytes(obj, seen);
+  }
+
+  bytes += frames_.size() * sizeof(Frame);
+  for (const auto& frame : frames_) {
+    for (const auto& free : frame.closure.free) {
+      bytes += ObjectBytes(free, seen);
+    }
+  }
+
+  for (const auto& entry : entries_) {
+    bytes += sizeof(Entry) + ObjectBytes(entry.value, seen);
+  }
+
+  for (const auto& obj : globals_) {
+    bytes += ObjectBytes(obj, seen);
+  }
+
+  const auto task_bytes = [&seen](const TaskPtr& task) {
+    return sizeof(Task) + ObjectBytes(task->func, seen) +
+           ContinuationBytes(task->cont, seen);
+  };
+  for (const auto& task : run_queue_) {
+    bytes += task_bytes(task);
+  }
+  for (const auto& task : blocked_tasks_) {
+    bytes += task_bytes(task);
+  }
+  return bytes;
+}
+
+void VirtualMachine::Unwind(size_t depth, size_t sp) {
+  frames_.resize(depth);
+  sp_ = sp;
+}
 
+void VirtualMachine::Suspend(size_t depth, size_t sp, Continuation& cont) {
+  for (auto it = frames_.begin() + static_cast<std::ptrdiff_t>(depth);
+       it != frames_.end();
+       ++it) {
+    it->bp -= sp;
+    it->ret -= sp;
+    cont.frames.push_back(std::move(*it));
+  }
+  frames_.resize(depth);
+  const auto begin = stack_.begin() + static_cast<std::ptrdiff_t>(sp);
+  const auto end = stack_.begin() + static_cast<std::ptrdiff_t>(sp_);
+  cont.stack.assign(std::make_move_iterator(begin),
+                    std::make_move_iterator(end));
+  sp_ = sp;
+}
+
+void VirtualMachine::Restore(Continuation& cont) {
+  const auto sp = sp_;
+  for (auto& obj : cont.stack) {
+    PushStack(std::move(obj));
+  }
+  for (auto& frame : cont.frames) {
+    frame.bp += sp;
+    frame.ret += sp;
+    PushFrame(std::move(frame));
+  }
+  cont.stack.clear();
+  cont.frames.clear();
+}
+
+absl::Status VirtualMachine::Execute(size_t depth) {
+  const auto& consts = *consts_;
   auto status = kOkStatus;
 
-  while (CurrFrame().ip < CurrFrame().Ins().NumBytes()) {
+  while (frames_.size() > depth) {
     const auto& ins = CurrFrame().Ins();
     auto& ip = CurrFrame().ip;
 
+    // Only the top level frame runs off its end, functions always return
+    if (ip >= ins.NumBytes()) {
+      PopFrame();
+      continue;
+    }
+
     const auto op = ToOpcode(ins.ByteAt(ip));
 
     switch (op) {
@@ -23,7 +453,7 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         const auto const_index = ReadUint16(ins.BytePtr(ip + 1));
         ip += 2;
 
-        PushStack(bc.consts[const_index]);
+        PushStack(consts[const_index]);
         break;
       }
       case Opcode::kNull:
@@ -48,6 +478,14 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         status = ExecComparison(op);
         break;
       }
+      case Opcode::kAddInt:
+      case Opcode::kSubInt:
+      case Opcode::kMulInt:
+      case Opcode::kEqInt:
+      case Opcode::kNeInt:
+      case Opcode::kGtInt:
+        ExecIntOp(op);
+        break;
       case Opcode::kBang: {
         status = ExecBangOp();
         break;
@@ -68,26 +506,54 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
       }
       case Opcode::kJump: {
         size_t pos = ReadUint16(ins.BytePtr(ip + 1));
+        const bool backward = pos <= ip;
         ip = pos - 1;  // the loop will increment ip, so -1
+        if (backward && Tick()) {
+          ++ip;
+          return status;
+        }
         break;
       }
       case Opcode::kJumpNotTrue: {
         size_t pos = ReadUint16(ins.BytePtr(ip + 1));
+        const bool backward = pos <= ip;
         ip += 2;
         const auto cond = PopStack();
-        if (!IsObjTruthy(cond)) ip = pos - 1;
+        if (!IsObjTruthy(cond)) {
+          ip = pos - 1;
+          if (backward && Tick()) {
+            ++ip;
+            return status;
+          }
+        }
+        break;
+      }
+      case Opcode::kJumpNotTrueBool: {
+        size_t pos = ReadUint16(ins.BytePtr(ip + 1));
+        const bool backward = pos <= ip;
+        ip += 2;
+        const auto cond = StackTop().Cast<BoolType>();
+        --sp_;
+        if (!cond) {
+          ip = pos - 1;
+          if (backward && Tick()) {
+            ++ip;
+            return status;
+          }
+        }
         break;
       }
       case Opcode::kSetGlobal: {
         auto index = ReadUint16(ins.BytePtr(ip + 1));
         ip += 2;
-        globals_[index] = PopStack();
+        SetGlobal(index);
         break;
       }
       case Opcode::kGetGlobal: {
         auto index = ReadUint16(ins.BytePtr(ip + 1));
         ip += 2;
-        PushStack(globals_.at(index));
+        CHECK_LT(index, globals_.size());
+        PushStack(globals_[index]);
         break;
       }
       case Opcode::kSetLocal: {
@@ -105,9 +571,9 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         break;
       }
       case Opcode::kGetBuiltin: {
-        const auto index = ins.ByteAt(ip + 1);
-        ip += 1;
-        CHECK_LT(index, static_cast<size_t>(Builtin::kNumBuiltins));
+        const auto index = ReadUint16(ins.BytePtr(ip + 1));
+        ip += 2;
+        CHECK_LT(index, GetBuiltins().size());
         PushStack(GetBuiltins().at(index));
         break;
       }
@@ -115,6 +581,7 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         const auto size = ReadUint16(ins.BytePtr(ip + 1));
         ip += 2;
         PushStack(BuildArray(size));
+        status.Update(Charge(ObjectBytes(StackTop())));
         break;
       }
       case Opcode::kDict: {
@@ -123,24 +590,62 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         auto obj = BuildDict(size);
         if (IsObjError(obj)) return MakeError(obj.Inspect());
         PushStack(std::move(obj));
+        status.Update(Charge(ObjectBytes(StackTop())));
         break;
       }
       case Opcode::kCall: {
         const size_t num_args = ins.ByteAt(ip + 1);
-        ip += 1;
         status.Update(ExecFuncCall(StackTop(num_args), num_args));
+        // Leave ip at the call so that it is retried once the task wakes up
+        if (blocked_) return status;
+        ip += 1;
+        // Tick after the call is made so that a small budget still progresses
+        if (status.ok() && Tick()) {
+          ++ip;
+          return status;
+        }
+        break;
+      }
+      case Opcode::kCallBuiltin: {
+        const auto index = ReadUint16(ins.BytePtr(ip + 1));
+        const size_t num_args = ins.ByteAt(ip + 3);
+        const auto& builtins = GetBuiltins();
+        CHECK_LT(index, builtins.size());
+        status.Update(ExecBuiltinCall(
+            builtins[index].Cast<BuiltinFunc>(), num_args, sp_ - num_args));
+        if (blocked_) return status;
+        ip += 3;
+        if (status.ok() && Tick()) {
+          ++ip;
+          return status;
+        }
+        break;
+      }
+      case Opcode::kCallGlobal: {
+        const auto index = ReadUint16(ins.BytePtr(ip + 1));
+        const size_t num_args = ins.ByteAt(ip + 3);
+        const auto slot = ReadUint16(ins.BytePtr(ip + 4));
+        status.Update(ExecGlobalCall(index, num_args, slot));
+        if (blocked_) return status;
+        ip += 5;
+        if (status.ok() && Tick()) {
+          ++ip;
+          return status;
+        }
         break;
       }
       case Opcode::kReturnVal: {
         auto ret = PopStack();
-        const auto frame = PopFrame();
-        sp_ = frame.bp - 1;  // restore sp
+        auto frame = PopFrame();
+        sp_ = frame.ret;  // restore sp
+        if (frame.memo) Memoize(frame, ret);
         PushStack(std::move(ret));
         continue;  // we do not want to increment ip if we just popped the frame
       }
       case Opcode::kReturn: {
-        const auto frame = PopFrame();
-        sp_ = frame.bp - 1;
+        auto frame = PopFrame();
+        sp_ = frame.ret;
+        if (frame.memo) Memoize(frame, NullObj());
         PushStack(NullObj());
         continue;
       }
@@ -148,23 +653,7 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         const auto index = ReadUint16(ins.BytePtr(ip + 1));
         const auto num_free = ins.ByteAt(ip + 3);
         ip += 3;
-        const auto& obj = bc.consts[index];
-        if (obj.Type() != ObjectType::kCompiled) {
-          status.Update(MakeError("not a function " + Repr(obj.Type())));
-          break;
-        }
-
-        std::vector<Object> free{stack_.begin() + sp_ - num_free,
-                                 stack_.begin() + sp_};
-        //        std::vector<Object> free;
-        //        free.reserve(num_free);
-        //        for (size_t i = 0; i < num_free; ++i) {
-        //          free.push_back(stack_[sp_ - num_free + i]);
-        //        }
-        sp_ -= num_free;
-
-        const auto& func = obj.Cast<CompiledFunc>();
-        PushStack(ClosureObj({func, std::move(free)}));
+        status.Update(ExecClosure(index, num_free));
         break;
       }
       case Opcode::kGetFree: {
@@ -175,6 +664,127 @@ absl::Status VirtualMachine::Run(const Bytecode& bc) {
         PushStack(closure.free[free_index]);
         break;
       }
+      case Opcode::kCurrentClosure: {
+        PushStack(ClosureObj(CurrFrame().closure));
+        break;
+      }
+      case Opcode::kYield: {
+        if (entries_.empty()) return MakeError("yield outside of generator");
+        auto& entry = entries_.back();
+        if (entry.gen == nullptr) {
+          return MakeError("cannot yield across a native call");
+        }
+
+        ++ip;  // resume after yield
+        entry.value = PopStack();
+        PushStack(NullObj());  // value of the yield expression when resumed
+
+        Suspend(entry.depth, entry.sp, entry.gen->cont);
+        entry.gen->state = Generator::State::kSuspended;
+        continue;
+      }
+      case Opcode::kWide: {
+        // Operands too large for the narrow reads above. This is rare enough
+        // to decode generically, ip ends on the last byte like the others.
+        const auto wide_op = ToOpcode(ins.ByteAt(ip + 1));
+        const auto dec = Decode(LookupDefinition(wide_op, true), ins, ip + 2);
+        const auto arg = [&dec](size_t i) {
+          return static_cast<size_t>(dec.operands[i]);
+        };
+        const size_t last = ip + 1 + dec.nbytes;
+
+        switch (wide_op) {
+          case Opcode::kConst:
+            ip = last;
+            PushStack(consts[arg(0)]);
+            break;
+          case Opcode::kJump:
+          case Opcode::kJumpNotTrue:
+          case Opcode::kJumpNotTrueBool: {
+            const auto pos = arg(0);
+            const bool backward = pos <= ip;
+            ip = last;
+            if (wide_op == Opcode::kJump || !IsObjTruthy(PopStack())) {
+              ip = pos - 1;
+              if (backward && Tick()) {
+                ++ip;
+                return status;
+              }
+            }
+            break;
+          }
+          case Opcode::kSetGlobal: {
+            const auto index = arg(0);
+            ip = last;
+            SetGlobal(index);
+            break;
+          }
+          case Opcode::kGetGlobal:
+            ip = last;
+            CHECK_LT(arg(0), globals_.size());
+            PushStack(globals_[arg(0)]);
+            break;
+          case Opcode::kSetLocal:
+            ip = last;
+            stack_.at(CurrFrame().bp + arg(0)) = PopStack();
+            break;
+          case Opcode::kGetLocal:
+            ip = last;
+            PushStack(stack_.at(CurrFrame().bp + arg(0)));
+            break;
+          case Opcode::kGetFree:
+            ip = last;
+            CHECK_LT(arg(0), CurrFrame().closure.free.size());
+            PushStack(CurrFrame().closure.free[arg(0)]);
+            break;
+          case Opcode::kGetBuiltin:
+            ip = last;
+            PushStack(GetBuiltins().at(arg(0)));
+            break;
+          case Opcode::kArray:
+            ip = last;
+            PushStack(BuildArray(arg(0)));
+            status.Update(Charge(ObjectBytes(StackTop())));
+            break;
+          case Opcode::kDict: {
+            ip = last;
+            auto obj = BuildDict(arg(0));
+            if (IsObjError(obj)) return MakeError(obj.Inspect());
+            PushStack(std::move(obj));
+            status.Update(Charge(ObjectBytes(StackTop())));
+            break;
+          }
+          case Opcode::kClosure:
+            ip = last;
+            status.Update(ExecClosure(arg(0), arg(1)));
+            break;
+          case Opcode::kCall:
+          case Opcode::kCallBuiltin:
+          case Opcode::kCallGlobal: {
+            if (wide_op == Opcode::kCall) {
+              status.Update(ExecFuncCall(StackTop(arg(0)), arg(0)));
+            } else if (wide_op == Opcode::kCallBuiltin) {
+              status.Update(ExecBuiltinCall(
+                  GetBuiltins().at(arg(0)).Cast<BuiltinFunc>(),
+                  arg(1),
+                  sp_ - arg(1)));
+            } else {
+              status.Update(ExecGlobalCall(arg(0), arg(1), arg(2)));
+            }
+            // Like the narrow calls, stay on the prefix to retry when woken up
+            if (blocked_) return status;
+            ip = last;
+            if (status.ok() && Tick()) {
+              ++ip;
+              return status;
+            }
+            break;
+          }
+          default:
+            return MakeError("Unhandled wide Opcode: " + Repr(wide_op));
+        }
+        break;
+      }
       default:
         return MakeError("Unhandled Opcode: " + Repr(op));
     }
@@ -223,6 +833,11 @@ absl::Status VirtualMachine::ExecIntBinaryOp(const Object& lhs,
       res = lv * rv;
       break;
     case Opcode::kDiv:
+      // Both would trap instead of returning
+      if (rv == 0) return MakeError("division by zero");
+      if (lv == std::numeric_limits<IntType>::min() && rv == -1) {
+        return MakeError("integer overflow in division");
+      }
       res = lv / rv;
       break;
     default:
@@ -283,6 +898,36 @@ absl::Status VirtualMachine::ExecIntComp(const Object& lhs,
   return kOkStatus;
 }
 
+void VirtualMachine::ExecIntOp(Opcode op) {
+  // The compiler proved both are ints, so no checks and no other types
+  const auto rv = StackTop().Cast<IntType>();
+  --sp_;
+  const auto lv = StackTop().Cast<IntType>();
+
+  switch (op) {
+    case Opcode::kAddInt:
+      ReplaceStackTop(IntObj(lv + rv));
+      break;
+    case Opcode::kSubInt:
+      ReplaceStackTop(IntObj(lv - rv));
+      break;
+    case Opcode::kMulInt:
+      ReplaceStackTop(IntObj(lv * rv));
+      break;
+    case Opcode::kEqInt:
+      ReplaceStackTop(BoolObj(lv == rv));
+      break;
+    case Opcode::kNeInt:
+      ReplaceStackTop(BoolObj(lv != rv));
+      break;
+    case Opcode::kGtInt:
+      ReplaceStackTop(BoolObj(lv > rv));
+      break;
+    default:
+      CHECK(false) << "not an int op " << op;
+  }
+}
+
 absl::Status VirtualMachine::ExecIndexExpr(const Object& lhs,
                                            const Object& index) {
   if (lhs.Type() == ObjectType::kArray && index.Type() == ObjectType::kInt) {
@@ -338,32 +983,17 @@ absl::Status VirtualMachine::ExecFuncCall(const Object& obj, size_t num_args) {
       const auto& closure = obj.Cast<Closure>();
       const auto& func = closure.func;
       if (num_args != func.num_params) {
-        status.Update(
-            MakeError(fmt::format("wrong number of arguments: want={}, got={}",
-                                  func.num_params,
-                                  num_args)));
+        status.Update(WrongNumArgs(func.num_params, num_args));
       } else {
-        PushFrame(Frame{closure, sp_ - num_args});
-        AllocateLocal(func.num_locals);
+        // The return value replaces the function
+        status.Update(CallFrame(closure, num_args, sp_ - num_args - 1));
       }
       break;
     }
     case ObjectType::kBuiltinFunc: {
-      const auto& builtin = obj.Cast<BuiltinFunc>();
-      // Since we are using deque it is not contiguous so we have to construct a
-      // vector
-      std::vector<Object> args{stack_.begin() + sp_ - num_args,
-                               stack_.begin() + sp_};
-      auto res = builtin.func(args);
-
-      // decrease sp to take the arguments and function of the stack
-      sp_ = sp_ - num_args - 1;
-
-      if (IsObjError(res)) {
-        status.Update(MakeError(res.Inspect()));
-      } else {
-        PushStack(std::move(res));
-      }
+      // Also take the function off the stack
+      status.Update(ExecBuiltinCall(
+          obj.Cast<BuiltinFunc>(), num_args, sp_ - num_args - 1));
       break;
     }
     default:
@@ -373,6 +1003,129 @@ absl::Status VirtualMachine::ExecFuncCall(const Object& obj, size_t num_args) {
   return status;
 }
 
+absl::Status VirtualMachine::ExecGlobalCall(size_t index,
+                                            size_t num_args,
+                                            size_t slot) {
+  if (slot >= call_caches_.size()) call_caches_.resize(slot + 1);
+  auto& cache = call_caches_[slot];
+  if (cache.epoch == globals_epoch_ && cache.index == index &&
+      cache.num_args == num_args) {
+    return CallFrame(*cache.closure, num_args, sp_ - num_args);
+  }
+
+  CHECK_LT(index, globals_.size());
+  const auto& obj = globals_[index];
+  switch (obj.Type()) {
+    case ObjectType::kClosure: {
+      const auto& closure = obj.Cast<Closure>();
+      if (num_args != closure.func.num_params) {
+        return WrongNumArgs(closure.func.num_params, num_args);
+      }
+      cache = {&closure, globals_epoch_, index, num_args};
+      return CallFrame(closure, num_args, sp_ - num_args);
+    }
+    case ObjectType::kBuiltinFunc:
+      return ExecBuiltinCall(obj.Cast<BuiltinFunc>(), num_args, sp_ - num_args);
+    default:
+      return MakeError("calling non-function: " + Repr(obj.Type()));
+  }
+}
+
+absl::Status VirtualMachine::CallFrame(const Closure& closure,
+                                       size_t num_args,
+                                       size_t ret) {
+  const auto& func = closure.func;
+  Array memo_args;
+  auto memo = memo_capacity_ > 0 && !memo_stopped_ && func.pure &&
+              closure.free.empty();
+  if (memo) {
+    const auto first =
+        stack_.begin() + static_cast<std::ptrdiff_t>(sp_ - num_args);
+    const auto last = stack_.begin() + static_cast<std::ptrdiff_t>(sp_);
+    memo = std::all_of(
+        first, last, [](const Object& arg) { return IsObjHashable(arg); });
+    if (memo) memo_args.assign(first, last);
+  }
+  if (memo) {
+    if (const auto* res = MemoCache(func).Get(memo_args)) {
+      ++memo_stats_.hits;
+      sp_ = ret;
+      PushStack(*res);
+      return kOkStatus;
+    }
+    ++memo_stats_.misses;
+  }
+
+  const auto num_locals = func.num_locals;
+  PushFrame(Frame{closure, sp_ - num_args, 0, ret, memo, std::move(memo_args)});
+  AllocateLocal(num_locals);
+  // Frames are released on return, a measurement catches deep recursion
+  return Charge(sizeof(Frame) + num_locals * sizeof(Object));
+}
+
+LruCache<Array, Object>& VirtualMachine::MemoCache(const CompiledFunc& func) {
+  auto it = memo_.find(func.ins.get());
+  if (it == memo_.end()) {
+    it = memo_.emplace(func.ins.get(),
+                       MemoTable{func.ins,
+                                 globals_epoch_,
+                                 LruCache<Array, Object>{memo_capacity_}})
+             .first;
+  }
+
+  auto& table = it->second;
+  if (table.epoch != globals_epoch_) {
+    table.cache.Clear();
+    table.epoch = globals_epoch_;
+  }
+  return table.cache;
+}
+
+void VirtualMachine::Memoize(Frame& frame, const Object& value) {
+  MemoCache(frame.closure.func).Put(std::move(frame.memo_args), value);
+}
+
+void VirtualMachine::SetGlobal(size_t index) {
+  if (index >= globals_.size()) globals_.resize(index + 1);
+  auto& global = globals_[index];
+  if (global.Type() == ObjectType::kClosure) memo_stopped_ = true;
+  global = PopStack();
+  ++globals_epoch_;
+}
+
+absl::Status VirtualMachine::ExecBuiltinCall(const BuiltinFunc& builtin,
+                                             size_t num_args,
+                                             size_t base) {
+  // Since we are using deque it is not contiguous so we have to copy the
+  // arguments, which fit inline for almost all calls
+  absl::InlinedVector<Object, 4> args{stack_.begin() + sp_ - num_args,
+                                      stack_.begin() + sp_};
+  auto res = builtin(args, *this);
+  // Keep the arguments on the stack for the retry
+  if (blocked_) return kOkStatus;
+
+  sp_ = base;
+  if (IsObjError(res)) return MakeError(res.Inspect());
+
+  PushStack(std::move(res));
+  return Charge(ObjectBytes(StackTop()));
+}
+
+absl::Status VirtualMachine::ExecClosure(size_t index, size_t num_free) {
+  const auto& obj = (*consts_)[index];
+  if (obj.Type() != ObjectType::kCompiled) {
+    return MakeError("not a function " + Repr(obj.Type()));
+  }
+
+  std::vector<Object> free{stack_.begin() + sp_ - num_free,
+                           stack_.begin() + sp_};
+  sp_ -= num_free;
+
+  const auto& func = obj.Cast<CompiledFunc>();
+  PushStack(ClosureObj({func, std::move(free)}));
+  return Charge(ObjectBytes(StackTop()));
+}
+
 Object VirtualMachine::BuildArray(size_t size) {
   Array arr;
   arr.reserve(size);
@@ -411,7 +1164,7 @@ absl::Status VirtualMachine::ExecStrBinaryOp(const Object& lhs,
   }
 
   PushStack(StrObj(lv + rv));
-  return kOkStatus;
+  return Charge(sizeof(Object) + lv.size() + rv.size());
 }
 
 absl::Status VirtualMachine::ExecBangOp() {
@@ -472,13 +1225,13 @@ void VirtualMachine::ReplaceStackTop(Object obj) {
 
 Frame VirtualMachine::PopFrame() {
   CHECK(!frames_.empty());
-  auto frame = std::move(frames_.top());
-  frames_.pop();
+  auto frame = std::move(frames_.back());
+  frames_.pop_back();
   return frame;
 }
 
 void VirtualMachine::PushFrame(Frame frame) {
-  frames_.emplace(std::move(frame));
+  frames_.push_back(std::move(frame));
 }
 
 void VirtualMachine::AllocateLocal(size_t num_locals) {
@@ -488,4 +1241,14 @@ void VirtualMachine::AllocateLocal(size_t num_locals) {
   sp_ += num_locals;
 }
 
+Compiler::Evaluator MakeEvaluator(int64_t budget, size_t quota) {
+  return [budget, quota](const Bytecode& bc) -> absl::StatusOr<Object> {
+    VirtualMachine vm;
+    vm.SetMemoryQuota(quota);
+    const auto status = vm.Run(bc, budget);
+    if (!status.ok()) return status;
+    return vm.Last();
+  };
+}
+
 }  // namespace monkey
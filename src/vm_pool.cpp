@@ -0,0 +1,84 @@
+#include "monkey/vm_pool.h"
+
+#include <fmt/ostream.h>
+
+#include <algorithm>
+
+namespace monkey {
+
+absl::StatusOr<std::unique_ptr<VirtualMachinePool>> VirtualMachinePool::Create(
+    const Bytecode& bc,
+    size_t num_workers) {
+  if (num_workers == 0) return MakeError("vm pool needs at least one worker");
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  workers.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; ++i) {
+    auto worker = std::make_unique<Worker>();
+    auto status = worker->vm.Run(bc);
+    if (!status.ok()) return status;
+
+    worker->entry = worker->vm.Last();
+    if (worker->entry.Type() != ObjectType::kClosure) {
+      return MakeError(fmt::format("entry of vm pool must be CLOSURE, got {}",
+                                   worker->entry.Type()));
+    }
+    workers.push_back(std::move(worker));
+  }
+
+  return std::unique_ptr<VirtualMachinePool>(
+      new VirtualMachinePool(std::move(workers)));
+}
+
+VirtualMachinePool::VirtualMachinePool(
+    std::vector<std::unique_ptr<Worker>> workers)
+    : workers_{std::move(workers)}, pool_{workers_.size()} {}
+
+VirtualMachinePool::Result VirtualMachinePool::Call(
+    size_t worker,
+    absl::Span<const Object> args) {
+  auto& w = *workers_[worker];
+  return w.vm.CallClosure(w.entry, args);
+}
+
+std::future<VirtualMachinePool::Result> VirtualMachinePool::Invoke(Args args) {
+  auto promise = std::make_shared<std::promise<Result>>();
+  auto future = promise->get_future();
+  pool_.Submit([this, promise, args = std::move(args)](size_t worker) {
+    promise->set_value(Call(worker, args));
+  });
+  return future;
+}
+
+std::vector<VirtualMachinePool::Result> VirtualMachinePool::InvokeAll(
+    absl::Span<const Args> inputs) {
+  std::vector<Result> results(inputs.size());
+  if (inputs.empty()) return results;
+
+  // A few chunks per worker amortize the queueing and still leave enough jobs
+  // for idle workers to steal
+  const auto chunk = std::max<size_t>(1, inputs.size() / (NumWorkers() * 8));
+  const auto num_chunks = (inputs.size() + chunk - 1) / chunk;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t remaining = num_chunks;
+
+  for (size_t begin = 0; begin < inputs.size(); begin += chunk) {
+    const auto end = std::min(begin + chunk, inputs.size());
+    pool_.Submit([&, begin, end](size_t worker) {
+      for (auto i = begin; i < end; ++i) {
+        results[i] = Call(worker, inputs[i]);
+      }
+
+      std::lock_guard<std::mutex> lock{mutex};
+      if (--remaining == 0) cv.notify_one();
+    });
+  }
+
+  std::unique_lock<std::mutex> lock{mutex};
+  cv.wait(lock, [&remaining]() { return remaining == 0; });
+  return results;
+}
+
+}  // namespace monkey
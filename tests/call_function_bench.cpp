@@ -0,0 +1,44 @@
+#include <benchmark/benchmark.h>
+#include <glog/logging.h>
+
+#include "monkey/compiler.h"
+#include "monkey/parser.h"
+#include "monkey/vm.h"
+
+namespace {
+using namespace monkey;
+
+const std::string kScoreCode = R"r(
+    let weight = 3;
+    let score = fn(x) { x * weight + 1 };
+    )r";
+
+void RunScoreCode(VirtualMachine& vm) {
+  Parser parser{kScoreCode};
+  const auto program = parser.ParseProgram();
+  Compiler comp;
+  const auto bc = comp.Compile(program);
+  CHECK(vm.Run(*bc).ok());
+}
+
+void BM_CallFunctionByName(benchmark::State& state) {
+  VirtualMachine vm;
+  RunScoreCode(vm);
+  const std::vector<Object> args = {IntObj(7)};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(vm.CallFunction("score", args));
+  }
+}
+BENCHMARK(BM_CallFunctionByName)->Unit(benchmark::kNanosecond);
+
+void BM_CallFunctionByIndex(benchmark::State& state) {
+  VirtualMachine vm;
+  RunScoreCode(vm);
+  const std::vector<Object> args = {IntObj(7)};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(vm.CallFunction(size_t{1}, args));
+  }
+}
+BENCHMARK(BM_CallFunctionByIndex)->Unit(benchmark::kNanosecond);
+
+}  // namespace
@@ -24,6 +24,12 @@ TEST(CodeTest, TestEncode) {
       {Opcode::kClosure,
        {65534, 255},
        {ToByte(Opcode::kClosure), 255, 254, 255}},
+      {Opcode::kCallBuiltin,
+       {300, 2},
+       {ToByte(Opcode::kCallBuiltin), 1, 44, 2}},
+      {Opcode::kCallGlobal,
+       {1, 3, 258},
+       {ToByte(Opcode::kCallGlobal), 0, 1, 3, 1, 2}},
   };
 
   for (const auto& test : tests) {
@@ -34,6 +40,42 @@ TEST(CodeTest, TestEncode) {
   }
 }
 
+TEST(CodeTest, TestEncodeWide) {
+  struct EncodeTest {
+    Opcode op;
+    std::vector<int> operands;
+    Bytes expected;
+  };
+
+  const auto wide = ToByte(Opcode::kWide);
+  const std::vector<EncodeTest> tests = {
+      {Opcode::kConst, {65536}, {wide, ToByte(Opcode::kConst), 0, 1, 0, 0}},
+      {Opcode::kGetLocal, {256}, {wide, ToByte(Opcode::kGetLocal), 1, 0}},
+      {Opcode::kJump,
+       {70000},
+       {wide, ToByte(Opcode::kJump), 0, 1, 17, 112}},
+      // Every operand is widened even if only one needs it
+      {Opcode::kClosure,
+       {1, 300},
+       {wide, ToByte(Opcode::kClosure), 0, 0, 0, 1, 1, 44}},
+  };
+
+  for (const auto& test : tests) {
+    const auto ins = Encode(test.op, test.operands);
+    EXPECT_THAT(ins.bytes, ContainerEq(test.expected));
+    EXPECT_EQ(ins.NumOps(), 1);
+
+    const auto dec = Decode(LookupDefinition(test.op, true), ins, 2);
+    EXPECT_EQ(dec.nbytes + 2, test.expected.size());
+    EXPECT_THAT(absl::MakeConstSpan(dec.operands),
+                ContainerEq(absl::MakeConstSpan(test.operands)));
+  }
+
+  // Narrow operands can be forced wide, e.g. to patch a widened jump
+  EXPECT_THAT(EncodeWide(Opcode::kGetLocal, {1}).bytes,
+              ContainerEq(Bytes{wide, ToByte(Opcode::kGetLocal), 0, 1}));
+}
+
 TEST(CodeTest, TestEncodeSingle) {
   struct EncodeTest {
     Opcode op;
@@ -52,6 +94,38 @@ TEST(CodeTest, TestEncodeSingle) {
   }
 }  // namespace
 
+TEST(CodeTest, TestEmit) {
+  struct EmitTest {
+    Opcode op;
+    std::vector<int> operands;
+    size_t pos;
+  };
+
+  const std::vector<EmitTest> tests = {
+      {Opcode::kConst, {1}, 0},
+      {Opcode::kAdd, {}, 3},
+      {Opcode::kClosure, {65536, 2}, 4},
+      {Opcode::kCallGlobal, {1, 3, 258}, 12},
+      {Opcode::kGetLocal, {256}, 18},
+  };
+
+  // Same code as appending the encoded instructions
+  Instruction ins;
+  std::vector<Instruction> encoded;
+  for (const auto& test : tests) {
+    EXPECT_EQ(ins.Emit(test.op, test.operands), test.pos);
+    encoded.push_back(Encode(test.op, test.operands));
+  }
+  EXPECT_EQ(ins, ConcatInstructions(encoded));
+  EXPECT_EQ(ins.NumOps(), tests.size());
+
+  for (size_t i = 0; i < kNumOpcodes; ++i) {
+    const auto op = ToOpcode(static_cast<Byte>(i));
+    EXPECT_EQ(LookupDefinition(op).NumOperands(),
+              GetOpcodeInfo(op).num_operands);
+  }
+}
+
 TEST(CodeTest, TestDecode) {
   struct DecodeTest {
     Opcode op;
@@ -82,6 +156,7 @@ TEST(CodeTest, TestInstructionString) {
       Encode(Opcode::kConst, 2),
       Encode(Opcode::kConst, 65534),
       Encode(Opcode::kClosure, {65534, 255}),
+      Encode(Opcode::kConst, 70000),
   };
 
   const std::vector<std::string> expected = {
@@ -90,6 +165,7 @@ TEST(CodeTest, TestInstructionString) {
       "0000 OpConst 2",
       "0000 OpConst 65534",
       "0000 OpClosure 65534 255",
+      "0000 OpWide OpConst 70000",
   };
 
   for (size_t i = 0; i < instructions.size(); ++i) {
@@ -98,7 +174,7 @@ TEST(CodeTest, TestInstructionString) {
 
   const std::string fullstr =
       "0000 OpAdd\n0001 OpGetLocal 1\n0003 OpConst 2\n0006 OpConst 65534\n0009 "
-      "OpClosure 65534 255";
+      "OpClosure 65534 255\n0013 OpWide OpConst 70000";
 
   const auto instr = ConcatInstructions(instructions);
   EXPECT_EQ(instr.Repr(), fullstr);
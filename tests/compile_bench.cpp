@@ -0,0 +1,83 @@
+#include <benchmark/benchmark.h>
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "monkey/compiler.h"
+#include "monkey/parser.h"
+
+namespace {
+using namespace monkey;
+
+constexpr size_t kSourceBytes = size_t{1} << 20;
+
+// Identifiers cannot contain digits, so spell i in letters
+std::string Name(size_t i) {
+  std::string name = "fx";
+  for (; i > 0; i /= 26) name += static_cast<char>('a' + i % 26);
+  return name;
+}
+
+// About 1MB of top-level functions with loops, branches, locals, literals and
+// calls to builtins and to themselves
+std::string MakeSource() {
+  std::string source;
+  for (size_t i = 0; source.size() < kSourceBytes; ++i) {
+    source += fmt::format(R"r(
+    let {0} = fn(n, arr) {{
+        let total = 0;
+        for (let i = 0; i < n; i = i + 1) {{
+            if (i * {1} > len(arr)) {{
+                total = total + arr[i] * {2};
+            }} else {{
+                total = total - {3};
+            }}
+        }}
+        let sq = fn(x) {{ x * x + {1} }};
+        let dict = {{"key": [total, sq(n)], "name": "{0}"}};
+        if (n > 1) {{
+            {0}(n - 1, push(arr, dict["key"][0]))
+        }} else {{
+            total + len(arr)
+        }}
+    }};
+    )r",
+                          Name(i),
+                          i % 7,
+                          i,
+                          i % 13);
+  }
+  return source;
+}
+
+void RunCompile(benchmark::State& state, bool optimize, bool parallel) {
+  const auto source = MakeSource();
+  Parser parser{source};
+  const auto program = parser.ParseProgram();
+  CHECK(parser.Ok()) << parser.ErrorMsg();
+
+  for (auto _ : state) {
+    Compiler comp;
+    comp.SetOptimization(optimize);
+    comp.SetParallel(parallel);
+    const auto bc = comp.Compile(program);
+    CHECK(bc.ok()) << bc.status();
+    benchmark::DoNotOptimize(bc->ins);
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          static_cast<int64_t>(source.size()));
+}
+
+void BM_Compile(benchmark::State& state) { RunCompile(state, true, false); }
+BENCHMARK(BM_Compile)->Unit(benchmark::kMillisecond);
+
+void BM_CompileUnoptimized(benchmark::State& state) {
+  RunCompile(state, false, false);
+}
+BENCHMARK(BM_CompileUnoptimized)->Unit(benchmark::kMillisecond);
+
+void BM_CompileParallel(benchmark::State& state) {
+  RunCompile(state, true, true);
+}
+BENCHMARK(BM_CompileParallel)->Unit(benchmark::kMillisecond);
+
+}  // namespace
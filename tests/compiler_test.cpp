@@ -1,5 +1,7 @@
 #include "monkey/compiler.h"
 
+#include <absl/strings/match.h>
+#include <fmt/core.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -18,19 +20,22 @@ struct CompilerTest {
   std::vector<Instruction> inst_vec;
 };
 
-void CheckLiteral(const CompilerTest& test) {
+void CheckLiteral(const CompilerTest& test, bool fold = false) {
   Parser parser{test.input};
   const auto program = parser.ParseProgram();
   ASSERT_TRUE(parser.Ok()) << parser.ErrorMsg();
 
+  // Without folding by default to check the code emitted for each kind of node
   Compiler compiler;
+  compiler.SetConstantFolding(fold);
+  compiler.SetOptimization(false);
   const auto bc = compiler.Compile(program);
   ASSERT_TRUE(bc.ok()) << bc.status();
 
   // Check instructions
   const auto ins = ConcatInstructions(test.inst_vec);
-  EXPECT_EQ(bc->ins.Repr(), ins.Repr());
-  EXPECT_THAT(bc->consts, ContainerEq(test.constants));
+  EXPECT_EQ(bc->ins->Repr(), ins.Repr());
+  EXPECT_THAT(*bc->consts, ContainerEq(test.constants));
 }
 
 TEST(CompilerTest, TestIntArithmetic) {
@@ -175,6 +180,254 @@ TEST(CompilerTest, TestConditional) {
   }
 }
 
+TEST(CompilerTest, TestLoop) {
+  const std::vector<CompilerTest> tests = {
+      {"let i = 0; while (i < 3) { i = i + 1; }",
+       {IntObj(0), IntObj(3), IntObj(1)},
+       {// 0000
+        Encode(Opcode::kConst, 0),
+        // 0003
+        Encode(Opcode::kSetGlobal, 0),
+        // 0006
+        Encode(Opcode::kConst, 1),
+        // 0009
+        Encode(Opcode::kGetGlobal, 0),
+        // 0012
+        Encode(Opcode::kGt),
+        // 0013
+        Encode(Opcode::kJumpNotTrue, 29),
+        // 0016
+        Encode(Opcode::kGetGlobal, 0),
+        // 0019
+        Encode(Opcode::kConst, 2),
+        // 0022
+        Encode(Opcode::kAdd),
+        // 0023
+        Encode(Opcode::kSetGlobal, 0),
+        // 0026
+        Encode(Opcode::kJump, 6),
+        // 0029
+        Encode(Opcode::kNull),
+        // 0030
+        Encode(Opcode::kPop)}},
+      {"fn() { for (let i = 0; i < 3; i = i + 1) { i } }",
+       {IntObj(0),
+        IntObj(3),
+        IntObj(1),
+        CompiledObj({// 0000
+                     Encode(Opcode::kConst, 0),
+                     // 0003
+                     Encode(Opcode::kSetLocal, 0),
+                     // 0005
+                     Encode(Opcode::kConst, 1),
+                     // 0008
+                     Encode(Opcode::kGetLocal, 0),
+                     // 0010
+                     Encode(Opcode::kGt),
+                     // 0011
+                     Encode(Opcode::kJumpNotTrue, 28),
+                     // 0014
+                     Encode(Opcode::kGetLocal, 0),
+                     // 0016
+                     Encode(Opcode::kPop),
+                     // 0017
+                     Encode(Opcode::kGetLocal, 0),
+                     // 0019
+                     Encode(Opcode::kConst, 2),
+                     // 0022
+                     Encode(Opcode::kAdd),
+                     // 0023
+                     Encode(Opcode::kSetLocal, 0),
+                     // 0025
+                     Encode(Opcode::kJump, 5),
+                     // 0028
+                     Encode(Opcode::kNull),
+                     // 0029
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {3, 0}), Encode(Opcode::kPop)}},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckLiteral(test);
+  }
+}
+
+TEST(CompilerTest, TestAssignErrors) {
+  const std::vector<std::pair<std::string, std::string>> tests = {
+      {"x = 1;", "Undefined variable x"},
+      {"len = 1;", "cannot assign to builtin len"},
+      {"let x = 1; fn() { x = 2; }",
+       "cannot assign to x outside the scope that defines it"},
+      {"fn() { let x = 1; fn() { x = 2; } }",
+       "cannot assign to x outside the scope that defines it"},
+  };
+
+  for (const auto& [input, msg] : tests) {
+    SCOPED_TRACE(input);
+    Parser parser{input};
+    const auto program = parser.ParseProgram();
+    ASSERT_TRUE(parser.Ok()) << parser.ErrorMsg();
+
+    Compiler compiler;
+    const auto bc = compiler.Compile(program);
+    ASSERT_FALSE(bc.ok());
+    EXPECT_EQ(bc.status().message(), msg);
+  }
+}
+
+// Identifiers cannot contain digits, so spell i in letters
+std::string Name(int i) {
+  std::string name = "x";
+  for (; i > 0; i /= 26) name += static_cast<char>('a' + i % 26);
+  return name;
+}
+
+// Check that every jump in ins lands on an instruction or at the end, returns
+// the number of wide jumps
+size_t CheckJumps(const Instruction& ins) {
+  std::vector<size_t> starts;
+  std::vector<size_t> targets;
+  size_t num_wide = 0;
+  for (size_t i = 0; i < ins.NumBytes();) {
+    starts.push_back(i);
+    const bool wide = ToOpcode(ins.ByteAt(i)) == Opcode::kWide;
+    const auto op = ToOpcode(ins.ByteAt(i + wide));
+    const auto dec = Decode(LookupDefinition(op, wide), ins, i + wide + 1);
+    if (op == Opcode::kJump || op == Opcode::kJumpNotTrue) {
+      targets.push_back(static_cast<size_t>(dec.operands[0]));
+      num_wide += wide;
+    }
+    i += size_t{1} + wide + dec.nbytes;
+  }
+  starts.push_back(ins.NumBytes());
+
+  for (const auto target : targets) {
+    EXPECT_TRUE(std::binary_search(starts.cbegin(), starts.cend(), target))
+        << target;
+  }
+  return num_wide;
+}
+
+TEST(CompilerTest, TestWideOperands) {
+  // More locals than fit in a byte
+  std::string input = "fn(a) { ";
+  for (int i = 0; i < 300; ++i) input += fmt::format("let {} = a; ", Name(i));
+  input += fmt::format("{0} = {1}; {0} }}", Name(299), Name(0));
+  {
+    Parser parser{input};
+    Compiler compiler;
+    compiler.SetOptimization(false);
+    const auto bc = compiler.Compile(parser.ParseProgram());
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    const auto func = bc->consts->back().Cast<CompiledFunc>().Ins().Repr();
+    EXPECT_TRUE(absl::StrContains(func, "OpWide OpSetLocal 300"));
+    EXPECT_TRUE(absl::StrContains(func, "OpWide OpGetLocal 300"));
+  }
+
+  // Nested ifs whose code ends right around 64KB. The outer forward jump is
+  // patched last and widened in place, which shifts the inner jumps, and with
+  // the last sizes that pushes their targets out of the narrow range too.
+  const std::vector<size_t> num_wide = {0, 2, 2, 4};
+  for (size_t extra = 0; extra < num_wide.size(); ++extra) {
+    input = "let x = fn() { true }(); if (x) { if (x) { ";
+    for (int i = 0; i < 16372; ++i) input += "1; ";
+    for (size_t i = 0; i < extra; ++i) input += "!x; ";
+    input += "2 } else { 3 }; 4; 5 } else { 6 }";
+
+    Parser parser{input};
+    Compiler compiler;
+    compiler.SetOptimization(false);
+    const auto bc = compiler.Compile(parser.ParseProgram());
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    EXPECT_EQ(CheckJumps(*bc->ins), num_wide[extra]);
+  }
+}
+
+TEST(CompilerTest, TestConstantFolding) {
+  const std::vector<CompilerTest> tests = {
+      {"1 + 2 * 3",
+       {IntObj(7)},
+       {Encode(Opcode::kConst, 0), Encode(Opcode::kPop)}},
+      {"if (1 < 2) { 10 } else { 20 }; 3333;",
+       {IntObj(10), IntObj(3333)},
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kPop)}},
+      {"if (false) { 10 }", {}, {Encode(Opcode::kNull), Encode(Opcode::kPop)}},
+      // Into a closure from a local, a global is read when the function runs
+      {"fn() { let k = 2; fn(x) { x * k } }",
+       {IntObj(2),
+        CompiledObj({Encode(Opcode::kGetLocal, 0),
+                     Encode(Opcode::kConst, 0),
+                     Encode(Opcode::kMul),
+                     Encode(Opcode::kReturnVal)}),
+        CompiledObj({Encode(Opcode::kConst, 0),
+                     Encode(Opcode::kSetLocal, 0),
+                     Encode(Opcode::kClosure, {1, 0}),
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {2, 0}), Encode(Opcode::kPop)}},
+      {"let k = 2; fn(x) { x * k }",
+       {IntObj(2),
+        CompiledObj({Encode(Opcode::kGetLocal, 0),
+                     Encode(Opcode::kGetGlobal, 0),
+                     Encode(Opcode::kMul),
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kClosure, {1, 0}),
+        Encode(Opcode::kPop)}},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckLiteral(test, true);
+  }
+}
+
+TEST(CompilerTest, TestInternedConstants) {
+  const std::vector<CompilerTest> tests = {
+      {R"r(let a = "id"; let b = 0; [a, "id", b, 0, 1])r",
+       {StrObj("id"), IntObj(0), IntObj(1)},
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kSetGlobal, 1),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kGetGlobal, 1),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kConst, 2),
+        Encode(Opcode::kArray, 5),
+        Encode(Opcode::kPop)}},
+      // Same code, the second one takes a param it never uses
+      {"[fn() { 1 }, fn() { 1 }, fn(x) { 1 }]",
+       {IntObj(1),
+        CompiledObj({Encode(Opcode::kConst, 0), Encode(Opcode::kReturnVal)}),
+        CompiledObj({Encode(Opcode::kConst, 0), Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {1, 0}),
+        Encode(Opcode::kClosure, {1, 0}),
+        Encode(Opcode::kClosure, {2, 0}),
+        Encode(Opcode::kArray, 3),
+        Encode(Opcode::kPop)}},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckLiteral(test);
+  }
+
+  // A thousand uses of the same literals still take one slot each
+  std::string input;
+  for (int i = 0; i < 1000; ++i) input += R"r(puts([0, 1, "id"]);)r";
+  Parser parser{input};
+  Compiler compiler;
+  const auto bc = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  EXPECT_EQ(bc->consts->size(), 3);
+}
+
 TEST(CompilerTest, TestGlobalLetStatement) {
   const std::vector<CompilerTest> tests = {
       {"let one = 1; let two = 2;",
@@ -290,23 +543,23 @@ TEST(CompilerTest, TestDictLiterals) {
 TEST(CompilerTest, TestIndexExpression) {
   const std::vector<CompilerTest> tests = {
       {"[1,2,3][1 + 1]",
-       {IntObj(1), IntObj(2), IntObj(3), IntObj(1), IntObj(1)},
+       {IntObj(1), IntObj(2), IntObj(3)},
        {Encode(Opcode::kConst, 0),
         Encode(Opcode::kConst, 1),
         Encode(Opcode::kConst, 2),
         Encode(Opcode::kArray, 3),
-        Encode(Opcode::kConst, 3),
-        Encode(Opcode::kConst, 4),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kConst, 0),
         Encode(Opcode::kAdd),
         Encode(Opcode::kIndex),
         Encode(Opcode::kPop)}},
       {"{1: 2}[2 - 1]",
-       {IntObj(1), IntObj(2), IntObj(2), IntObj(1)},
+       {IntObj(1), IntObj(2)},
        {Encode(Opcode::kConst, 0),
         Encode(Opcode::kConst, 1),
         Encode(Opcode::kDict, 2),
-        Encode(Opcode::kConst, 2),
-        Encode(Opcode::kConst, 3),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kConst, 0),
         Encode(Opcode::kSub),
         Encode(Opcode::kIndex),
         Encode(Opcode::kPop)}},
@@ -345,8 +598,14 @@ TEST(CompilerTest, TestFunction) {
                      Encode(Opcode::kReturnVal)})},
        {Encode(Opcode::kClosure, {2, 0}), Encode(Opcode::kPop)}},
       {"fn() { }",
-       {CompiledObj({Encode(Opcode::kReturn), 0})},
+       {CompiledObj({Encode(Opcode::kReturn)})},
        {Encode(Opcode::kClosure, {0, 0}), Encode(Opcode::kPop)}},
+      {"fn() { yield 1; }",
+       {IntObj(1),
+        CompiledObj({Encode(Opcode::kConst, 0),
+                     Encode(Opcode::kYield),
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {1, 0}), Encode(Opcode::kPop)}},
   };
 
   for (const auto& test : tests) {
@@ -391,17 +650,15 @@ TEST(CompilerTest, TestFunctionCall) {
         CompiledObj({Encode(Opcode::kConst, 0), Encode(Opcode::kReturnVal)})},
        {Encode(Opcode::kClosure, {1, 0}),
         Encode(Opcode::kSetGlobal, 0),
-        Encode(Opcode::kGetGlobal, 0),
-        Encode(Opcode::kCall, 0),
+        Encode(Opcode::kCallGlobal, {0, 0, 0}),
         Encode(Opcode::kPop)}},
       {"let oneArg = fn(a) { a }; oneArg(24);",
        {CompiledObj({Encode(Opcode::kGetLocal, 0), Encode(Opcode::kReturnVal)}),
         IntObj(24)},
        {Encode(Opcode::kClosure, {0, 0}),
         Encode(Opcode::kSetGlobal, 0),
-        Encode(Opcode::kGetGlobal, 0),
         Encode(Opcode::kConst, 1),
-        Encode(Opcode::kCall, 1),
+        Encode(Opcode::kCallGlobal, {0, 1, 0}),
         Encode(Opcode::kPop)}},
       {"let manyArg = fn(a, b, c) { a; b; c}; manyArg(24, 25, 26);",
        {CompiledObj({Encode(Opcode::kGetLocal, 0),
@@ -415,11 +672,20 @@ TEST(CompilerTest, TestFunctionCall) {
         IntObj(26)},
        {Encode(Opcode::kClosure, {0, 0}),
         Encode(Opcode::kSetGlobal, 0),
-        Encode(Opcode::kGetGlobal, 0),
         Encode(Opcode::kConst, 1),
         Encode(Opcode::kConst, 2),
         Encode(Opcode::kConst, 3),
-        Encode(Opcode::kCall, 3),
+        Encode(Opcode::kCallGlobal, {0, 3, 0}),
+        Encode(Opcode::kPop)}},
+      // Every call site gets its own cache slot
+      {"let f = fn() { 1 }; f(); f();",
+       {IntObj(1),
+        CompiledObj({Encode(Opcode::kConst, 0), Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {1, 0}),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kCallGlobal, {0, 0, 0}),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kCallGlobal, {0, 0, 1}),
         Encode(Opcode::kPop)}},
   };
 
@@ -467,25 +733,38 @@ TEST(CompilerTest, TestLetStatementScope) {
 }
 
 TEST(CompilerTest, TestBuiltin) {
+  const auto len = static_cast<int>(Builtin::kLen);
+  const auto push = static_cast<int>(Builtin::kPush);
   const std::vector<CompilerTest> tests = {
       {"len([]); push([], 1);",
        {IntObj(1)},
-       {Encode(Opcode::kGetBuiltin, static_cast<int>(Builtin::kLen)),
-        Encode(Opcode::kArray, 0),
-        Encode(Opcode::kCall, 1),
+       {Encode(Opcode::kArray, 0),
+        Encode(Opcode::kCallBuiltin, {len, 1}),
         Encode(Opcode::kPop),
-        Encode(Opcode::kGetBuiltin, static_cast<int>(Builtin::kPush)),
         Encode(Opcode::kArray, 0),
         Encode(Opcode::kConst, 0),
-        Encode(Opcode::kCall, 2),
+        Encode(Opcode::kCallBuiltin, {push, 2}),
         Encode(Opcode::kPop)}},
       {"fn(){ len([]) };",
-       {CompiledObj(
-           {Encode(Opcode::kGetBuiltin, static_cast<int>(Builtin::kLen)),
-            Encode(Opcode::kArray, 0),
-            Encode(Opcode::kCall, 1),
-            Encode(Opcode::kReturnVal)})},
+       {CompiledObj({Encode(Opcode::kArray, 0),
+                     Encode(Opcode::kCallBuiltin, {len, 1}),
+                     Encode(Opcode::kReturnVal)})},
        {Encode(Opcode::kClosure, {0, 0}), Encode(Opcode::kPop)}},
+      // Builtins used as values are still pushed
+      {"map([], len);",
+       {},
+       {Encode(Opcode::kArray, 0),
+        Encode(Opcode::kGetBuiltin, len),
+        Encode(Opcode::kCallBuiltin, {static_cast<int>(Builtin::kMap), 2}),
+        Encode(Opcode::kPop)}},
+      // A binding that shadows a builtin is called like any other function
+      {"fn(len){ len(1) };",
+       {IntObj(1),
+        CompiledObj({Encode(Opcode::kGetLocal, 0),
+                     Encode(Opcode::kConst, 0),
+                     Encode(Opcode::kCall, 1),
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {1, 0}), Encode(Opcode::kPop)}},
   };
 
   for (const auto& test : tests) {
@@ -564,6 +843,21 @@ TEST(CompilerTest, TestClosure) {
         Encode(Opcode::kSetGlobal, 0),  // global = 55
         Encode(Opcode::kClosure, {6, 0}),
         Encode(Opcode::kPop)}},
+      // A local literal calls its own closure, also from a nested one
+      {"fn() { let f = fn(x) { fn() { f(x) } }; f }",
+       {CompiledObj({Encode(Opcode::kGetFree, 0),  // f
+                     Encode(Opcode::kGetFree, 1),  // x
+                     Encode(Opcode::kCall, 1),
+                     Encode(Opcode::kReturnVal)}),
+        CompiledObj({Encode(Opcode::kCurrentClosure),  // f
+                     Encode(Opcode::kGetLocal, 0),     // x
+                     Encode(Opcode::kClosure, {0, 2}),
+                     Encode(Opcode::kReturnVal)}),
+        CompiledObj({Encode(Opcode::kClosure, {1, 0}),
+                     Encode(Opcode::kSetLocal, 0),  // f
+                     Encode(Opcode::kGetLocal, 0),
+                     Encode(Opcode::kReturnVal)})},
+       {Encode(Opcode::kClosure, {2, 0}), Encode(Opcode::kPop)}},
   };
 
   for (const auto& test : tests) {
@@ -572,4 +866,351 @@ TEST(CompilerTest, TestClosure) {
   }
 }
 
+TEST(CompilerTest, TestRepeatedCompile) {
+  Compiler compiler;
+  compiler.SetConstantFolding(false);
+
+  Parser parser1{"let one = 1; one;"};
+  const auto bc1 = compiler.Compile(parser1.ParseProgram());
+  ASSERT_TRUE(bc1.ok()) << bc1.status();
+
+  Parser parser2{"one + 2;"};
+  const auto bc2 = compiler.Compile(parser2.ParseProgram());
+  ASSERT_TRUE(bc2.ok()) << bc2.status();
+
+  // Second call only returns new code, but still sees the old global
+  const auto expected = ConcatInstructions({Encode(Opcode::kGetGlobal, 0),
+                                            Encode(Opcode::kConst, 1),
+                                            Encode(Opcode::kAdd),
+                                            Encode(Opcode::kPop)});
+  EXPECT_EQ(bc2->ins->Repr(), expected.Repr());
+
+  // Both share the same constant pool
+  EXPECT_EQ(bc1->consts.get(), bc2->consts.get());
+  EXPECT_THAT(*bc2->consts, ContainerEq(std::vector<Object>{IntObj(1), IntObj(2)}));
+}
+
+TEST(CompilerTest, TestPurity) {
+  struct PurityTest {
+    std::string input;
+    bool pure;  // of the last function literal
+  };
+
+  const std::vector<PurityTest> tests = {
+      {"fn(x) { x + 1 }", true},
+      {"fn(a) { len(a) + first(rest(push(a, 1))) }", true},
+      {"let f = fn(x) { if (x < 2) { x } else { f(x - 1) + f(x - 2) } }; f",
+       true},
+      {"let k = 2; let f = fn(x) { x * k }; let g = fn(x) { f(x) }; g", true},
+      {"fn(x) { puts(x) }", false},
+      {"fn(f, x) { f(x) }", false},
+      {"fn(x) { yield x }", false},
+      {"fn(a) { map(a, fn(x) { x }) }", false},
+      {"let p = fn(x) { puts(x) }; let g = fn(x) { p(x) }; g", false},
+      // p is assigned, so calling it may have side effects
+      {"let p = fn(x) { x }; let g = fn(x) { p(x) }; p = fn(x) { puts(x) }; g",
+       false},
+      // f is whatever w returns, not the literal
+      {"let w = fn(g) { g }; let f = w(fn(x) { f(x) }); 1", false},
+      {"let w = fn(g) { g }; let f = 1; f = w(fn(x) { f(x) }); 1", false},
+      // Creating an impure closure is pure, calling it is not
+      {"fn() { let f = fn() { puts(1) }; 1 }", true},
+      {"fn() { let f = fn() { 1 }; f() }", false},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    Parser parser{test.input};
+    const auto program = parser.ParseProgram();
+    ASSERT_TRUE(parser.Ok()) << parser.ErrorMsg();
+
+    // Without inlining, which removes the calls
+    Compiler compiler;
+    compiler.SetOptimization(false);
+    const auto bc = compiler.Compile(program);
+    ASSERT_TRUE(bc.ok()) << bc.status();
+
+    // The outermost literal is compiled last, so it is the last constant
+    const auto it = std::find_if(
+        bc->consts->rbegin(), bc->consts->rend(), [](const Object& obj) {
+          return obj.Type() == ObjectType::kCompiled;
+        });
+    ASSERT_NE(it, bc->consts->rend());
+    EXPECT_EQ(it->Cast<CompiledFunc>().pure, test.pure);
+  }
+}
+
+TEST(CompilerTest, TestInlining) {
+  struct InlineTest {
+    std::string input;
+    size_t num_inlined;
+  };
+
+  const std::vector<InlineTest> tests = {
+      {"let f = fn(x) { x * 2 }; f(3) + f(4)", 2},
+      {"let g = fn(y) { let f = fn(x) { let z = x; z }; f(y + 1) };", 1},
+      {"let f = fn(x, y) { x }; f(1, 2) + f(3, 4)", 2},
+      // A later program may assign a global, functions keep calling it
+      {"let f = fn(x, y) { x }; let g = fn() { f(1, f(2, 3)) };", 0},
+      // Recursive
+      {"let f = fn(x) { f(x) }; f(1)", 0},
+      // Too big
+      {"let f = fn(x) { [x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x] }; "
+       "f(1)",
+       0},
+      // Wrong number of arguments
+      {"let f = fn(x) { x }; f()", 0},
+      // Assigned or defined in a branch
+      {"let f = fn(x) { x }; f = fn(x) { 1 }; f(1)", 0},
+      {"if (true) { let f = fn(x) { x }; f(1) }", 0},
+      // Lifted first, the captured variable becomes an argument
+      {"fn(k) { let g = fn(x) { x + k }; g(1) }", 1},
+      // Captures a variable assigned later
+      {"fn(k) { let g = fn(x) { x + k }; k = 2; g(1) }", 0},
+      // Returns early
+      {"fn() { let f = fn(x) { if (x) { return 1; } 2 }; f(1) }", 0},
+      // Top level has no locals for an argument that is not simple
+      {"let f = fn(x) { x }; f(len([]))", 0},
+      {"let f = fn(x) { let y = x; y }; f(1)", 0},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    Parser parser{test.input};
+    Compiler compiler;
+    const auto bc = compiler.Compile(parser.ParseProgram());
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    EXPECT_EQ(compiler.num_inlined(), test.num_inlined);
+  }
+
+  // Arguments that are a single load are substituted, the others are stored
+  // in new locals of the caller
+  Parser parser{"fn(y) { let f = fn(x) { x * x }; f(y) + f(y + 1) }"};
+  Compiler compiler;
+  const auto bc = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  const auto& func = bc->consts->back().Cast<CompiledFunc>();
+  EXPECT_EQ(func.num_locals, 3);
+  EXPECT_EQ(func.Ins().Repr(),
+            ConcatInstructions({Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kMul),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kConst, 1),
+                                Encode(Opcode::kAdd),
+                                Encode(Opcode::kSetLocal, 2),
+                                Encode(Opcode::kGetLocal, 2),
+                                Encode(Opcode::kGetLocal, 2),
+                                Encode(Opcode::kMul),
+                                Encode(Opcode::kAdd),
+                                Encode(Opcode::kReturnVal)})
+                .Repr());
+}
+
+TEST(CompilerTest, TestLambdaLifting) {
+  struct LiftTest {
+    std::string input;
+    size_t num_lifted;
+  };
+
+  const std::vector<LiftTest> tests = {
+      {"fn(a) { let g = fn(x) { x + a }; g(1) }", 1},
+      {"fn() { let g = fn(n) { if (n > 0) { g(n - 1) } else { 0 } }; g(3) }",
+       1},
+      // Only the caller is lifted, the other one escapes into it
+      {"fn() { let g = fn(x) { x }; let h = fn() { g(1) }; h() }", 1},
+      // Globals are not captured anyway
+      {"let g = fn(x) { x }; g(1)", 0},
+      // Escapes
+      {"fn() { let g = fn(x) { x }; len([g]) }", 0},
+      {"fn() { let g = fn(x) { x }; g(1, 2) }", 0},
+      {"fn() { let g = fn(x) { x }; }", 0},
+      // Captures an assigned variable
+      {"fn(a) { let g = fn() { a }; a = 2; g() }", 0},
+      // Reads a variable of the scope before defining its own
+      {"fn(a) { let g = fn() { let b = a; let a = 1; a + b }; g() }", 0},
+      {"fn() { let g = fn() { 1 }; g(); let g = fn() { 2 }; g() }", 0},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    Parser parser{test.input};
+    Compiler compiler;
+    const auto bc = compiler.Compile(parser.ParseProgram());
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    EXPECT_EQ(compiler.num_lifted(), test.num_lifted);
+  }
+
+  // Too big to inline, the call pushes a closure constant and passes the
+  // captured variable after the argument
+  Parser parser{
+      "fn(a) { let g = fn(x) { [x, a, x, a, x, a, x, a, x, a, x, a, x, a, x, "
+      "a, x] }; g(1) }"};
+  Compiler compiler;
+  const auto bc = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  const auto& closure = (*bc->consts)[0].Cast<Closure>();
+  EXPECT_TRUE(closure.free.empty());
+  EXPECT_EQ(closure.func.num_params, 2);
+  const auto& func = bc->consts->back().Cast<CompiledFunc>();
+  EXPECT_EQ(func.Ins().Repr(),
+            ConcatInstructions({Encode(Opcode::kConst, 0),
+                                Encode(Opcode::kConst, 1),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kCall, 2),
+                                Encode(Opcode::kReturnVal)})
+                .Repr());
+}
+
+TEST(CompilerTest, TestSpecializeTypes) {
+  struct SpecializeTest {
+    std::string input;
+    size_t num_specialized;
+  };
+
+  const std::vector<SpecializeTest> tests = {
+      {"fn(n) { let a = 1; while (n > a) { a = a * 2; } a - 1 }", 3},
+      {"fn(n) { let i = 0; while (i < n) { i = i + 1; } i }", 2},
+      {"fn() { if (!len([])) { 1 } }", 1},
+      // Division checks for zero, but its result is an int
+      {"fn(n) { let a = 4; while (n) { a = a / 2; } a + 1 }", 1},
+      {"fn(x) { x + 1 }", 0},
+      {"fn() { let s = \"a\"; s + \"b\" }", 0},
+      // Not an int on every path
+      {"fn(n) { let a = 1; while (n) { a = \"a\"; } a + 1 }", 0},
+  };
+
+  // Counted for each call to Compile
+  Compiler repl;
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    Parser parser{test.input};
+    const auto bc = repl.Compile(parser.ParseProgram());
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    EXPECT_EQ(repl.num_specialized(), test.num_specialized);
+  }
+
+  Parser parser{"fn() { let i = 0; while (i < 10) { i = i + 1; } i }"};
+  Compiler compiler;
+  const auto bc = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  const auto& func = bc->consts->back().Cast<CompiledFunc>();
+  EXPECT_EQ(func.Ins().Repr(),
+            ConcatInstructions({Encode(Opcode::kConst, 0),
+                                Encode(Opcode::kSetLocal, 0),
+                                Encode(Opcode::kConst, 1),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kGtInt),
+                                Encode(Opcode::kJumpNotTrueBool, 25),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kConst, 2),
+                                Encode(Opcode::kAddInt),
+                                Encode(Opcode::kSetLocal, 0),
+                                Encode(Opcode::kJump, 5),
+                                Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kReturnVal)})
+                .Repr());
+}
+
+TEST(CompilerTest, TestEvaluatedLets) {
+  std::vector<std::string> evaluated;
+  Compiler compiler;
+  compiler.SetEvaluator([&](const Bytecode& bc) -> absl::StatusOr<Object> {
+    evaluated.push_back(bc.ins->Repr());
+    return IntObj(7);
+  });
+
+  Parser parser{"let f = fn(x) { x }; let t = f(1) + 2; let u = t; u = 1;"};
+  const auto bc = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  EXPECT_EQ(compiler.num_evaluated(), 2);
+
+  // Sets the globals it needs and calls the expression compiled as a function,
+  // whose constants are dropped again
+  ASSERT_EQ(evaluated.size(), 2);
+  EXPECT_EQ(evaluated[0],
+            ConcatInstructions({Encode(Opcode::kClosure, {0, 0}),
+                                Encode(Opcode::kSetGlobal, 0),
+                                Encode(Opcode::kClosure, {3, 0}),
+                                Encode(Opcode::kCall, 0),
+                                Encode(Opcode::kPop)})
+                .Repr());
+  EXPECT_EQ(*bc->consts, (Constants{(*bc->consts)[0], IntObj(7), IntObj(1)}));
+  EXPECT_EQ(bc->ins->Repr(),
+            ConcatInstructions({Encode(Opcode::kClosure, {0, 0}),
+                                Encode(Opcode::kSetGlobal, 0),
+                                Encode(Opcode::kConst, 1),
+                                Encode(Opcode::kSetGlobal, 1),
+                                Encode(Opcode::kConst, 1),
+                                Encode(Opcode::kSetGlobal, 2),
+                                Encode(Opcode::kConst, 2),
+                                Encode(Opcode::kSetGlobal, 2)})
+                .Repr());
+}
+
+/// The code and constants of bc, with the layout of compiled functions
+std::vector<std::string> Dump(const Bytecode& bc) {
+  std::vector<std::string> dump = {bc.ins->Repr()};
+  for (const auto& obj : *bc.consts) {
+    auto str = fmt::format("{} {}", Repr(obj.Type()), obj.Inspect());
+    const CompiledFunc* func = nullptr;
+    if (obj.Type() == ObjectType::kCompiled) func = &obj.Cast<CompiledFunc>();
+    if (obj.Type() == ObjectType::kClosure) func = &obj.Cast<Closure>().func;
+    if (func != nullptr) {
+      str += fmt::format(
+          " {} {} {}", func->num_locals, func->num_params, func->pure);
+    }
+    dump.push_back(std::move(str));
+  }
+  return dump;
+}
+
+TEST(CompilerTest, TestParallelCompile) {
+  // Recursion, lifted and inlined locals, strings, builtins and literals
+  // shared between functions, as well as calls to globals of earlier programs
+  std::string funcs;
+  for (int i = 0; i < 16; ++i) {
+    funcs += fmt::format(
+        "let fib{0} = fn(n) {{ if (n < 2) {{ n }} else {{ fib{0}(n - 1) + "
+        "fib{0}(n - 2) }} }};"
+        "let lift{0} = fn(x) {{ let sq = fn(v) {{ v * v }}; let h = fn(y) {{ "
+        "y * {1} + x }}; sq(x) + h(x) + h(2) }};"
+        "let str{0} = fn(s) {{ len(s + \"str{2}\") + [1, 2, {1}][0] }};"
+        "let far{0} = fn(x) {{ big(x) + k + {1} }};",
+        Name(i),
+        i,
+        i % 3);
+  }
+
+  const std::vector<std::string> inputs = {
+      "let k = 5; let big = fn(x) { if (x > 0) { x * 2 + k } else { x - 3 } };"
+      "let small = fn(x) { x }; big = fn(x) { small(x) * (x - k) + len([x]) };",
+      funcs + "let dep = fn() { fibx(3) + liftxb(2) }; dep();",
+      "let bad = fn() { len = 1; }; let good = fn() { 1 };",
+      "let later = fn(x) { fibxd(x) + big(x) }; let same = fn(x) { farxc(x) };",
+      funcs,
+  };
+
+  Compiler serial;
+  Compiler parallel;
+  parallel.SetParallel(true);
+  for (const auto& input : inputs) {
+    Parser serial_parser{input};
+    Parser parallel_parser{input};
+    const auto expected = serial.Compile(serial_parser.ParseProgram());
+    const auto actual = parallel.Compile(parallel_parser.ParseProgram());
+    ASSERT_EQ(actual.ok(), expected.ok()) << input;
+    if (!expected.ok()) {
+      EXPECT_EQ(actual.status(), expected.status());
+      continue;
+    }
+    EXPECT_THAT(Dump(*actual), ContainerEq(Dump(*expected))) << input;
+  }
+
+  EXPECT_GT(parallel.num_parallel(), 0);
+  EXPECT_EQ(parallel.num_inlined(), serial.num_inlined());
+  EXPECT_EQ(parallel.num_lifted(), serial.num_lifted());
+  EXPECT_EQ(parallel.num_specialized(), serial.num_specialized());
+}
+
 }  // namespace
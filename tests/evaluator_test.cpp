@@ -4,6 +4,7 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 
+#include "monkey/builtin.h"
 #include "monkey/parser.h"
 
 namespace {
@@ -198,6 +199,32 @@ TEST(EvaluatorTest, TestLetStatement) {
   }
 }
 
+TEST(EvaluatorTest, TestLoops) {
+  const std::vector<EvalTest> tests = {
+      {"let i = 0; while (i < 10) { i = i + 1; }; i", 10},
+      {"let i = 0; while (false) { i = 1; }", nullptr},
+      {"let s = 0; for (let i = 1; i < 11; i = i + 1) { s = s + i; }; s", 55},
+      {"let f = fn(n) { let s = 0; for (let i = 0; i < n; i = i + 1) { "
+       "s = s + i; } s }; f(5)",
+       10},
+      {"let f = fn() { let i = 0; while (true) { if (i == 3) { return i; } "
+       "i = i + 1; } }; f()",
+       3},
+      {"let i = 0; while (i < 3) { i = i + true; }",
+       "type mismatch: INT + BOOL"s},
+      {"x = 1;", "identifier not found: x"s},
+      {"len = 1;", "cannot assign to builtin len"s},
+      {"let x = 1; let f = fn() { x = 2; }; f()",
+       "cannot assign to x outside the scope that defines it"s},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    const auto obj = ParseAndEval(test.input);
+    CheckLiteral(obj, test.value);
+  }
+}
+
 TEST(EvaluatorTest, TestFunctionObject) {
   const std::string input = "fn(x) { x + 2; return 3; };";
   const auto obj = ParseAndEval(input);
@@ -267,6 +294,54 @@ TEST(EvaluatorTest, TestBuiltinFunctions) {
   }
 }
 
+TEST(EvaluatorTest, TestRegisteredBuiltins) {
+  static const auto index = Register(
+      "eval_add", [](IntType a, IntType b) -> IntType { return a + b; });
+  EXPECT_EQ(FindBuiltin("eval_add"), static_cast<int>(index));
+
+  const std::vector<EvalTest> tests = {
+      {"eval_add(1, 2)", 3},
+      {"reduce([1, 2, 3], 0, eval_add)", 6},
+      {"eval_add(1)", "wrong number of arguments. got=1, want=2"s},
+      {R"r(eval_add(1, "2"))r",
+       "argument 2 to `eval_add` must be INT, got STR"s},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    const auto obj = ParseAndEval(test.input);
+    CheckLiteral(obj, test.value);
+  }
+}
+
+TEST(EvaluatorTest, TestHigherOrderBuiltins) {
+  const std::vector<EvalTest> tests = {
+      {"len(map([1, 2, 3], fn(x) { x * 2 }))", 3},
+      {"map([1, 2, 3], fn(x) { x * 2 })[2]", 6},
+      {"len(filter([1, 2, 3, 4], fn(x) { x > 2 }))", 2},
+      {"reduce([1, 2, 3, 4], 0, fn(acc, x) { acc + x })", 10},
+      {"each([1, 2], fn(x) { x })", nullptr},
+      {"sort_by([3, 1, 2], fn(x) { -x })[0]", 3},
+      {R"r(sort_by(["bb", "a", "ccc"], fn(x) { x })[0])r", "a"s},
+      {"map([1], fn(x, y) { x })", "wrong number of arguments: want=2, got=1"s},
+      {"map(1, fn(x) { x })", "argument to `map` must be ARRAY, got INT"s},
+      {"pmap([1, 2, 3], fn(x) { x * 2 })[2]", 6},
+      {"preduce([1, 2, 3, 4], 0, fn(a, b) { a + b })", 10},
+      // Channels work as plain queues, tasks and generators need the vm
+      {"let c = chan(); send(c, 1); send(c, 2); recv(c) + recv(c)", 3},
+      {"recv(chan())", "`recv` on empty channel would block"s},
+      {"spawn(fn() { 1 })", "tasks are only supported by the vm"s},
+      {"next(generator(fn() { yield 1 }))",
+       "generators are only supported by the vm"s},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    const auto obj = ParseAndEval(test.input);
+    CheckLiteral(obj, test.value);
+  }
+}
+
 TEST(EvaluatorTest, TestArrayLiterals) {
   const std::string input = "[1, 2 * 2, 3 + 3]";
   const auto obj = ParseAndEval(input);
@@ -368,9 +443,10 @@ TEST(EvaluatorTest, TestFibonacci) {
         }
     };)r";
   const std::vector<EvalTest> tests = {
-      {fib_code + "fibonacci(0);", 0}, {fib_code + "fibonacci(1);", 1},
-      //      {fib_code + "fibonacci(2);", 1},
-      //      {fib_code + "fibonacci(3);", 2},
+      {fib_code + "fibonacci(0);", 0},
+      {fib_code + "fibonacci(1);", 1},
+      {fib_code + "fibonacci(2);", 1},
+      {fib_code + "fibonacci(3);", 2},
   };
 
   for (const auto& test : tests) {
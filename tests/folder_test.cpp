@@ -0,0 +1,78 @@
+#include "monkey/folder.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "monkey/parser.h"
+
+namespace {
+
+using namespace monkey;
+
+Program Parse(const std::string& input) {
+  Parser parser{input};
+  auto program = parser.ParseProgram();
+  CHECK(parser.Ok()) << parser.ErrorMsg();
+  return program;
+}
+
+TEST(FolderTest, TestFold) {
+  const std::vector<std::pair<std::string, std::string>> tests = {
+      {"1 + 2 * 3", "7"},
+      {"-5", "-5"},
+      {"10 / 3 - 4", "-1"},
+      {"1 < 2 == true", "true"},
+      {R"r("a" + "b")r", "ab"},
+      {"!5", "false"},
+      {"!!false", "false"},
+      // Left for the vm to fail on
+      {"1 / 0", "(1 / 0)"},
+      {"1 + true", "(1 + true)"},
+      {R"r("a" == "a")r", "(a == a)"},
+      {"9223372036854775807 + 1", "(9223372036854775807 + 1)"},
+      // Propagation
+      {"let a = 2; let b = a * 3; b + x", "let a = 2;\nlet b = 6;\n(6 + x)"},
+      {"let a = 1; a = a + 1; a", "let a = 1;\na = (a + 1);\na"},
+      // Functions read globals when they run, locals are folded into them
+      {"let k = 2; fn(x) { x * k }", "let k = 2;\nfn(x) { (x * k) }"},
+      {"fn() { let k = 2; fn(x) { x * k } }",
+       "fn() { let k = 2;; fn(x) { (x * 2) } }"},
+      {"let k = 1; fn(k) { k }", "let k = 1;\nfn(k) { k }"},
+      {"fn() { let i = 0; i = i + 1; i }",
+       "fn() { let i = 0;; i = (i + 1);; i }"},
+      {"let f = fn(x) { x }; f(1)", "let f = fn(x) { x };\nf(1)"},
+      {"if (x) { let c = 1; }; c", "if x let c = 1;\nc"},
+      // Branches
+      {"if (1 < 2) { 10 } else { 20 }", "if true 10"},
+      {"if (0) { 10 } else { 20 }", "if true 10"},
+      {"if (false) { 10 } else { 20 }", "if false  else 20"},
+      {"if (false) { let y = 1; }", "if false let y = 1;"},
+  };
+
+  for (const auto& [input, expected] : tests) {
+    SCOPED_TRACE(input);
+    ConstantFolder folder;
+    const auto folded = folder.Fold(Parse(input));
+    ASSERT_TRUE(folded.ok()) << folded.status();
+    EXPECT_EQ(folded->String(), expected);
+  }
+}
+
+TEST(FolderTest, TestRepeatedFold) {
+  ConstantFolder folder;
+  ASSERT_TRUE(folder.Fold(Parse("let n = 3; n + 1;")).ok());
+  EXPECT_EQ(folder.Fold(Parse("n * 2")).value().String(), "6");
+
+  // Only used at top level, so later programs may still assign it
+  ASSERT_TRUE(folder.Fold(Parse("n = 4;")).ok());
+  EXPECT_EQ(folder.Fold(Parse("n * 2")).value().String(), "(n * 2)");
+
+  // Functions are left reading the global, so it can still be assigned
+  const auto func = folder.Fold(Parse("let k = 2; let f = fn() { k + 1 };"));
+  ASSERT_TRUE(func.ok()) << func.status();
+  EXPECT_EQ(func->String(), "let k = 2;\nlet f = fn() { (k + 1) };");
+  EXPECT_TRUE(folder.Fold(Parse("k = 3;")).ok());
+  EXPECT_GT(folder.num_folded(), 0);
+}
+
+}  // namespace
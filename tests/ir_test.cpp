@@ -0,0 +1,107 @@
+#include "monkey/ir.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using namespace monkey;
+
+// if (true) { 10 } else { 20 }; 30
+Instruction IfElse() {
+  return ConcatInstructions({
+      Encode(Opcode::kTrue),            // 0000
+      Encode(Opcode::kJumpNotTrue, 10),  // 0001
+      Encode(Opcode::kConst, 0),         // 0004
+      Encode(Opcode::kJump, 13),         // 0007
+      Encode(Opcode::kConst, 1),         // 0010
+      Encode(Opcode::kPop),              // 0013
+      Encode(Opcode::kConst, 2),         // 0014
+      Encode(Opcode::kPop),              // 0017
+  });
+}
+
+TEST(IrTest, TestBuildCfg) {
+  const auto cfg = BuildCfg(IfElse());
+  ASSERT_EQ(cfg.blocks.size(), 5);
+  EXPECT_EQ(cfg.Repr(),
+            "B0\n"
+            "  OpTrue\n"
+            "  if B1 else B2\n"
+            "B1\n"
+            "  OpConst 0\n"
+            "  goto B3\n"
+            "B2\n"
+            "  OpConst 1\n"
+            "  goto B3\n"
+            "B3\n"
+            "  OpPop\n"
+            "  OpConst 2\n"
+            "  OpPop\n"
+            "  goto B4\n"
+            "B4");
+}
+
+TEST(IrTest, TestBuildCfgReturns) {
+  // fn(x) { if (x) { return 1; } 2 }
+  const auto ins = ConcatInstructions({
+      Encode(Opcode::kGetLocal, 0),     // 0000
+      Encode(Opcode::kJumpNotTrue, 9),  // 0002
+      Encode(Opcode::kConst, 0),        // 0005
+      Encode(Opcode::kReturnVal),       // 0008
+      Encode(Opcode::kConst, 1),        // 0009
+      Encode(Opcode::kReturnVal),       // 0012
+  });
+
+  const auto cfg = BuildCfg(ins);
+  ASSERT_EQ(cfg.blocks.size(), 4);
+  EXPECT_TRUE(cfg.blocks[1].Returns());
+  EXPECT_TRUE(cfg.blocks[2].Returns());
+  EXPECT_EQ(cfg.blocks[1].next, kNoBlock);
+  // Nothing reaches the end of the code
+  EXPECT_TRUE(cfg.blocks[3].insts.empty());
+  EXPECT_EQ(LowerCfg(cfg).Repr(), ins.Repr());
+}
+
+TEST(IrTest, TestLowerCfg) {
+  const auto ins = IfElse();
+  const auto lowered = LowerCfg(BuildCfg(ins));
+  EXPECT_EQ(lowered.Repr(), ins.Repr());
+  EXPECT_EQ(lowered.NumOps(), ins.NumOps());
+
+  // Blocks can be moved around, jumps follow them
+  auto cfg = BuildCfg(ins);
+  std::swap(cfg.blocks[1], cfg.blocks[2]);
+  cfg.blocks[0].next = 2;
+  cfg.blocks[0].target = 1;
+  EXPECT_EQ(LowerCfg(cfg).Repr(),
+            "0000 OpTrue\n"
+            "0001 OpJumpNotTrue 7\n"
+            "0004 OpJump 13\n"
+            "0007 OpConst 1\n"
+            "0010 OpJump 16\n"
+            "0013 OpConst 0\n"
+            "0016 OpPop\n"
+            "0017 OpConst 2\n"
+            "0020 OpPop");
+}
+
+TEST(IrTest, TestLowerCfgWide) {
+  // A jump over a block too big for a narrow operand
+  Cfg cfg;
+  cfg.blocks.resize(3);
+  cfg.blocks[0].insts = {{Opcode::kTrue}};
+  cfg.blocks[0].cond = true;
+  cfg.blocks[0].next = 1;
+  cfg.blocks[0].target = 2;
+  cfg.blocks[1].insts.assign(70000, {Opcode::kNull});
+  cfg.blocks[1].next = 2;
+
+  const auto ins = LowerCfg(cfg);
+  EXPECT_EQ(ins.NumBytes(), 1 + 6 + 70000);
+  EXPECT_EQ(ins.NumOps(), 1 + 1 + 70000);
+  EXPECT_EQ(ToOpcode(ins.ByteAt(1)), Opcode::kWide);
+  EXPECT_EQ(ReadUint32(&ins.bytes[3]), 70007);
+}
+
+}  // namespace
@@ -0,0 +1,126 @@
+#include <benchmark/benchmark.h>
+#include <fmt/core.h>
+#include <glog/logging.h>
+
+#include "monkey/compiler.h"
+#include "monkey/parser.h"
+#include "monkey/vm.h"
+
+namespace {
+using namespace monkey;
+
+// Recursive versions of data/fib.mky and data/map.mky next to the loop
+// versions in data/fib_loop.mky and data/map_loop.mky. The recursive helpers
+// are globals.
+
+const std::string kFibRecursive = R"r(
+    let fibonacci = fn(x) {
+        if (x < 2) { x } else { fibonacci(x - 1) + fibonacci(x - 2) }
+    };
+    )r";
+
+const std::string kFibLoop = R"r(
+    let fibonacci = fn(x) {
+        let a = 0;
+        let b = 1;
+        for (let i = 0; i < x; i = i + 1) {
+            let t = a + b;
+            a = b;
+            b = t;
+        }
+        a
+    };
+    )r";
+
+const std::string kMapRecursive = R"r(
+    let range_iter = fn(i, n, arr) {
+        if (i == n) { arr } else { range_iter(i + 1, n, push(arr, i)) }
+    };
+    let range = fn(n) { range_iter(0, n, []) };
+    let map_iter = fn(arr, accumulated, f) {
+        if (len(arr) == 0) {
+            accumulated
+        } else {
+            map_iter(rest(arr), push(accumulated, f(first(arr))), f);
+        }
+    };
+    let map = fn(arr, f) { map_iter(arr, [], f) };
+    let reduce_iter = fn(arr, result, f) {
+        if (len(arr) == 0) {
+            result
+        } else {
+            reduce_iter(rest(arr), f(result, first(arr)), f);
+        }
+    };
+    let reduce = fn(arr, initial, f) { reduce_iter(arr, initial, f) };
+    )r";
+
+const std::string kMapLoop = R"r(
+    let range = fn(n) {
+        let arr = [];
+        for (let i = 0; i < n; i = i + 1) { arr = push(arr, i); }
+        arr
+    };
+    let map = fn(arr, f) {
+        let accumulated = [];
+        for (let i = 0; i < len(arr); i = i + 1) {
+            accumulated = push(accumulated, f(arr[i]));
+        }
+        accumulated
+    };
+    let reduce = fn(arr, initial, f) {
+        let result = initial;
+        let i = 0;
+        while (i < len(arr)) {
+            result = f(result, arr[i]);
+            i = i + 1;
+        }
+        result
+    };
+    )r";
+
+const std::string kSumDoubled = R"r(
+    let double = fn(x) { x * 2 };
+    let sum = fn(arr) { reduce(arr, 0, fn(acc, el) { acc + el }) };
+    )r";
+
+std::string SumDoubledCall(int64_t n) {
+  return kSumDoubled + fmt::format("sum(map(range({}), double));", n);
+}
+
+void RunVm(benchmark::State& state, const std::string& code) {
+  Parser parser{code};
+  const auto program = parser.ParseProgram();
+  CHECK(parser.Ok()) << parser.ErrorMsg();
+  Compiler comp;
+  const auto bc = comp.Compile(program);
+  CHECK(bc.ok()) << bc.status();
+
+  VirtualMachine vm;
+  for (auto _ : state) {
+    CHECK(vm.Run(*bc).ok());
+    benchmark::DoNotOptimize(vm.Last());
+  }
+}
+
+void BM_FibRecursive(benchmark::State& state) {
+  RunVm(state, kFibRecursive + fmt::format("fibonacci({});", state.range(0)));
+}
+BENCHMARK(BM_FibRecursive)->Arg(10)->Arg(15);
+
+void BM_FibLoop(benchmark::State& state) {
+  RunVm(state, kFibLoop + fmt::format("fibonacci({});", state.range(0)));
+}
+BENCHMARK(BM_FibLoop)->Arg(10)->Arg(15);
+
+void BM_MapRecursive(benchmark::State& state) {
+  RunVm(state, kMapRecursive + SumDoubledCall(state.range(0)));
+}
+BENCHMARK(BM_MapRecursive)->Arg(10)->Arg(100);
+
+void BM_MapLoop(benchmark::State& state) {
+  RunVm(state, kMapLoop + SumDoubledCall(state.range(0)));
+}
+BENCHMARK(BM_MapLoop)->Arg(10)->Arg(100);
+
+}  // namespace
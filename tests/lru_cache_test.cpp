@@ -0,0 +1,51 @@
+#include "monkey/lru_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace {
+
+using namespace monkey;
+
+TEST(LruCacheTest, TestGetPut) {
+  LruCache<int, std::string> cache{2};
+  EXPECT_EQ(cache.Get(1), nullptr);
+
+  cache.Put(1, "a");
+  cache.Put(2, "b");
+  ASSERT_NE(cache.Get(1), nullptr);
+  EXPECT_EQ(*cache.Get(1), "a");
+  EXPECT_EQ(cache.size(), 2);
+
+  cache.Put(2, "c");
+  EXPECT_EQ(*cache.Get(2), "c");
+  EXPECT_EQ(cache.size(), 2);
+
+  cache.Clear();
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.Get(1), nullptr);
+}
+
+TEST(LruCacheTest, TestEvictLeastRecentlyUsed) {
+  LruCache<int, int> cache{2};
+  cache.Put(1, 10);
+  cache.Put(2, 20);
+  cache.Get(1);  // 2 is now the least recently used
+  cache.Put(3, 30);
+
+  EXPECT_EQ(cache.Get(2), nullptr);
+  ASSERT_NE(cache.Get(1), nullptr);
+  ASSERT_NE(cache.Get(3), nullptr);
+  EXPECT_EQ(*cache.Get(3), 30);
+  EXPECT_EQ(cache.size(), 2);
+}
+
+TEST(LruCacheTest, TestZeroCapacity) {
+  LruCache<int, int> cache{0};
+  cache.Put(1, 10);
+  EXPECT_EQ(cache.Get(1), nullptr);
+  EXPECT_EQ(cache.size(), 0);
+}
+
+}  // namespace
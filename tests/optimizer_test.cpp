@@ -0,0 +1,427 @@
+#include "monkey/optimizer.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using namespace monkey;
+
+struct OptimizerTest {
+  std::string name;
+  std::vector<Instruction> input;
+  std::vector<Instruction> expected;
+  bool function{true};
+  size_t num_locals{0};  // after optimization
+};
+
+void CheckPass(PassManager::Pass pass,
+               const std::vector<OptimizerTest>& tests) {
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.name);
+    PassManager passes;
+    passes.Clear();
+    passes.Add("Pass", pass);
+
+    TimerManager timers;
+    const std::vector<Object> consts = {IntObj(1), StrObj("a")};
+    CodeUnit unit;
+    unit.num_locals = 1;
+    unit.function = test.function;
+    unit.consts = &consts;
+    const auto ins =
+        passes.Optimize(ConcatInstructions(test.input), unit, timers);
+    EXPECT_EQ(ins.Repr(), ConcatInstructions(test.expected).Repr());
+    EXPECT_EQ(unit.num_locals, std::max<size_t>(test.num_locals, 1));
+    EXPECT_GT(timers.GetStats("Pass").count(), 0);
+  }
+}
+
+TEST(OptimizerTest, TestThreadJumps) {
+  const std::vector<OptimizerTest> tests = {
+      {"chain",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kJumpNotTrue, 7),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kJump, 12),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal)},
+       // The else branch goes straight to the end of the chain
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kJumpNotTrue, 12),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kJump, 12),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal)}},
+      {"constant condition",
+       {Encode(Opcode::kTrue),
+        Encode(Opcode::kJumpNotTrue, 8),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kTrue),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kReturnVal)}},
+      {"false condition",
+       {Encode(Opcode::kFalse),
+        Encode(Opcode::kJumpNotTrue, 8),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kFalse),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kJump, 9),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kReturnVal),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kReturnVal)}},
+  };
+  CheckPass(ThreadJumps, tests);
+}
+
+TEST(OptimizerTest, TestPropagateCopies) {
+  const std::vector<OptimizerTest> tests = {
+      {"local",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kSetLocal, 1),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kSetLocal, 1),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kReturnVal)}},
+      {"source assigned",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kSetLocal, 1),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kSetLocal, 1),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kReturnVal)}},
+      {"global",
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kPop)},
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kPop)},
+       false},
+      // Top-level code may assign globals while a call waits or a generator
+      // is suspended, copies of locals are kept
+      {"call",
+       {Encode(Opcode::kGetGlobal, 1),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kGetGlobal, 2),
+        Encode(Opcode::kCall, 0),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kPop)},
+       {Encode(Opcode::kGetGlobal, 1),
+        Encode(Opcode::kSetGlobal, 0),
+        Encode(Opcode::kGetGlobal, 2),
+        Encode(Opcode::kCall, 0),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kPop)},
+       false},
+      {"yield",
+       {Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kSetLocal, 2),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kYield),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kGetLocal, 2),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kSetLocal, 2),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kYield),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)}},
+  };
+  CheckPass(PropagateCopies, tests);
+}
+
+TEST(OptimizerTest, TestEliminateDeadCode) {
+  const std::vector<OptimizerTest> tests = {
+      {"unreachable",
+       {Encode(Opcode::kJump, 7),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kNull), Encode(Opcode::kReturnVal)}},
+      {"dead store",
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kNull), Encode(Opcode::kReturnVal)}},
+      {"top level",
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kJump, 9),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kPop)},
+       {Encode(Opcode::kConst, 0), Encode(Opcode::kPop)},
+       false},
+  };
+  CheckPass(EliminateDeadCode, tests);
+}
+
+TEST(OptimizerTest, TestEliminateCommonSubexprs) {
+  const std::vector<OptimizerTest> tests = {
+      {"repeated",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kSetLocal, 1),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kGetLocal, 1),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)},
+       true,
+       2},
+      {"too small",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)}},
+      {"assigned in between",
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kConst, 1),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)}},
+      {"call in between",
+       {Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kGetGlobal, 1),
+        Encode(Opcode::kCall, 0),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kPop),
+        Encode(Opcode::kGetGlobal, 1),
+        Encode(Opcode::kCall, 0),
+        Encode(Opcode::kGetGlobal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kMinus),
+        Encode(Opcode::kReturnVal)}},
+  };
+  CheckPass(EliminateCommonSubexprs, tests);
+}
+
+TEST(OptimizerTest, TestSpecializeTypes) {
+  // Constant 0 is an int, constant 1 a string
+  const std::vector<OptimizerTest> tests = {
+      {"ints",
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kGt),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAddInt),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kGtInt),
+        Encode(Opcode::kReturnVal)}},
+      {"not ints",
+       {Encode(Opcode::kConst, 1),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kDiv),
+        Encode(Opcode::kEq),
+        Encode(Opcode::kReturnVal)},
+       {Encode(Opcode::kConst, 1),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kMul),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kDiv),
+        Encode(Opcode::kEq),
+        Encode(Opcode::kReturnVal)}},
+      {"loop",
+       {Encode(Opcode::kConst, 0),           // 0000
+        Encode(Opcode::kSetLocal, 0),        // 0003
+        Encode(Opcode::kGetLocal, 0),        // 0005
+        Encode(Opcode::kConst, 0),           // 0007
+        Encode(Opcode::kGt),                 // 0010
+        Encode(Opcode::kJumpNotTrue, 25),    // 0011
+        Encode(Opcode::kGetLocal, 0),        // 0014
+        Encode(Opcode::kConst, 0),           // 0016
+        Encode(Opcode::kAdd),                // 0019
+        Encode(Opcode::kSetLocal, 0),        // 0020
+        Encode(Opcode::kJump, 5),            // 0022
+        Encode(Opcode::kNull),               // 0025
+        Encode(Opcode::kReturnVal)},         // 0026
+       {Encode(Opcode::kConst, 0),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kGtInt),
+        Encode(Opcode::kJumpNotTrueBool, 25),
+        Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAddInt),
+        Encode(Opcode::kSetLocal, 0),
+        Encode(Opcode::kJump, 5),
+        Encode(Opcode::kNull),
+        Encode(Opcode::kReturnVal)}},
+      {"branches disagree",
+       {Encode(Opcode::kGetLocal, 0),      // 0000
+        Encode(Opcode::kJumpNotTrue, 11),  // 0002
+        Encode(Opcode::kConst, 0),         // 0005
+        Encode(Opcode::kJump, 12),         // 0008
+        Encode(Opcode::kTrue),             // 0011
+        Encode(Opcode::kConst, 0),         // 0012
+        Encode(Opcode::kAdd),              // 0015
+        Encode(Opcode::kReturnVal)},       // 0016
+       {Encode(Opcode::kGetLocal, 0),
+        Encode(Opcode::kJumpNotTrue, 11),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kJump, 12),
+        Encode(Opcode::kTrue),
+        Encode(Opcode::kConst, 0),
+        Encode(Opcode::kAdd),
+        Encode(Opcode::kReturnVal)}},
+  };
+  CheckPass(SpecializeTypes, tests);
+}
+
+TEST(OptimizerTest, TestPassManager) {
+  // fn(x) { let y = x; if (true) { -(y * 2) + -(y * 2) } }
+  const auto ins = ConcatInstructions({
+      Encode(Opcode::kGetLocal, 0),      // 0000
+      Encode(Opcode::kSetLocal, 1),      // 0002
+      Encode(Opcode::kTrue),             // 0004
+      Encode(Opcode::kJumpNotTrue, 26),  // 0005
+      Encode(Opcode::kGetLocal, 1),      // 0008
+      Encode(Opcode::kConst, 0),         // 0010
+      Encode(Opcode::kMul),              // 0013
+      Encode(Opcode::kMinus),            // 0014
+      Encode(Opcode::kGetLocal, 1),      // 0015
+      Encode(Opcode::kConst, 0),         // 0017
+      Encode(Opcode::kMul),              // 0020
+      Encode(Opcode::kMinus),            // 0021
+      Encode(Opcode::kAdd),              // 0022
+      Encode(Opcode::kJump, 27),         // 0023
+      Encode(Opcode::kNull),             // 0026
+      Encode(Opcode::kReturnVal),        // 0027
+  });
+
+  PassManager passes;
+  TimerManager timers;
+  CodeUnit unit;
+  unit.num_locals = 2;
+  unit.function = true;
+  const auto optimized = passes.Optimize(ins, unit, timers);
+  EXPECT_EQ(optimized.Repr(),
+            ConcatInstructions({Encode(Opcode::kGetLocal, 0),
+                                Encode(Opcode::kConst, 0),
+                                Encode(Opcode::kMul),
+                                Encode(Opcode::kMinus),
+                                Encode(Opcode::kSetLocal, 2),
+                                Encode(Opcode::kGetLocal, 2),
+                                Encode(Opcode::kGetLocal, 2),
+                                Encode(Opcode::kAdd),
+                                Encode(Opcode::kReturnVal)})
+                .Repr());
+  EXPECT_EQ(unit.num_locals, 3);
+  for (const auto* name : {"BuildCfg", "ThreadJumps", "PropagateCopies",
+                           "EliminateDeadCode", "EliminateCommonSubexprs",
+                           "SpecializeTypes", "LowerCfg"}) {
+    EXPECT_GT(timers.GetStats(name).count(), 0) << name;
+  }
+}
+
+}  // namespace
@@ -263,6 +263,38 @@ TEST(ParserTest, TestParsingIfExpression) {
   CheckIdentifier(GetExpr(true_stmt), "x");
 }
 
+TEST(ParserTest, TestParsingLoops) {
+  const std::vector<std::pair<std::string, std::string>> tests = {
+      {"x = x + 1;", "x = (x + 1);"},
+      {"while (x < 3) { x = x + 1; }", "while (x < 3) x = (x + 1);"},
+      {"for (let i = 0; i < 3; i = i + 1) { puts(i) }",
+       "for (let i = 0; (i < 3); i = (i + 1)) puts(i)"},
+      {"for (i = 0; i < 3; f(i)) { }", "for (i = 0; (i < 3); f(i)) "},
+  };
+
+  for (const auto& [input, expected] : tests) {
+    SCOPED_TRACE(input);
+    Parser parser{input};
+    const auto program = parser.ParseProgram();
+    ASSERT_TRUE(parser.Ok()) << parser.ErrorMsg();
+    ASSERT_EQ(program.NumStatements(), 1);
+    EXPECT_EQ(program.String(), expected);
+  }
+
+  Parser parser{"for (i; i < 3; i = i + 1) { i }"};
+  parser.ParseProgram();
+  EXPECT_FALSE(parser.Ok());
+
+  Parser parser2{"let i = 0; while (i < 3) { i = i + 1; }; i"};
+  const auto program = parser2.ParseProgram();
+  ASSERT_TRUE(parser2.Ok()) << parser2.ErrorMsg();
+  ASSERT_EQ(program.NumStatements(), 3);
+  EXPECT_EQ(program.statements[1].Type(), NodeType::kWhileStmt);
+  const auto* loop = program.statements[1].PtrCast<WhileStmt>();
+  ASSERT_EQ(loop->body.size(), 1);
+  EXPECT_EQ(loop->body.statements.front().Type(), NodeType::kAssignStmt);
+}
+
 TEST(ParserTest, TestParsingFunctionLiteral) {
   const std::string input = "fn(x, y) { x + y; }";
 
@@ -324,6 +356,21 @@ TEST(ParserTest, TestParsingCallExpression) {
   CheckInfixExpr(ptr->args[2], 4, "+", 5);
 }
 
+TEST(ParserTest, TestParsingYieldExpression) {
+  const std::string input = "yield x + 1;";
+  Parser parser{input};
+  const auto program = parser.ParseProgram();
+  ASSERT_EQ(program.NumStatements(), 1);
+  const auto stmt = program.statements.front();
+  ASSERT_EQ(stmt.Type(), NodeType::kExprStmt);
+  const auto& expr = GetExpr(stmt);
+  ASSERT_EQ(expr.Type(), NodeType::kYieldExpr);
+  const auto* ptr = expr.PtrCast<YieldExpr>();
+  ASSERT_NE(ptr, nullptr);
+  CheckInfixExpr(ptr->value, std::string{"x"}, "+", 1);
+  EXPECT_EQ(expr.String(), "yield (x + 1)");
+}
+
 TEST(ParserTest, TestStrLiteralExpression) {
   const std::string input = R"raw("hello world";)raw";
   Parser parser{input};
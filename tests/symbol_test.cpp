@@ -248,4 +248,59 @@ TEST(SymbolTest, TestResolveUnResolvableFree) {
   }
 }
 
+TEST(SymbolTest, TestDefineFunctionName) {
+  auto global = SymbolTable{};
+  auto local = SymbolTable{&global};
+  local.DefineFunctionName("f");
+  local.DefineFunctionName("g");
+  local.Define("g");
+
+  auto nested = SymbolTable{&local};
+  const std::vector<Symbol> symbols = {
+      {"f", SymbolScope::kFunction, 0},
+      {"g", SymbolScope::kLocal, 0},
+  };
+  for (const auto& sym : symbols) {
+    const auto res = local.Resolve(sym.name);
+    ASSERT_TRUE(res.has_value());
+    EXPECT_EQ(*res, sym);
+  }
+
+  // Captured like a local of the function
+  const auto res = nested.Resolve("f");
+  ASSERT_TRUE(res.has_value());
+  EXPECT_EQ(*res, (Symbol{"f", SymbolScope::kFree, 0}));
+  EXPECT_EQ(nested.FreeSymbols(), std::vector<Symbol>{symbols[0]});
+}
+
+TEST(SymbolTest, TestOverlay) {
+  auto global = SymbolTable{};
+  global.DefineBuiltin("len", 0);
+  global.Define("a");
+  global.Define("b");
+
+  auto overlay = SymbolTable::Overlay(global);
+  EXPECT_TRUE(overlay->IsGlobal());
+  EXPECT_EQ(overlay->Define("b"), Symbol({"b", SymbolScope::kGlobal, 2}));
+  EXPECT_EQ(overlay->Define("c"), Symbol({"c", SymbolScope::kGlobal, 3}));
+
+  auto local = SymbolTable{overlay.get()};
+  const std::vector<Symbol> symbols = {
+      {"len", SymbolScope::kBuiltin, 0},
+      {"a", SymbolScope::kGlobal, 0},
+      {"b", SymbolScope::kGlobal, 2},
+      {"c", SymbolScope::kGlobal, 3},
+  };
+  for (const auto& sym : symbols) {
+    const auto res = local.Resolve(sym.name);
+    ASSERT_TRUE(res.has_value());
+    EXPECT_EQ(*res, sym);
+  }
+
+  // The base is left as it was
+  EXPECT_EQ(global.NumDefs(), 2);
+  EXPECT_EQ(global.Resolve("b"), Symbol({"b", SymbolScope::kGlobal, 1}));
+  EXPECT_FALSE(global.Resolve("c").has_value());
+}
+
 }  // namespace
@@ -0,0 +1,49 @@
+#include "monkey/thread_pool.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using namespace monkey;
+
+TEST(ThreadPoolTest, TestRunAllJobs) {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool{4};
+    EXPECT_EQ(pool.NumWorkers(), 4);
+    for (int i = 0; i < 1000; ++i) {
+      pool.Submit([&count](size_t) { ++count; });
+    }
+  }
+  EXPECT_EQ(count, 1000);
+}
+
+TEST(ThreadPoolTest, TestWorkerIndex) {
+  std::atomic<int> bad{0};
+  {
+    ThreadPool pool{3};
+    for (int i = 0; i < 100; ++i) {
+      pool.Submit([&bad](size_t worker) {
+        if (worker >= 3) ++bad;
+      });
+    }
+  }
+  EXPECT_EQ(bad, 0);
+}
+
+TEST(ThreadPoolTest, TestSubmitFromJob) {
+  std::atomic<int> count{0};
+  {
+    ThreadPool pool{2};
+    for (int i = 0; i < 10; ++i) {
+      pool.Submit([&pool, &count](size_t) {
+        for (int j = 0; j < 10; ++j) {
+          pool.Submit([&count](size_t) { ++count; });
+        }
+      });
+    }
+  }
+  EXPECT_EQ(count, 100);
+}
+
+}  // namespace
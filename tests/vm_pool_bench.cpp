@@ -0,0 +1,39 @@
+#include <benchmark/benchmark.h>
+
+#include "monkey/compiler.h"
+#include "monkey/parser.h"
+#include "monkey/vm_pool.h"
+
+namespace {
+using namespace monkey;
+
+const std::string kRuleCode = R"r(
+    let fibonacci = fn(x) {
+        if (x < 2) { x } else { fibonacci(x - 1) + fibonacci(x - 2) }
+    };
+    fn(x) { fibonacci(x) };
+    )r";
+
+constexpr int kNumInputs = 256;
+
+void BM_VirtualMachinePool(benchmark::State& state) {
+  Parser parser{kRuleCode};
+  const auto program = parser.ParseProgram();
+  Compiler comp;
+  const auto bc = comp.Compile(program);
+  const auto pool =
+      VirtualMachinePool::Create(*bc, static_cast<size_t>(state.range(0)));
+
+  const std::vector<VirtualMachinePool::Args> inputs(kNumInputs, {IntObj(10)});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize((*pool)->InvokeAll(inputs));
+  }
+  state.SetItemsProcessed(state.iterations() * kNumInputs);
+}
+BENCHMARK(BM_VirtualMachinePool)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -0,0 +1,74 @@
+#include "monkey/vm_pool.h"
+
+#include <gtest/gtest.h>
+
+#include "monkey/parser.h"
+
+namespace {
+
+using namespace monkey;
+
+absl::StatusOr<std::unique_ptr<VirtualMachinePool>> MakePool(
+    const std::string& input,
+    size_t num_workers) {
+  Parser parser{input};
+  const auto program = parser.ParseProgram();
+  Compiler comp;
+  const auto bc = comp.Compile(program);
+  if (!bc.ok()) return bc.status();
+  return VirtualMachinePool::Create(*bc, num_workers);
+}
+
+TEST(VmPoolTest, TestInvokeAll) {
+  const auto pool = MakePool("let k = 10; fn(x) { x * 2 + k }", 4);
+  ASSERT_TRUE(pool.ok()) << pool.status();
+  EXPECT_EQ((*pool)->NumWorkers(), 4);
+
+  std::vector<VirtualMachinePool::Args> inputs;
+  for (int i = 0; i < 1000; ++i) {
+    inputs.push_back({IntObj(i)});
+  }
+
+  const auto results = (*pool)->InvokeAll(inputs);
+  ASSERT_EQ(results.size(), inputs.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    ASSERT_TRUE(results[i].ok()) << results[i].status();
+    EXPECT_EQ(results[i]->Cast<IntType>(), static_cast<IntType>(i * 2 + 10));
+  }
+}
+
+TEST(VmPoolTest, TestInvoke) {
+  const auto pool = MakePool("fn(a, b) { a + b }", 2);
+  ASSERT_TRUE(pool.ok()) << pool.status();
+
+  auto f1 = (*pool)->Invoke({StrObj("a"), StrObj("b")});
+  auto f2 = (*pool)->Invoke({IntObj(1), IntObj(2)});
+  const auto r1 = f1.get();
+  const auto r2 = f2.get();
+  ASSERT_TRUE(r1.ok());
+  ASSERT_TRUE(r2.ok());
+  EXPECT_EQ(r1->Cast<StrType>(), "ab");
+  EXPECT_EQ(r2->Cast<IntType>(), 3);
+}
+
+TEST(VmPoolTest, TestErrors) {
+  EXPECT_EQ(MakePool("1", 2).status().message(),
+            "entry of vm pool must be CLOSURE, got INT");
+  EXPECT_EQ(MakePool("1 + true; fn() { 1 }", 2).status().message(),
+            "Unsupported types for binary operations: INT BOOL");
+  EXPECT_FALSE(MakePool("fn() { 1 }", 0).ok());
+
+  // An error in one call does not affect the others
+  const auto pool = MakePool("fn(x) { x + 1 }", 2);
+  ASSERT_TRUE(pool.ok()) << pool.status();
+  const std::vector<VirtualMachinePool::Args> inputs = {
+      {IntObj(1)}, {BoolObj(true)}, {IntObj(2)}};
+  const auto results = (*pool)->InvokeAll(inputs);
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_EQ(results[0]->Cast<IntType>(), 2);
+  EXPECT_EQ(results[1].status().message(),
+            "Unsupported types for binary operations: BOOL INT");
+  EXPECT_EQ(results[2]->Cast<IntType>(), 3);
+}
+
+}  // namespace
@@ -1,11 +1,16 @@
 #include "monkey/vm.h"
 
+#include <absl/strings/match.h>
 #include <absl/types/variant.h>
+#include <fmt/core.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "monkey/builtin.h"
 #include "monkey/compiler.h"
+#include "monkey/environment.h"
+#include "monkey/evaluator.h"
 #include "monkey/object.h"
 #include "monkey/parser.h"
 
@@ -39,9 +44,15 @@ Program Parse(const std::string& input) {
   return parser.ParseProgram();
 }
 
-void CheckVmError(const VmTest& test) {
+void CheckVmError(const VmTest& test,
+                  bool fold,
+                  bool optimize,
+                  bool evaluate = false) {
   const auto program = Parse(test.input);
   Compiler comp;
+  comp.SetConstantFolding(fold);
+  comp.SetOptimization(optimize);
+  if (evaluate) comp.SetEvaluator(MakeEvaluator());
   const auto bc = comp.Compile(program);
   ASSERT_TRUE(bc.ok());
 
@@ -53,9 +64,15 @@ void CheckVmError(const VmTest& test) {
   EXPECT_EQ(std::string{status.message()}, msg);
 }
 
-void CheckVm(const VmTest& test) {
+void CheckVm(const VmTest& test,
+             bool fold,
+             bool optimize,
+             bool evaluate = false) {
   const auto program = Parse(test.input);
   Compiler comp;
+  comp.SetConstantFolding(fold);
+  comp.SetOptimization(optimize);
+  if (evaluate) comp.SetEvaluator(MakeEvaluator());
   const auto bc = comp.Compile(program);
 
   ASSERT_TRUE(bc.ok()) << bc.status();
@@ -100,6 +117,47 @@ void CheckVm(const VmTest& test) {
   }
 }
 
+// Plain, folded and optimized code must agree
+void CheckVm(const VmTest& test) {
+  for (const bool optimize : {false, true}) {
+    for (const bool fold : {false, true}) {
+      SCOPED_TRACE(fmt::format("fold={} optimize={}", fold, optimize));
+      CheckVm(test, fold, optimize);
+    }
+  }
+}
+
+void CheckVmError(const VmTest& test) {
+  for (const bool optimize : {false, true}) {
+    for (const bool fold : {false, true}) {
+      SCOPED_TRACE(fmt::format("fold={} optimize={}", fold, optimize));
+      CheckVmError(test, fold, optimize);
+    }
+  }
+}
+
+// Programs compiled and run one after the other like in a repl, each ending
+// in an int
+void CheckSession(const std::vector<VmTest>& programs) {
+  for (const bool optimize : {false, true}) {
+    for (const bool fold : {false, true}) {
+      SCOPED_TRACE(fmt::format("fold={} optimize={}", fold, optimize));
+      Compiler comp;
+      comp.SetConstantFolding(fold);
+      comp.SetOptimization(optimize);
+      VirtualMachine vm;
+      for (const auto& test : programs) {
+        SCOPED_TRACE(test.input);
+        const auto bc = comp.Compile(Parse(test.input));
+        ASSERT_TRUE(bc.ok()) << bc.status();
+        const auto status = vm.Run(*bc);
+        ASSERT_TRUE(status.ok()) << status;
+        EXPECT_EQ(vm.Last(), IntObj(std::get<1>(test.value)));
+      }
+    }
+  }
+}
+
 TEST(VmTest, TestIntArithmetic) {
   const std::vector<VmTest> tests = {
       {"1", 1},
@@ -125,6 +183,18 @@ TEST(VmTest, TestIntArithmetic) {
     SCOPED_TRACE(test.input);
     CheckVm(test);
   }
+
+  // Not folded, so the vm has to check
+  const std::vector<VmTest> errors = {
+      {"10 / 0", "division by zero"s},
+      {"let z = 0; 10 / z", "division by zero"s},
+      {"let f = fn(x) { 10 / x }; f(0)", "division by zero"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
 }
 
 TEST(VmTest, TestBooleanExpression) {
@@ -187,6 +257,9 @@ TEST(VmTest, TestGlobalLetStatement) {
       {"let one = 1; one", 1},
       {"let one = 1; let two = 2; one + two", 3},
       {"let one = 1; let two = one + one; one + two", 3},
+      {"let f = fn(x) { x }; f = 5; f", 5},
+      {"let f = fn(x) { x }; let g = fn() { f(2) }; f = fn(x) { x * 3 }; g()",
+       6},
   };
 
   for (const auto& test : tests) {
@@ -195,6 +268,102 @@ TEST(VmTest, TestGlobalLetStatement) {
   }
 }
 
+TEST(VmTest, TestLoops) {
+  const std::vector<VmTest> tests = {
+      {"let i = 0; while (i < 10) { i = i + 1; }; i", 10},
+      {"let i = 0; while (false) { i = 1; }", nullptr},
+      {"let s = 0; for (let i = 1; i < 11; i = i + 1) { s = s + i; }; s", 55},
+      {"let f = fn(n) { let s = 0; for (let i = 0; i < n; i = i + 1) { "
+       "s = s + i; } s }; f(5)",
+       10},
+      {"let f = fn() { let i = 0; while (true) { if (i == 3) { return i; } "
+       "i = i + 1; } }; f()",
+       3},
+      {"let f = fn() { let i = 0; while (i < 3) { i = i + 1; } }; f()",
+       nullptr},
+      {"if (true) { let i = 0; while (i < 2) { i = i + 1; } }", nullptr},
+      {"let a = []; for (let i = 0; i < 3; i = i + 1) { a = push(a, i); }; a",
+       IntVec{0, 1, 2}},
+      {"let fib = fn(n) { let a = 0; let b = 1; "
+       "for (let i = 0; i < n; i = i + 1) { let t = a + b; a = b; b = t; } "
+       "a }; fib(20)",
+       6765},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+}
+
+// Identifiers cannot contain digits, so spell i in letters
+std::string Name(int i) {
+  std::string name = "x";
+  for (; i > 0; i /= 26) name += static_cast<char>('a' + i % 26);
+  return name;
+}
+
+TEST(VmTest, TestWideOperands) {
+  std::string array = "let a = [0";
+  for (int i = 1; i < 70000; ++i) array += fmt::format(", {}", i);
+  array += "]; len(a) + a[69999]";
+
+  std::string lets;
+  std::string sum = Name(0);
+  for (int i = 0; i < 300; ++i) {
+    lets += fmt::format("let {} = a + {}; ", Name(i), i);
+    if (i > 0) sum += " + " + Name(i);
+  }
+
+  std::string block;
+  for (int i = 0; i < 17000; ++i) block += "1; ";
+
+  const std::vector<VmTest> tests = {
+      {array, 139999},
+      {"fn(a) { " + lets +
+           fmt::format("{0} = {0} + {1}; {0} }}(1)", Name(299), Name(1)),
+       302},
+      {"fn(a) { " + lets + "fn() { " + sum + " } }(1)()", 45150},
+      {"let f = fn(x) { if (x) { " + block + "2 } else { 3 } }; "
+       "f(true) + f(false) * 10",
+       32},
+      {"let i = 0; let n = 0; while (i < 3) { i = i + 1; " + block +
+           "n = n + i; }; n",
+       6},
+  };
+
+  for (size_t i = 0; i < tests.size(); ++i) {
+    SCOPED_TRACE(i);
+    CheckVm(tests[i]);
+  }
+
+  // Compiling more than 64K globals is slow, so encode their use directly
+  Parser parser{"fn(a) { a * 2 }"};
+  Compiler compiler;
+  const auto func = compiler.Compile(parser.ParseProgram());
+  ASSERT_TRUE(func.ok()) << func.status();
+  auto consts = std::make_shared<Constants>(*func->consts);
+  const auto num_consts = static_cast<int>(consts->size());
+  consts->push_back(IntObj(21));
+
+  const auto ins = ConcatInstructions({
+      Encode(Opcode::kClosure, {num_consts - 1, 0}),
+      Encode(Opcode::kSetGlobal, 70000),
+      Encode(Opcode::kConst, num_consts),
+      Encode(Opcode::kCallGlobal, {70000, 1, 70000}),
+      Encode(Opcode::kSetGlobal, 65536),
+      Encode(Opcode::kGetGlobal, 65536),
+      Encode(Opcode::kPop),
+  });
+  EXPECT_EQ(ins.NumBytes(), 38);
+
+  const Bytecode bc{std::make_shared<Instruction>(ins), consts, func->names};
+  VirtualMachine vm;
+  const auto status = vm.Run(bc);
+  ASSERT_TRUE(status.ok()) << status;
+  EXPECT_EQ(vm.Last(), IntObj(42));
+}
+
 TEST(VmTest, TestStringExpression) {
   const std::vector<VmTest> tests = {
       {R"r("monkey")r", "monkey"s},
@@ -390,6 +559,251 @@ TEST(VmTest, TestCallFunctionWithWrongArguments) {
   }
 }
 
+TEST(VmTest, TestCallGlobal) {
+  const std::vector<VmTest> tests = {
+      {"let l = len; l([1, 2])", 2},
+      {"let f = fn(x) { x }; let g = fn() { f(2) + f(3) }; g() + g()", 10},
+      {"let f = fn(x) { if (x > 0) { f(x - 1) + 1 } else { 0 } }; f(50)", 50},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"let x = 1; x()", "calling non-function: INT"s},
+      {"let f = fn(a) { a }; f(1); f()",
+       "wrong number of arguments: want=1, got=0"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+}
+
+TEST(VmTest, TestInlining) {
+  const std::vector<VmTest> tests = {
+      {"let double = fn(x) { x * 2 }; double(3)", 6},
+      {"let f = fn(a, b) { a - b }; let g = fn(x) { f(x * 2, x) }; g(5)", 5},
+      // Locals of the inlined code are shared by both calls
+      {"let g = fn(x) { let sq = fn(y) { let z = y * y; z + 1 }; "
+       "sq(x) + sq(x + 1) }; g(2)",
+       15},
+      {"let g = fn(y) { let f = fn(x) { x = x + 1; x }; f(y) + y }; g(1)", 3},
+      {"let abs = fn(x) { if (x < 0) { -x } else { x } }; "
+       "let g = fn(a) { abs(a) + abs(0 - a) }; g(-3)",
+       6},
+      {"let f = fn() { }; let g = fn() { f() }; g()", nullptr},
+      {"let inc = fn(x) { x + 1 }; let twice = fn(x) { inc(inc(x)) }; "
+       "let h = fn(y) { twice(y) * 2 }; h(1)",
+       6},
+      {"let k = fn(x) { x }; let f = fn(x) { let y = k; y(x) + k(x) }; f(4)",
+       8},
+      // Not inlined
+      {"let f = fn(x) { x }; f = fn(x) { x + 1 }; f(1)", 2},
+      {"let f = fn(x) { if (x > 0) { return x; } 0 }; f(3)", 3},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"let f = fn(x) { x }; let g = fn() { f(1, 2) }; g()",
+       "wrong number of arguments: want=1, got=2"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+}
+
+TEST(VmTest, TestLambdaLifting) {
+  const std::vector<VmTest> tests = {
+      {"let f = fn(a) { let g = fn(x) { x + a }; g(1) + g(2) }; f(10)", 23},
+      {"let f = fn(a) { let b = a * 2; let g = fn() { a + b }; g() }; f(1)", 3},
+      // A free variable of the enclosing function
+      {"let f = fn(a) { fn() { let g = fn(x) { x * a }; g(3) } }; f(2)()", 6},
+      // Not lifted, the closure keeps the value it captured
+      {"let f = fn(a) { let g = fn() { a }; a = 5; g() }; f(1)", 1},
+      {"let f = fn(a) { let g = fn() { a }; let h = g; h() }; f(1)", 1},
+      {"let f = fn() { let g = fn() { 1 }; [g][0]() }; f()", 1},
+      // A later let of a variable the literal reads does not change it
+      {"let t = fn(a) { let f = fn() { a }; let a = 2; f() }; t(1)", 1},
+      {"let t = fn() { let a = 1; let f = fn() { a }; let a = 2; f() }; t()",
+       1},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  // Lifted literals call their constant, the others their own closure
+  const std::vector<VmTest> recursive = {
+      {"let map = fn(arr, f) { "
+       "  let iter = fn(arr, acc) { "
+       "    if (len(arr) == 0) { acc } "
+       "    else { iter(rest(arr), push(acc, f(first(arr)))) } "
+       "  }; "
+       "  iter(arr, []) "
+       "}; "
+       "map([1, 2, 3], fn(x) { x * 2 })",
+       IntVec{2, 4, 6}},
+      {"let sum = fn(n) { "
+       "  let go = fn(i, acc) { "
+       "    if (i > n) { acc } else { go(i + 1, acc + i) } "
+       "  }; "
+       "  go(1, 0) "
+       "}; "
+       "sum(10)",
+       55},
+      {"let f = fn() { "
+       "  let g = fn(n) { if (n == 0) { 0 } else { n + g(n - 1) } }; "
+       "  g "
+       "}; "
+       "f()(3)",
+       6},
+      {"let f = fn() { "
+       "  let g = fn(n) { "
+       "    let h = fn() { g(n - 1) }; "
+       "    if (n == 0) { 0 } else { 1 + h() } "
+       "  }; "
+       "  g(3) "
+       "}; "
+       "f()",
+       3},
+      // Params and locals of the same name shadow it
+      {"let f = fn() { let g = fn(g) { g }; g(5) }; f()", 5},
+      {"let f = fn() { let g = fn() { let g = 7; g }; g() }; f()", 7},
+  };
+
+  for (const auto& test : recursive) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  // The arguments of a lifted call are checked the same
+  CheckVmError({"let f = fn() { let g = fn(x) { x }; g(1, 2) }; f()",
+                "wrong number of arguments: want=1, got=2"s});
+}
+
+TEST(VmTest, TestSpecializeTypes) {
+  const std::vector<VmTest> tests = {
+      {"let f = fn() { let i = 0; let s = 0; "
+       "while (i < 10) { s = s + i * i; i = i + 1; } s }; f()",
+       285},
+      {"let f = fn(n) { let a = 1; while (n > a) { a = a * 2; } a - 1 }; "
+       "f(100)",
+       127},
+      {"let f = fn() { let a = 3; let b = 0 - a; if (a != b) { b } }; f()",
+       -3},
+      {"let f = fn(n) { let a = 5; if (n == a) { a } else { a - n } }; f(2)",
+       3},
+      {"let f = fn(n) { let a = 4; while (n > 0) { a = a / 2; n = n - 1; } "
+       "a + 1 }; f(2)",
+       2},
+      // Not an int on every path
+      {"let f = fn(n) { let a = 1; while (n > 0) { a = \"a\"; n = n - 1; } "
+       "a }; f(1)",
+       "a"s},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  // Only operands known to be ints are specialized, the rest are checked
+  CheckVmError({"let f = fn(x) { let a = 1; a + x }; f(\"a\")",
+                "Unsupported types for binary operations: INT STR"s});
+}
+
+TEST(VmTest, TestCompileTimeEvaluation) {
+  struct EvalTest {
+    VmTest test;
+    size_t num_evaluated;
+  };
+
+  const std::vector<EvalTest> tests = {
+      {{"let sq = fn(x) { x * x }; let t = [sq(1), sq(2), sq(3)]; t",
+        IntVec{1, 4, 9}},
+       1},
+      {{"let build = fn(n) { let arr = []; let i = 0; "
+        "while (i < n) { arr = push(arr, i * i); i = i + 1; } arr }; "
+        "let t = build(4); t",
+        IntVec{0, 1, 4, 9}},
+       1},
+      {{"let fib = fn(n) { if (n < 2) { n } else { fib(n - 1) + fib(n - 2) } "
+        "}; let n = 5; let f = fib(n + 5); let g = f * 2; g",
+        110},
+       2},
+      {{"let d = {1: len(\"ab\"), 2: first([3])}; d", IntDict{{1, 2}, {2, 3}}},
+       1},
+      // Impure
+      {{"let f = fn() { puts(1) }; let v = f(); v", nullptr}, 0},
+      // Only the value before the assignment is known
+      {{"let a = [1]; a = [2]; let b = push(a, 3); b", IntVec{2, 3}}, 1},
+      // Not plain data
+      {{"let k = fn(x) { fn() { x } }; let g = k(1); g()", 1}, 0},
+      // Fails, which is left for the code to report when it runs
+      {{"let f = fn(x) { x + 1 }; let y = f(true); y",
+        "Unsupported types for binary operations: BOOL INT"s},
+       0},
+  };
+
+  for (const auto& [test, num_evaluated] : tests) {
+    SCOPED_TRACE(test.input);
+    Compiler comp;
+    comp.SetEvaluator(MakeEvaluator());
+    const auto bc = comp.Compile(Parse(test.input));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    EXPECT_EQ(comp.num_evaluated(), num_evaluated);
+
+    for (const bool optimize : {false, true}) {
+      for (const bool fold : {false, true}) {
+        SCOPED_TRACE(fmt::format("fold={} optimize={}", fold, optimize));
+        if (absl::holds_alternative<std::string>(test.value)) {
+          CheckVmError(test, fold, optimize, true);
+        } else {
+          CheckVm(test, fold, optimize, true);
+        }
+      }
+    }
+  }
+
+  // Code that runs out of budget keeps running when the program does
+  Compiler comp;
+  comp.SetEvaluator(MakeEvaluator(100));
+  const auto bc = comp.Compile(
+      Parse("let f = fn(n) { if (n == 0) { 0 } else { f(n - 1) } }; "
+            "let v = f(1000); v"));
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  EXPECT_EQ(comp.num_evaluated(), 0);
+  VirtualMachine vm;
+  ASSERT_TRUE(vm.Run(*bc).ok());
+  EXPECT_EQ(vm.Last(), IntObj(0));
+}
+
+TEST(VmTest, TestCallGlobalCacheInvalidation) {
+  // Both compilers put their first call site in slot 0 and their first global
+  // in index 0, setting the global must invalidate the cached callee
+  VirtualMachine vm;
+  for (const auto* input : {"let f = fn(x) { x }; f(7)",
+                            "let g = fn(x) { x * 10 }; g(7)"}) {
+    Compiler comp;
+    comp.SetOptimization(false);  // keep the calls
+    const auto bc = comp.Compile(Parse(input));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    ASSERT_TRUE(vm.Run(*bc).ok());
+  }
+  EXPECT_EQ(vm.Last().Cast<IntType>(), 70);
+}
+
 TEST(VmTest, TestBuiltinFunctions) {
   const std::vector<VmTest> tests = {
       {R"r(len(""))r", 0},
@@ -426,6 +840,234 @@ TEST(VmTest, TestBuiltinFunctions) {
   }
 }
 
+void RegisterTestBuiltins() {
+  Register("clamp", [](IntType x, IntType lo, IntType hi) -> IntType {
+    return std::min(std::max(x, lo), hi);
+  });
+  Register("repeat", [](const StrType& str, IntType n) {
+    StrType out;
+    for (IntType i = 0; i < n; ++i) out += str;
+    return out;
+  });
+  Register("is_empty", [](const Array& arr) { return arr.empty(); });
+  Register("type_of", [](const Object& obj) { return Repr(obj.Type()); });
+  Register("nothing", []() {});
+}
+
+TEST(VmTest, TestRegisteredBuiltins) {
+  static const auto once = (RegisterTestBuiltins(), true);
+  EXPECT_TRUE(once);
+  EXPECT_GE(FindBuiltin("clamp"), static_cast<int>(Builtin::kNumBuiltins));
+  EXPECT_EQ(FindBuiltin("unknown"), -1);
+
+  const std::vector<VmTest> tests = {
+      {"clamp(15, 0, 10)", 10},
+      {"clamp(-5, 0, 10)", 0},
+      {"let f = fn(x) { clamp(x, 1, 3) }; f(2)", 2},
+      {R"r(repeat("ab", 3))r", "ababab"s},
+      {"is_empty([])", true},
+      {"is_empty([1])", false},
+      {"type_of([1])", "ARRAY"s},
+      {"nothing()", nullptr},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"clamp(1, 2)", "wrong number of arguments. got=2, want=3"s},
+      {"clamp(1, true, 3)", "argument 2 to `clamp` must be INT, got BOOL"s},
+      {R"r(repeat(1, "a"))r", "argument 1 to `repeat` must be STR, got INT"s},
+      {"nothing(1)", "wrong number of arguments. got=1, want=0"s},
+      {"map([1, 5], clamp)", "wrong number of arguments. got=1, want=3"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+}
+
+TEST(VmTest, TestHigherOrderBuiltins) {
+  const std::vector<VmTest> tests = {
+      {"map([1, 2, 3], fn(x) { x * 2 })", IntVec{2, 4, 6}},
+      {"filter([1, 2, 3, 4], fn(x) { x > 2 })", IntVec{3, 4}},
+      {"reduce([1, 2, 3, 4], 0, fn(acc, x) { acc + x })", 10},
+      {"each([1, 2], fn(x) { x })", nullptr},
+      {"sort_by([3, 1, 2], fn(x) { x })", IntVec{1, 2, 3}},
+      {"sort_by([1, 2, 3, 4], fn(x) { 0 - x })", IntVec{4, 3, 2, 1}},
+      {"map([[1], [1, 2]], len)", IntVec{1, 2}},
+      // Closures with free variables and nested higher-order calls
+      {"let k = fn(a) { fn(x) { x + a } }; map([1, 2], k(10))", IntVec{11, 12}},
+      {"map([[1, 2], [3]], fn(a) { reduce(map(a, fn(x) { x * x }), 0, "
+       "fn(s, x) { s + x }) })",
+       IntVec{5, 9}},
+      {"let f = fn(n) { map([n], fn(x) { x + 1 })[0] }; f(1) + f(2)", 5},
+      // Parallel versions see globals and free variables of the caller
+      {"let k = 3; pmap([1, 2, 3], fn(x) { x * k })", IntVec{3, 6, 9}},
+      {"let f = fn(a) { fn(x) { x + a } }; pmap([1, 2], f(10))",
+       IntVec{11, 12}},
+      {"preduce([1, 2, 3, 4], 10, fn(a, b) { a + b })", 20},
+      {"preduce([], 10, fn(a, b) { a + b })", 10},
+      {"pmap([[1, 2], [3]], fn(a) { preduce(a, 0, fn(s, x) { s + x }) })",
+       IntVec{3, 3}},
+      {"let build = fn(n, acc) { if (n == 0) { acc } else { build(n - 1, "
+       "push(acc, n)) } }; preduce(pmap(build(200, []), fn(x) { x * 2 }), 0, "
+       "fn(a, b) { a + b })",
+       40200},
+      // Generators and channels are not shared between threads, calls that
+      // use them run in order
+      {"let g = generator(fn() { yield 1; yield 2; yield 3 }); "
+       "pmap([g, g, g], fn(x) { next(x) })",
+       IntVec{1, 2, 3}},
+      {"let f = fn() { let c = chan(); send(c, 1); send(c, 2); "
+       "pmap([10, 20], fn(x) { x + recv(c) }) }; f()",
+       IntVec{11, 22}},
+      {"let g = generator(fn() { yield 1; yield 2; yield 3 }); "
+       "pmap([10, 20, 30], fn(x) { x * next(g) })",
+       IntVec{10, 40, 90}},
+      {"let f = fn(c) { preduce([1, 2, 3, 4], 0, fn(a, b) { a + b * recv(c) "
+       "}) }; let c = chan(); map([1, 2, 3, 4, 5, 6, 7], fn(x) { send(c, 1) "
+       "}); f(c)",
+       10},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"map(1, fn(x) { x })", "argument to `map` must be ARRAY, got INT"s},
+      {"map([1], fn(x, y) { x })", "wrong number of arguments: want=2, got=1"s},
+      {"map([1], 1)", "calling non-closure: INT"s},
+      {"pmap([1, 2, true, false], fn(x) { x + 1 })",
+       "Unsupported types for binary operations: BOOL INT"s},
+      {"preduce(1, 0, fn(a, b) { a })",
+       "argument to `preduce` must be ARRAY, got INT"s},
+      {"pmap([1, 2], fn(x) { spawn(fn() { x }) })",
+       "`spawn` is not supported in parallel tasks"s},
+      {"sort_by([1, 2], fn(x) { [x] })",
+       "key of `sort_by` must be INT or STR, got ARRAY"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+}
+
+TEST(VmTest, TestGenerators) {
+  const std::vector<VmTest> tests = {
+      {"let g = generator(fn() { yield 1; yield 2; 3 }); collect(g)",
+       IntVec{1, 2}},
+      {"let g = generator(fn() { yield 1 }); next(g) + next(g, 10)", 11},
+      {"let g = generator(fn() { yield 1 }); next(g); next(g)", nullptr},
+      {"let g = generator(fn() { yield 1 }); collect(g); collect(g)",
+       IntVec{}},
+      // Locals and pending operands survive a yield
+      {"let g = generator(fn() { let a = 1; yield a; let b = a + 1; yield b; "
+       "yield a + b }); collect(g)",
+       IntVec{1, 2, 3}},
+      {"let g = generator(fn() { yield len([1, yield 2, 3]) }); collect(g)",
+       IntVec{2, 3}},
+      // Yield from a function called by the generator, infinite sequence
+      {"let count = fn(n) { yield n; count(n + 1) }; "
+       "let g = generator(fn() { count(0) }); take(g, 3); take(g, 2)",
+       IntVec{3, 4}},
+      {"let inner = generator(fn() { yield 1; yield 2 }); "
+       "let outer = generator(fn() { yield next(inner) * 10; "
+       "yield next(inner) * 10 }); collect(outer)",
+       IntVec{10, 20}},
+      {"let g = generator(fn() { yield 1; yield 2; yield 3 }); "
+       "map(take(g, 2), fn(x) { x * x })",
+       IntVec{1, 4}},
+      // A global assigned while the generator is suspended keeps its copy
+      {"let x = 1; let g = generator(fn() { let a = x; yield 0; yield a; }); "
+       "next(g); x = 2; next(g)",
+       1},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"yield 1", "yield outside of generator"s},
+      {"let f = fn() { yield 1 }; f()", "yield outside of generator"s},
+      {"next(generator(fn() { each([1], fn(x) { yield x }) }))",
+       "cannot yield across a native call"s},
+      {"next(generator(fn(x) { yield x }))",
+       "wrong number of arguments: want=1, got=0"s},
+      {"let g = generator(fn() { next(g) }); next(g)",
+       "generator is already running"s},
+      {"next(1)", "argument to `next` must be GENERATOR, got INT"s},
+      {"generator(1)", "argument to `generator` must be a function, got INT"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+}
+
+TEST(VmTest, TestTasks) {
+  const std::vector<VmTest> tests = {
+      {"let c = chan(); spawn(fn() { send(c, 1) }); recv(c)", 1},
+      {"let c = chan(); send(c, 1); send(c, 2); [recv(c), recv(c)]",
+       IntVec{1, 2}},
+      // Producer blocks on the full channel until main receives
+      {"let c = chan(1); let p = fn(n) { if (n > 0) { send(c, n); p(n - 1) } };"
+       "spawn(fn() { p(3) }); [recv(c), recv(c), recv(c)]",
+       IntVec{3, 2, 1}},
+      // A long running task is preempted, so the short one sends first
+      {"let c = chan(); let f = fn(x) { if (x < 2) { x } else { f(x - 1) + "
+       "f(x - 2) } }; spawn(fn() { send(c, f(15)) }); spawn(fn() { send(c, 1) "
+       "}); [recv(c), recv(c)]",
+       IntVec{1, 610}},
+      {"let c = chan(); let s = fn(n) { if (n > 0) { spawn(fn() { send(c, n) "
+       "}); s(n - 1) } }; s(1000); let r = fn(n, acc) { if (n == 0) { acc } "
+       "else { r(n - 1, acc + recv(c)) } }; r(1000, 0)",
+       500500},
+      // Same for a task blocked in recv
+      {"let x = 1; let c = chan(); let d = chan(); spawn(fn() { let a = x; "
+       "send(d, 0); recv(c); send(d, a) }); recv(d); x = 2; send(c, 0); "
+       "recv(d)",
+       1},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+  }
+
+  const std::vector<VmTest> errors = {
+      {"recv(chan())", "deadlock: all tasks are blocked"s},
+      {"let c = chan(); spawn(fn() { recv(c) }); recv(c)",
+       "deadlock: all tasks are blocked"s},
+      {"spawn(fn() { 1 + true }); recv(chan())",
+       "Unsupported types for binary operations: INT BOOL"s},
+      {"map([chan()], recv)", "`recv` on empty channel would block"s},
+      {"spawn(fn(x) { x })", "wrong number of arguments: want=1, got=0"s},
+      {"spawn(1)", "argument to `spawn` must be a function, got INT"s},
+      {"chan(0)", "argument to `chan` must be a positive INT, got 0"s},
+      {"send(1, 1)", "argument to `send` must be CHANNEL, got INT"s},
+  };
+
+  for (const auto& test : errors) {
+    SCOPED_TRACE(test.input);
+    CheckVmError(test);
+  }
+
+  // A function of the evaluator has no code the vm could run
+  VirtualMachine vm;
+  EXPECT_EQ(vm.Spawn(FuncObj({})),
+            ErrorObj("argument to `spawn` must be CLOSURE, got FUNC"));
+}
+
 TEST(VmTest, TestClosure) {
   const std::vector<VmTest> tests = {
       {R"r(let newClosure = fn(a) {
@@ -484,6 +1126,28 @@ TEST(VmTest, TestClosure) {
   }
 }
 
+TEST(VmTest, TestSameAsEvaluator) {
+  const std::vector<VmTest> tests = {
+      // Globals are shared, locals are captured by value
+      {"let a = 1; let f = fn() { a }; a = 2; f()", 2},
+      {"let a = 1; let f = fn() { a }; let g = fn() { f() + a }; a = 2; g()",
+       4},
+      {"let g = fn() { let b = 1; let f = fn() { b }; b = 2; f() }; g()", 1},
+      {"let f = fn(x) { if (x < 2) { x } else { f(x - 1) + f(x - 2) } }; f(10)",
+       55},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    CheckVm(test);
+
+    Evaluator eval;
+    Environment env;
+    EXPECT_EQ(eval.Evaluate(Parse(test.input), env),
+              IntObj(std::get<1>(test.value)));
+  }
+}
+
 TEST(VmTest, TestRecursiveFibonacci) {
   const std::string fib_code = R"r(
     let fibonacci = fn(x) {
@@ -511,4 +1175,268 @@ TEST(VmTest, TestRecursiveFibonacci) {
   }
 }
 
+TEST(VmTest, TestRepeatedRun) {
+  Compiler comp;
+  VirtualMachine vm;
+
+  const std::vector<VmTest> tests = {
+      {"let f = fn(x) { x + 1 }; f(1);", 2},
+      {"let g = fn() { f(10) + 100 }; g();", 111},
+      {R"r(f(g()) + len("abc"))r", 115},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    const auto bc = comp.Compile(Parse(test.input));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    const auto status = vm.Run(*bc);
+    ASSERT_TRUE(status.ok()) << status;
+    EXPECT_EQ(vm.Last(), IntObj(std::get<1>(test.value)));
+  }
+
+  // A function compiled earlier calls the function assigned later
+  CheckSession({{"let sq = fn(x) { x }; let g = fn(y) { sq(y) }; g(3)", 3},
+                {"sq = fn(x) { x * x }; g(3)", 9},
+                {"sq(4)", 16}});
+
+  // A function compiled earlier sees a global assigned later
+  CheckSession({{"let a = 1; let f = fn() { a + 1 }; f()", 2},
+                {"a = 5; f()", 6},
+                {"a", 5}});
+
+  // Tasks still queued when the main program ends are dropped
+  const auto spawned =
+      Compiler{}.Compile(Parse("spawn(fn() { 1 + true }); 1"));
+  ASSERT_TRUE(spawned.ok()) << spawned.status();
+  ASSERT_TRUE(vm.Run(*spawned).ok());
+  const auto blocked = Compiler{}.Compile(Parse("recv(chan())"));
+  ASSERT_TRUE(blocked.ok()) << blocked.status();
+  EXPECT_EQ(vm.Run(*blocked).message(), "deadlock: all tasks are blocked");
+}
+
+TEST(VmTest, TestBudget) {
+  const std::vector<VmTest> tests = {
+      {"let f = fn(x) { if (x < 2) { x } else { f(x - 1) + f(x - 2) } }; "
+       "f(15)",
+       610},
+      // Native callbacks finish before the run is suspended
+      {"let f = fn(x) { if (x < 2) { x } else { f(x - 1) + f(x - 2) } }; "
+       "reduce(map([10, 11], f), 0, fn(a, b) { a + b })",
+       144},
+      {"let c = chan(); let f = fn(x) { if (x < 2) { x } else { f(x - 1) + "
+       "f(x - 2) } }; spawn(fn() { send(c, f(12)) }); recv(c) + f(10)",
+       199},
+  };
+
+  for (const auto& test : tests) {
+    SCOPED_TRACE(test.input);
+    Compiler comp;
+    const auto bc = comp.Compile(Parse(test.input));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+
+    VirtualMachine vm;
+    int suspended = 0;
+    auto status = vm.Run(*bc, 100);
+    while (IsSuspended(status)) {
+      ASSERT_TRUE(vm.IsSuspended());
+      ++suspended;
+      status = vm.Continue(100);
+    }
+    ASSERT_TRUE(status.ok()) << status;
+    EXPECT_FALSE(vm.IsSuspended());
+    EXPECT_GT(suspended, 0);
+    EXPECT_EQ(vm.Last(), IntObj(std::get<1>(test.value)));
+  }
+}
+
+TEST(VmTest, TestBudgetErrors) {
+  Compiler comp;
+  VirtualMachine vm;
+  EXPECT_EQ(vm.Continue().message(), "no suspended run to continue");
+
+  const auto bc = comp.Compile(Parse("let f = fn(x) { f(x) }; f(1)"));
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  EXPECT_TRUE(IsSuspended(vm.Run(*bc, 10)));
+  EXPECT_EQ(vm.Run(*bc).message(), "a suspended run must be continued");
+  EXPECT_TRUE(IsSuspended(vm.Continue(1)));
+  EXPECT_TRUE(vm.IsSuspended());
+}
+
+TEST(VmTest, TestCallFunction) {
+  Compiler comp;
+  VirtualMachine vm;
+  EXPECT_EQ(vm.CallFunction("score", {}).status().message(),
+            "no bytecode has been run");
+
+  const auto bc = comp.Compile(Parse(
+      "let k = 10; let score = fn(x, y) { x * y + k }; let add = fn(a) { "
+      "fn(b) { a + b } }; let inc = add(1);"));
+  ASSERT_TRUE(bc.ok()) << bc.status();
+  ASSERT_TRUE(vm.Run(*bc).ok());
+
+  for (int i = 0; i < 10; ++i) {
+    const auto res = vm.CallFunction("score", {IntObj(i), IntObj(2)});
+    ASSERT_TRUE(res.ok()) << res.status();
+    EXPECT_EQ(res->Cast<IntType>(), i * 2 + 10);
+  }
+
+  const auto res = vm.CallFunction("inc", {IntObj(41)});
+  ASSERT_TRUE(res.ok()) << res.status();
+  EXPECT_EQ(res->Cast<IntType>(), 42);
+
+  // Globals are numbered in order of definition
+  const auto by_index = vm.CallFunction(size_t{1}, {IntObj(1), IntObj(1)});
+  ASSERT_TRUE(by_index.ok()) << by_index.status();
+  EXPECT_EQ(by_index->Cast<IntType>(), 11);
+
+  EXPECT_EQ(vm.CallFunction("nope", {}).status().message(),
+            "undefined function: nope");
+  EXPECT_EQ(vm.CallFunction(size_t{9}, {}).status().message(),
+            "undefined global: 9");
+  EXPECT_EQ(vm.CallFunction("k", {}).status().message(),
+            "calling non-closure: INT");
+  EXPECT_EQ(vm.CallFunction("score", {IntObj(1)}).status().message(),
+            "wrong number of arguments: want=2, got=1");
+  EXPECT_EQ(vm.CallFunction("score", {IntObj(1), BoolObj(true)})
+                .status()
+                .message(),
+            "Unsupported types for binary operations: INT BOOL");
+
+  // A failed call leaves the vm usable
+  const auto after = vm.CallFunction("score", {IntObj(1), IntObj(1)});
+  ASSERT_TRUE(after.ok()) << after.status();
+  EXPECT_EQ(after->Cast<IntType>(), 11);
+}
+
+TEST(VmTest, TestMemo) {
+  Compiler comp;
+  const auto bc = comp.Compile(Parse(R"r(
+      let fib = fn(x) { if (x < 2) { x } else { fib(x - 1) + fib(x - 2) } };
+      let log = fn(x) { puts(x); x };
+      let sum = fn(a) {
+        if (len(a) == 0) { 0 } else { first(a) + sum(rest(a)) }
+      };
+      )r"));
+  ASSERT_TRUE(bc.ok()) << bc.status();
+
+  VirtualMachine vm;
+  vm.SetMemoCapacity(100);
+  ASSERT_TRUE(vm.Run(*bc).ok());
+
+  // Each argument misses once, the second recursive call always hits
+  const auto res = vm.CallFunction("fib", {IntObj(60)});
+  ASSERT_TRUE(res.ok()) << res.status();
+  EXPECT_EQ(res->Cast<IntType>(), 1548008755920);
+  EXPECT_EQ(vm.memo_stats().misses, 61);
+  EXPECT_EQ(vm.memo_stats().hits, 58);
+
+  ASSERT_TRUE(vm.CallFunction("fib", {IntObj(60)}).ok());
+  EXPECT_EQ(vm.memo_stats().hits, 59);
+
+  // Impure functions and unhashable arguments are not cached
+  ASSERT_TRUE(vm.CallFunction("log", {IntObj(1)}).ok());
+  const auto sum = vm.CallFunction("sum", {ArrayObj({IntObj(1), IntObj(2)})});
+  ASSERT_TRUE(sum.ok()) << sum.status();
+  EXPECT_EQ(sum->Cast<IntType>(), 3);
+  EXPECT_EQ(vm.memo_stats().misses, 61);
+  EXPECT_EQ(vm.memo_stats().hits, 59);
+
+  // A tiny table evicts all the time but still gives the right answer
+  vm.SetMemoCapacity(1);
+  const auto small = vm.CallFunction("fib", {IntObj(15)});
+  ASSERT_TRUE(small.ok()) << small.status();
+  EXPECT_EQ(small->Cast<IntType>(), 610);
+
+  // g was compiled as pure, but calls whatever a later program binds to id
+  vm.SetMemoCapacity(100);
+  comp.SetOptimization(false);  // keep the calls
+  for (const auto* input : {"let id = fn(x) { x }; let g = fn(x) { id(x) };",
+                            "g(1); g(1);",
+                            "id = fn(x) { puts(x); x }; g(1); g(1);"}) {
+    const auto more = comp.Compile(Parse(input));
+    ASSERT_TRUE(more.ok()) << more.status();
+    ASSERT_TRUE(vm.Run(*more).ok());
+  }
+  EXPECT_EQ(vm.memo_stats().hits, 60);
+
+  vm.Reset();
+  EXPECT_EQ(vm.memo_stats().hits, 0);
+  EXPECT_EQ(vm.memo_stats().misses, 0);
+}
+
+TEST(VmTest, TestReset) {
+  Compiler comp;
+  const auto first = comp.Compile(Parse(
+      "let a = [1, 2, 3]; let f = fn(x) { f(x) }; spawn(fn() { a }); f(1)"));
+  ASSERT_TRUE(first.ok()) << first.status();
+
+  VirtualMachine vm;
+  vm.SetMemoryQuota(1 << 20);
+  EXPECT_TRUE(IsSuspended(vm.Run(*first, 100)));
+  ASSERT_GT(vm.MemoryUsage().live, 0);
+
+  vm.Reset();
+  EXPECT_FALSE(vm.IsSuspended());
+  EXPECT_EQ(vm.Last().Type(), ObjectType::kInvalid);
+  EXPECT_EQ(vm.MemoryQuota(), 1 << 20);
+  const auto stats = vm.MemoryUsage();
+  EXPECT_EQ(stats.allocated, 0);
+  EXPECT_EQ(stats.peak, stats.live);
+
+  // Serving the same script again leaves nothing behind
+  size_t live = 0;
+  for (int i = 0; i < 3; ++i) {
+    Compiler other;
+    const auto bc = other.Compile(Parse("let b = 2; b * 21"));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+    ASSERT_TRUE(vm.Rebind(*bc).ok());
+    EXPECT_EQ(vm.Last().Cast<IntType>(), 42);
+    if (i == 0) live = vm.MemoryUsage().live;
+    EXPECT_EQ(vm.MemoryUsage().live, live);
+  }
+}
+
+TEST(VmTest, TestMemoryQuota) {
+  const std::vector<std::string> inputs = {
+      "let f = fn(a) { f(push(a, 1)) }; f([])",
+      "let f = fn(s) { f(s + s) }; f(\"ab\")",
+      "let f = fn(x) { f(x) }; f(1)",
+      "let f = fn(x) { let g = fn() { x }; f(g) }; f(1)",
+  };
+
+  for (const auto& input : inputs) {
+    SCOPED_TRACE(input);
+    Compiler comp;
+    const auto bc = comp.Compile(Parse(input));
+    ASSERT_TRUE(bc.ok()) << bc.status();
+
+    VirtualMachine vm;
+    vm.SetMemoryQuota(1 << 20);
+    const auto status = vm.Run(*bc);
+    EXPECT_TRUE(absl::StartsWith(status.message(), "memory quota exceeded"))
+        << status;
+
+    // Values of the failed run are released and the vm stays usable
+    EXPECT_LT(vm.MemoryUsage().live, vm.MemoryQuota());
+    const auto ok = comp.Compile(Parse("len([1, 2, 3])"));
+    ASSERT_TRUE(ok.ok()) << ok.status();
+    ASSERT_TRUE(vm.Run(*ok).ok());
+    EXPECT_EQ(vm.Last().Cast<IntType>(), 3);
+  }
+}
+
+TEST(VmTest, TestMemoryUsage) {
+  Compiler comp;
+  const auto bc = comp.Compile(Parse("let a = [\"abc\", [1, 2]]; a"));
+  ASSERT_TRUE(bc.ok()) << bc.status();
+
+  VirtualMachine vm;
+  ASSERT_TRUE(vm.Run(*bc).ok());
+  const auto stats = vm.MemoryUsage();
+  const auto array_bytes = ObjectBytes(vm.Last());
+  EXPECT_GE(stats.live, 2 * array_bytes);  // global and stack
+  EXPECT_GE(stats.peak, stats.live);
+  EXPECT_GE(stats.allocated, array_bytes);
+}
+
 }  // namespace